@@ -142,6 +142,13 @@ String buffer_get_line(Buffer buffer, Integer index, Error *err)
 ///               - buffer handle
 ///             - utf_sizes: include UTF-32 and UTF-16 size of the replaced
 ///               region, as args to `on_lines`.
+///             - coalesce: merge the changes made before Nvim next processes
+///               events (e.g. by a whole macro or |:substitute|) into a
+///               single `nvim_buf_lines_event` covering all the lines they
+///               touched. Not for Lua callbacks.
+///             - bytes: send `nvim_buf_bytes_event` with the byte range
+///               and inserted text of each change, instead of
+///               `nvim_buf_lines_event`. Not for Lua callbacks.
 /// @param[out] err Error details, if any
 /// @return False if attach failed (invalid parameter, or buffer isn't loaded);
 ///         otherwise True. TODO: LUA_API_NO_EVAL
@@ -198,12 +205,30 @@ Boolean nvim_buf_attach(uint64_t channel_id,
         goto error;
       }
       cb.utf_sizes = v->data.boolean;
+    } else if (!is_lua && strequal("coalesce", k.data)) {
+      if (v->type != kObjectTypeBoolean) {
+        api_set_error(err, kErrorTypeValidation, "coalesce must be boolean");
+        goto error;
+      }
+      cb.coalesce = v->data.boolean;
+    } else if (!is_lua && strequal("bytes", k.data)) {
+      if (v->type != kObjectTypeBoolean) {
+        api_set_error(err, kErrorTypeValidation, "bytes must be boolean");
+        goto error;
+      }
+      cb.bytes = v->data.boolean;
     } else {
       api_set_error(err, kErrorTypeValidation, "unexpected key: %s", k.data);
       goto error;
     }
   }
 
+  if (cb.coalesce && cb.bytes) {
+    api_set_error(err, kErrorTypeValidation,
+                  "coalesce and bytes cannot be used together");
+    goto error;
+  }
+
   return buf_updates_register(buf, channel_id, cb, send_buffer);
 
 error:
@@ -621,23 +646,33 @@ void nvim_buf_set_lines(uint64_t channel_id,
   }
 
   // Now we may need to insert the remaining new old_len
-  for (size_t i = to_replace; i < new_len; i++) {
-    int64_t lnum = start + (int64_t)i - 1;
+  if (to_replace < new_len) {
+    size_t to_append = new_len - to_replace;
+    int64_t lnum = start + (int64_t)to_replace - 1;
 
-    if (lnum >= MAXLNUM) {
+    if (lnum + (int64_t)to_append > MAXLNUM) {
       api_set_error(err, kErrorTypeValidation, "Index value is too high");
       goto end;
     }
 
-    if (ml_append((linenr_T)lnum, (char_u *)lines[i], 0, false) == FAIL) {
+    colnr_T *lens = xmalloc(to_append * sizeof(colnr_T));
+    for (size_t i = 0; i < to_append; i++) {
+      lens[i] = (colnr_T)replacement.items[to_replace + i].data.string.size + 1;
+    }
+    int ok = ml_append_lines((linenr_T)lnum, (char_u **)lines + to_replace,
+                             lens, (long)to_append, false);
+    xfree(lens);
+    if (ok == FAIL) {
       api_set_error(err, kErrorTypeException, "Failed to insert line");
       goto end;
     }
 
     // Same as with replacing, but we also need to free lines
-    xfree(lines[i]);
-    lines[i] = NULL;
-    extra++;
+    for (size_t i = to_replace; i < new_len; i++) {
+      xfree(lines[i]);
+      lines[i] = NULL;
+    }
+    extra += (ptrdiff_t)to_append;
   }
 
   // Adjust marks. Invalidate any which lie in the
@@ -1318,6 +1353,131 @@ Integer nvim_buf_set_extmark(Buffer buffer, Integer ns_id, Integer id,
   return (Integer)id_num;
 }
 
+/// Creates many extmarks at once, optionally highlighting their ranges.
+///
+/// Much faster than calling |nvim_buf_set_extmark()| or
+/// |nvim_buf_add_highlight()| for each mark, in particular when the
+/// namespace is (or is cleared to be) empty.
+///
+/// @param buffer  Buffer handle, or 0 for current buffer
+/// @param ns_id  Namespace id from |nvim_create_namespace()|
+/// @param positions  Flat list of four integers per mark: line, col, end_line
+///                   and end_col. An end_line of -1 creates a mark without
+///                   a range. A col of -1 means the end of the line.
+/// @param opts  Optional parameters. Keys:
+///          - hl_group: Name of the highlight group of the ranges
+///          - clear: Clear the namespace in the whole buffer first
+/// @param[out]  err   Error details, if any
+/// @return List of the ids of the created extmarks, in the order of
+///         `positions`
+ArrayOf(Integer) nvim_buf_set_extmarks(Buffer buffer, Integer ns_id,
+                                       Array positions, Dictionary opts,
+                                       Error *err)
+  FUNC_API_SINCE(7)
+{
+  Array rv = ARRAY_DICT_INIT;
+
+  buf_T *buf = find_buffer_by_handle(buffer, err);
+  if (!buf) {
+    return rv;
+  }
+
+  if (!ns_initialized((uint64_t)ns_id)) {
+    api_set_error(err, kErrorTypeValidation, _("Invalid ns_id"));
+    return rv;
+  }
+
+  int hl_id = 0;
+  bool clear = false;
+  for (size_t i = 0; i < opts.size; i++) {
+    String k = opts.items[i].key;
+    Object *v = &opts.items[i].value;
+    if (strequal("hl_group", k.data)) {
+      if (v->type != kObjectTypeString) {
+        api_set_error(err, kErrorTypeValidation, "hl_group is not a String");
+        return rv;
+      }
+      if (v->data.string.size > 0) {
+        hl_id = syn_check_group((char_u *)v->data.string.data,
+                                (int)v->data.string.size);
+      }
+    } else if (strequal("clear", k.data)) {
+      if (v->type != kObjectTypeBoolean) {
+        api_set_error(err, kErrorTypeValidation, "clear is not a Boolean");
+        return rv;
+      }
+      clear = v->data.boolean;
+    } else {
+      api_set_error(err, kErrorTypeValidation, "unexpected key: %s", k.data);
+      return rv;
+    }
+  }
+
+  if (positions.size % 4 != 0) {
+    api_set_error(err, kErrorTypeValidation,
+                  "positions must have four items per mark");
+    return rv;
+  }
+
+  size_t n = positions.size / 4;
+  mtbatch_t *items = xcalloc(sizeof(*items), n);
+  for (size_t i = 0; i < n; i++) {
+    Integer pos[4];
+    for (size_t j = 0; j < 4; j++) {
+      Object *v = &positions.items[4 * i + j];
+      if (v->type != kObjectTypeInteger) {
+        api_set_error(err, kErrorTypeValidation,
+                      "positions must be Integers");
+        goto cleanup;
+      }
+      pos[j] = v->data.integer;
+    }
+    for (size_t j = 0; j < 4; j += 2) {
+      if (j == 2 && pos[2] == -1) {
+        break;
+      }
+      size_t len = 0;
+      if (pos[j] < 0 || pos[j] > buf->b_ml.ml_line_count) {
+        api_set_error(err, kErrorTypeValidation, "line value outside range");
+        goto cleanup;
+      } else if (pos[j] < buf->b_ml.ml_line_count) {
+        len = STRLEN(ml_get_buf(buf, (linenr_T)pos[j]+1, false));
+      }
+      if (pos[j+1] == -1) {
+        pos[j+1] = (Integer)len;
+      } else if (pos[j+1] < -1 || pos[j+1] > (Integer)len) {
+        api_set_error(err, kErrorTypeValidation, "col value outside range");
+        goto cleanup;
+      }
+    }
+    if (pos[2] != -1
+        && (pos[2] < pos[0] || (pos[2] == pos[0] && pos[3] < pos[1]))) {
+      api_set_error(err, kErrorTypeValidation, "end is before start");
+      goto cleanup;
+    }
+    items[i] = (mtbatch_t){
+      .start_row = (int32_t)pos[0], .start_col = (int32_t)pos[1],
+      .end_row = (int32_t)pos[2], .end_col = (int32_t)pos[3],
+      .start_right = true, .end_right = false,
+    };
+  }
+
+  if (clear) {
+    extmark_clear(buf, (uint64_t)ns_id, 0, 0, MAXLNUM, MAXCOL);
+  }
+  extmark_add_batch(buf, (uint64_t)ns_id, hl_id, items, n);
+
+  rv.size = n;
+  rv.items = xcalloc(sizeof(Object), rv.size);
+  for (size_t i = 0; i < n; i++) {
+    rv.items[i] = INTEGER_OBJ((Integer)items[i].id);
+  }
+
+cleanup:
+  xfree(items);
+  return rv;
+}
+
 /// Removes an extmark.
 ///
 /// @param buffer Buffer handle, or 0 for current buffer
@@ -1716,6 +1876,11 @@ Dictionary nvim__buf_stats(Buffer buffer, Error *err)
   // NB: this should be zero at any time API functions are called,
   // this exists to debug issues
   PUT(rv, "dirty_bytes", INTEGER_OBJ((Integer)buf->deleted_bytes));
+  // Number of times a data block was found in the memline leaf cache, and
+  // number of times the tree of blocks had to be searched.
+  PUT(rv, "leaf_cache_hits", INTEGER_OBJ((Integer)buf->b_ml.ml_leaf_hits));
+  PUT(rv, "leaf_cache_misses",
+      INTEGER_OBJ((Integer)buf->b_ml.ml_leaf_misses));
 
   u_header_T *uhp = NULL;
   if (buf->b_u_curhead != NULL) {
@@ -1730,6 +1895,58 @@ Dictionary nvim__buf_stats(Buffer buffer, Error *err)
   return rv;
 }
 
+/// Writes the text of a buffer to a new temporary file, which clients on the
+/// same machine can map instead of fetching the lines through the API.
+///
+/// The file holds each line followed by a newline (NUL bytes in the text are
+/// written as NUL), then a table of line_count + 1 native-endian uint64
+/// values at offset `table`: the byte offset of each line, and the size of
+/// the text. The file is not updated by later changes; compare `changedtick`
+/// with |b:changedtick| to see whether it is stale. Delete it when done, else
+/// it is removed when Nvim exits.
+///
+/// @param buffer Buffer handle, or 0 for current buffer
+/// @param[out] err Error details, if any
+/// @return Dictionary with the keys `path`, `changedtick`, `line_count` and
+///         `table`.
+Dictionary nvim__buf_snapshot(Buffer buffer, Error *err)
+{
+  Dictionary rv = ARRAY_DICT_INIT;
+
+  buf_T *buf = find_buffer_by_handle(buffer, err);
+  if (!buf) {
+    return rv;
+  }
+
+  if (buf->b_ml.ml_mfp == NULL) {
+    api_set_error(err, kErrorTypeValidation, "Buffer is not loaded");
+    return rv;
+  }
+
+  char *fname = (char *)vim_tempname();
+  if (fname == NULL) {
+    api_set_error(err, kErrorTypeException, "Can't get temp file name");
+    return rv;
+  }
+
+  uint64_t table = 0;
+  mlsnapshot_T *snap = ml_snapshot(buf);
+  int error = ml_snapshot_write(snap, fname, &table);
+  ml_snapshot_unref(snap);
+  if (error != 0) {
+    api_set_error(err, kErrorTypeException, "Failed to write snapshot: %s",
+                  os_strerror(error));
+    xfree(fname);
+    return rv;
+  }
+
+  PUT(rv, "path", STRING_OBJ(cstr_as_string(fname)));
+  PUT(rv, "changedtick", INTEGER_OBJ(buf_get_changedtick(buf)));
+  PUT(rv, "line_count", INTEGER_OBJ(buf->b_ml.ml_line_count));
+  PUT(rv, "table", INTEGER_OBJ((Integer)table));
+  return rv;
+}
+
 // Check if deleting lines made the cursor position invalid.
 // Changed lines from `lo` to `hi`; added `extra` lines (negative if deleted).
 static void fix_cursor(linenr_T lo, linenr_T hi, linenr_T extra)
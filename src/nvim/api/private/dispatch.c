@@ -4,9 +4,9 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <string.h>
 #include <msgpack.h>
 
-#include "nvim/map.h"
 #include "nvim/log.h"
 #include "nvim/vim.h"
 #include "nvim/msgpack_rpc/helpers.h"
@@ -20,13 +20,9 @@
 #include "nvim/api/vim.h"
 #include "nvim/api/window.h"
 
-static Map(String, MsgpackRpcRequestHandler) *methods = NULL;
-
-static void msgpack_rpc_add_method_handler(String method,
-                                           MsgpackRpcRequestHandler handler)
-{
-  map_put(String, MsgpackRpcRequestHandler)(methods, method, handler);
-}
+#ifdef INCLUDE_GENERATED_DECLARATIONS
+#include "api/private/dispatch_wrappers.generated.h"
+#endif
 
 /// @param name API method name
 /// @param name_len name size (includes terminating NUL)
@@ -34,18 +30,25 @@ MsgpackRpcRequestHandler msgpack_rpc_get_handler_for(const char *name,
                                                      size_t name_len,
                                                      Error *error)
 {
-  String m = { .data = (char *)name, .size = name_len };
-  MsgpackRpcRequestHandler rv =
-    map_get(String, MsgpackRpcRequestHandler)(methods, m);
+  int id = msgpack_rpc_method_id(name, name_len);
 
-  if (!rv.fn) {
+  if (id < 0) {
     api_set_error(error, kErrorTypeException, "Invalid method: %.*s",
-                  m.size > 0 ? (int)m.size : (int)sizeof("<empty>"),
-                  m.size > 0 ? m.data : "<empty>");
+                  name_len > 0 ? (int)name_len : (int)sizeof("<empty>"),
+                  name_len > 0 ? name : "<empty>");
+    return (MsgpackRpcRequestHandler){ .name = NULL, .fn = NULL };
   }
-  return rv;
+  return method_handlers[id];
 }
 
-#ifdef INCLUDE_GENERATED_DECLARATIONS
-#include "api/private/dispatch_wrappers.generated.h"
-#endif
+/// @param id API method id, the "id" of the function in |api_info()|
+MsgpackRpcRequestHandler msgpack_rpc_get_handler_for_id(uint64_t id,
+                                                        Error *error)
+{
+  if (id >= ARRAY_SIZE(method_handlers)) {
+    api_set_error(error, kErrorTypeException, "Invalid method id: %" PRIu64,
+                  id);
+    return (MsgpackRpcRequestHandler){ .name = NULL, .fn = NULL };
+  }
+  return method_handlers[id];
+}
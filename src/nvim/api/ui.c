@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "nvim/vim.h"
 #include "nvim/ui.h"
@@ -19,6 +20,24 @@
 #include "nvim/highlight.h"
 #include "nvim/screen.h"
 #include "nvim/window.h"
+#include "nvim/lib/kvec.h"
+
+// Unchanged cells between two changed runs of a line are sent anyway if there
+// are fewer of them than this, as a new grid_line event costs about as much.
+#define GRID_LINE_GAP 4
+
+/// What a remote UI shows on one of its grids, so that grid_line events only
+/// carry the cells that changed. An attribute of -1 means the cell is unknown.
+typedef struct {
+  ScreenGrid grid;
+  // Set while grid_clear is held back: cells drawn since the clear. The
+  // other cells are cleared when it is settled, see shadow_settle().
+  char_u *drawn;
+} ShadowGrid;
+
+typedef struct {
+  HlAttrs rgb, cterm;
+} ShadowHl;
 
 #ifdef INCLUDE_GENERATED_DECLARATIONS
 # include "api/ui.c.generated.h"
@@ -35,6 +54,12 @@ typedef struct {
   // Position of legacy cursor, used both for drawing and visible user cursor.
   Integer client_row, client_col;
   bool wildmenu_active;
+
+  // What the UI shows, only with ext_linegrid: ShadowGrid for each grid.
+  PMap(uint64_t) *grids;
+  kvec_t(ShadowHl) hl_defs;  // Attributes sent by hl_attr_define.
+  Integer default_colors[5];  // Arguments sent by default_colors_set.
+  bool default_colors_sent;
 } UIData;
 
 static PMap(uint64_t) *connected_uis = NULL;
@@ -54,6 +79,12 @@ void remote_ui_disconnect(uint64_t channel_id)
   }
   UIData *data = ui->data;
   api_free_array(data->buffer);  // Destroy pending screen updates.
+  ShadowGrid *sg;
+  map_foreach_value(data->grids, sg, {
+    shadow_free(sg);
+  });
+  pmap_free(uint64_t)(data->grids);
+  kv_destroy(data->hl_defs);
   pmap_del(uint64_t)(connected_uis, channel_id);
   xfree(ui->data);
   ui->data = NULL;  // Flag UI as "stopped".
@@ -165,6 +196,9 @@ void nvim_ui_attach(uint64_t channel_id, Integer width, Integer height,
   data->hl_id = 0;
   data->client_col = -1;
   data->wildmenu_active = false;
+  data->grids = pmap_new(uint64_t)();
+  kv_init(data->hl_defs);
+  data->default_colors_sent = false;
   ui->data = data;
 
   pmap_put(uint64_t)(connected_uis, channel_id, ui);
@@ -368,6 +402,20 @@ static void push_call(UI *ui, const char *name, Array args)
 
 static void remote_ui_grid_clear(UI *ui, Integer grid)
 {
+  UIData *data = ui->data;
+  ShadowGrid *sg = pmap_get(uint64_t)(data->grids, (uint64_t)grid);
+  if (sg) {
+    // Hold back the clear: cells that are drawn again before the flush may
+    // already show the right text, and then need not be sent at all.
+    size_t ncells = (size_t)sg->grid.Rows * (size_t)sg->grid.Columns;
+    if (sg->drawn) {
+      memset(sg->drawn, 0, ncells);
+    } else {
+      sg->drawn = xcalloc(ncells + 1, 1);
+    }
+    return;
+  }
+
   Array args = ARRAY_DICT_INIT;
   if (ui->ui_ext[kUILinegrid]) {
     ADD(args, INTEGER_OBJ(grid));
@@ -379,6 +427,23 @@ static void remote_ui_grid_clear(UI *ui, Integer grid)
 static void remote_ui_grid_resize(UI *ui, Integer grid,
                                   Integer width, Integer height)
 {
+  if (ui->ui_ext[kUILinegrid]) {
+    UIData *data = ui->data;
+    ShadowGrid *sg = pmap_get(uint64_t)(data->grids, (uint64_t)grid);
+    if (!sg) {
+      sg = xcalloc(1, sizeof(ShadowGrid));
+      sg->grid = (ScreenGrid)SCREEN_GRID_INIT;
+      sg->grid.handle = (handle_T)grid;
+      pmap_put(uint64_t)(data->grids, (uint64_t)grid, sg);
+    }
+    // The UI may keep or clear the cells, so they are unknown now.
+    grid_alloc(&sg->grid, (int)height, (int)width, false, false);
+    if (sg->drawn) {
+      xfree(sg->drawn);
+      sg->drawn = xcalloc((size_t)height * (size_t)width + 1, 1);
+    }
+  }
+
   Array args = ARRAY_DICT_INIT;
   if (ui->ui_ext[kUILinegrid]) {
     ADD(args, INTEGER_OBJ(grid));
@@ -394,6 +459,14 @@ static void remote_ui_grid_scroll(UI *ui, Integer grid, Integer top,
                                   Integer rows, Integer cols)
 {
   if (ui->ui_ext[kUILinegrid]) {
+    UIData *data = ui->data;
+    ShadowGrid *sg = pmap_get(uint64_t)(data->grids, (uint64_t)grid);
+    if (sg) {
+      shadow_settle(ui, grid, sg);
+      shadow_scroll(sg, (int)top, (int)bot, (int)left, (int)right,
+                    (int)rows);
+    }
+
     Array args = ARRAY_DICT_INIT;
     ADD(args, INTEGER_OBJ(grid));
     ADD(args, INTEGER_OBJ(top));
@@ -433,6 +506,20 @@ static void remote_ui_default_colors_set(UI *ui, Integer rgb_fg,
   if (!ui->ui_ext[kUITermColors]) {
     HL_SET_DEFAULT_COLORS(rgb_fg, rgb_bg, rgb_sp);
   }
+
+  UIData *data = ui->data;
+  Integer colors[5] = { rgb_fg, rgb_bg, rgb_sp, cterm_fg, cterm_bg };
+  if (!data->default_colors_sent
+      || memcmp(data->default_colors, colors, sizeof(colors))) {
+    // Cells can look different now, don't rely on what the UI shows.
+    ShadowGrid *sg;
+    map_foreach_value(data->grids, sg, {
+      grid_invalidate(&sg->grid);
+    });
+    memcpy(data->default_colors, colors, sizeof(colors));
+    data->default_colors_sent = true;
+  }
+
   Array args = ARRAY_DICT_INIT;
   ADD(args, INTEGER_OBJ(rgb_fg));
   ADD(args, INTEGER_OBJ(rgb_bg));
@@ -463,6 +550,29 @@ static void remote_ui_hl_attr_define(UI *ui, Integer id, HlAttrs rgb_attrs,
   if (!ui->ui_ext[kUILinegrid]) {
     return;
   }
+
+  // Redefining an attribute changes how the cells that use it look, which
+  // the UI must be sent again.
+  UIData *data = ui->data;
+  ShadowHl def = { .rgb = rgb_attrs, .cterm = cterm_attrs };
+  if (id < (Integer)kv_size(data->hl_defs)
+      && !shadow_hl_equal(kv_A(data->hl_defs, id), def)) {
+    ShadowGrid *sg;
+    map_foreach_value(data->grids, sg, {
+      size_t ncells = (size_t)sg->grid.Rows * (size_t)sg->grid.Columns;
+      for (size_t i = 0; i < ncells; i++) {
+        if (sg->grid.attrs[i] == id) {
+          sg->grid.attrs[i] = -1;
+        }
+      }
+    });
+  }
+  while ((Integer)kv_size(data->hl_defs) <= id) {
+    kv_push(data->hl_defs, ((ShadowHl){ .rgb = HLATTRS_INIT,
+                                        .cterm = HLATTRS_INIT }));
+  }
+  kv_A(data->hl_defs, id) = def;
+
   Array args = ARRAY_DICT_INIT;
 
   ADD(args, INTEGER_OBJ(id));
@@ -536,6 +646,66 @@ static void remote_ui_put(UI *ui, const char *cell)
   push_call(ui, "put", args);
 }
 
+/// Pushes a grid_line event with the cells from "startcol" to "clearcol".
+static void push_grid_line(UI *ui, Integer grid, Integer row,
+                           Integer startcol, Integer endcol,
+                           Integer clearcol, Integer clearattr,
+                           const schar_T *chunk, const sattr_T *attrs)
+{
+  Array args = ARRAY_DICT_INIT;
+  ADD(args, INTEGER_OBJ(grid));
+  ADD(args, INTEGER_OBJ(row));
+  ADD(args, INTEGER_OBJ(startcol));
+  Array cells = ARRAY_DICT_INIT;
+  int repeat = 0;
+  size_t ncells = (size_t)(endcol-startcol);
+  int last_hl = -1;
+  for (size_t i = 0; i < ncells; i++) {
+    repeat++;
+    if (i == ncells-1 || attrs[i] != attrs[i+1]
+        || STRCMP(chunk[i], chunk[i+1])) {
+      Array cell = ARRAY_DICT_INIT;
+      ADD(cell, STRING_OBJ(cstr_to_string((const char *)chunk[i])));
+      if (attrs[i] != last_hl || repeat > 1) {
+        ADD(cell, INTEGER_OBJ(attrs[i]));
+        last_hl = attrs[i];
+      }
+      if (repeat > 1) {
+        ADD(cell, INTEGER_OBJ(repeat));
+      }
+      ADD(cells, ARRAY_OBJ(cell));
+      repeat = 0;
+    }
+  }
+  if (endcol < clearcol) {
+    Array cell = ARRAY_DICT_INIT;
+    ADD(cell, STRING_OBJ(cstr_to_string(" ")));
+    ADD(cell, INTEGER_OBJ(clearattr));
+    ADD(cell, INTEGER_OBJ(clearcol-endcol));
+    ADD(cells, ARRAY_OBJ(cell));
+  }
+  ADD(args, ARRAY_OBJ(cells));
+
+  push_call(ui, "grid_line", args);
+}
+
+/// Pushes the cells from "startcol" to "endcol" of a changed run of a line,
+/// the run may continue into the cleared part of the line.
+static void push_grid_run(UI *ui, Integer grid, Integer row,
+                          Integer startcol, Integer endcol, Integer runstart,
+                          Integer runend, Integer clearattr,
+                          const schar_T *chunk, const sattr_T *attrs)
+{
+  if (runstart < endcol) {
+    push_grid_line(ui, grid, row, runstart, MIN(runend, endcol), runend,
+                   clearattr, chunk + (runstart - startcol),
+                   attrs + (runstart - startcol));
+  } else {
+    push_grid_line(ui, grid, row, runstart, runstart, runend, clearattr,
+                   chunk, attrs);
+  }
+}
+
 static void remote_ui_raw_line(UI *ui, Integer grid, Integer row,
                                Integer startcol, Integer endcol,
                                Integer clearcol, Integer clearattr,
@@ -544,41 +714,51 @@ static void remote_ui_raw_line(UI *ui, Integer grid, Integer row,
 {
   UIData *data = ui->data;
   if (ui->ui_ext[kUILinegrid]) {
-    Array args = ARRAY_DICT_INIT;
-    ADD(args, INTEGER_OBJ(grid));
-    ADD(args, INTEGER_OBJ(row));
-    ADD(args, INTEGER_OBJ(startcol));
-    Array cells = ARRAY_DICT_INIT;
-    int repeat = 0;
-    size_t ncells = (size_t)(endcol-startcol);
-    int last_hl = -1;
-    for (size_t i = 0; i < ncells; i++) {
-      repeat++;
-      if (i == ncells-1 || attrs[i] != attrs[i+1]
-          || STRCMP(chunk[i], chunk[i+1])) {
-        Array cell = ARRAY_DICT_INIT;
-        ADD(cell, STRING_OBJ(cstr_to_string((const char *)chunk[i])));
-        if (attrs[i] != last_hl || repeat > 1) {
-          ADD(cell, INTEGER_OBJ(attrs[i]));
-          last_hl = attrs[i];
-        }
-        if (repeat > 1) {
-          ADD(cell, INTEGER_OBJ(repeat));
+    ShadowGrid *sg = pmap_get(uint64_t)(data->grids, (uint64_t)grid);
+    if (!sg || row >= sg->grid.Rows || clearcol > sg->grid.Columns) {
+      push_grid_line(ui, grid, row, startcol, endcol, clearcol, clearattr,
+                     chunk, attrs);
+      return;
+    }
+
+    // Only send the runs of cells that differ from what the UI shows.
+    Integer runstart = -1;
+    Integer runend = -1;
+    unsigned off = sg->grid.line_offset[row];
+    for (Integer col = startcol; col < clearcol; col++) {
+      const char_u *text = (col < endcol ? chunk[col - startcol]
+                            : (const char_u *)" ");
+      sattr_T attr = (col < endcol ? attrs[col - startcol]
+                      : (sattr_T)clearattr);
+      if (sg->drawn) {
+        sg->drawn[off + col] = true;
+      }
+      if (sg->grid.attrs[off + col] == attr
+          && !STRCMP(sg->grid.chars[off + col], text)) {
+        continue;
+      }
+      STRLCPY(sg->grid.chars[off + col], text, sizeof(schar_T));
+      sg->grid.attrs[off + col] = attr;
+
+      // Send both halves of a double-width char.
+      Integer cellstart = (!*text && col > startcol) ? col - 1 : col;
+      Integer cellend = (col + 1 < endcol && !*chunk[col + 1 - startcol])
+                        ? col + 2 : col + 1;
+      if (runstart >= 0 && cellstart - runend < GRID_LINE_GAP) {
+        runend = MAX(runend, cellend);
+      } else {
+        if (runstart >= 0) {
+          push_grid_run(ui, grid, row, startcol, endcol, runstart, runend,
+                        clearattr, chunk, attrs);
         }
-        ADD(cells, ARRAY_OBJ(cell));
-        repeat = 0;
+        runstart = cellstart;
+        runend = cellend;
       }
     }
-    if (endcol < clearcol) {
-      Array cell = ARRAY_DICT_INIT;
-      ADD(cell, STRING_OBJ(cstr_to_string(" ")));
-      ADD(cell, INTEGER_OBJ(clearattr));
-      ADD(cell, INTEGER_OBJ(clearcol-endcol));
-      ADD(cells, ARRAY_OBJ(cell));
+    if (runstart >= 0) {
+      push_grid_run(ui, grid, row, startcol, endcol, runstart, runend,
+                    clearattr, chunk, attrs);
     }
-    ADD(args, ARRAY_OBJ(cells));
-
-    push_call(ui, "grid_line", args);
   } else {
     for (int i = 0; i < endcol-startcol; i++) {
       remote_ui_cursor_goto(ui, row, startcol+i);
@@ -608,6 +788,11 @@ static void remote_ui_raw_line(UI *ui, Integer grid, Integer row,
 static void remote_ui_flush(UI *ui)
 {
   UIData *data = ui->data;
+  uint64_t handle;
+  ShadowGrid *sg;
+  map_foreach(data->grids, handle, sg, {
+    shadow_settle(ui, (Integer)handle, sg);
+  });
   if (data->buffer.size > 0) {
     if (!ui->ui_ext[kUILinegrid]) {
       remote_ui_cursor_goto(ui, data->cursor_row, data->cursor_col);
@@ -652,6 +837,15 @@ static Array translate_firstarg(UI *ui, Array args)
 static void remote_ui_event(UI *ui, char *name, Array args, bool *args_consumed)
 {
   UIData *data = ui->data;
+  if (strequal(name, "grid_destroy")) {
+    uint64_t grid = (uint64_t)args.items[0].data.integer;
+    ShadowGrid *sg = pmap_get(uint64_t)(data->grids, grid);
+    if (sg) {
+      pmap_del(uint64_t)(data->grids, grid);
+      shadow_free(sg);
+    }
+  }
+
   if (!ui->ui_ext[kUILinegrid]) {
     // the representation of highlights in cmdline changed, translate back
     // never consumes args
@@ -724,6 +918,140 @@ static void remote_ui_event(UI *ui, char *name, Array args, bool *args_consumed)
   push_call(ui, name, my_args);
 }
 
+/// Sends a held back grid_clear. Usually the cells that were not drawn since
+/// then are cleared with grid_line. When fewer cells must be drawn again after
+/// a grid_clear, it is sent, followed by the cells that were drawn.
+static void shadow_settle(UI *ui, Integer handle, ShadowGrid *sg)
+{
+  if (!sg->drawn) {
+    return;
+  }
+  ScreenGrid *grid = &sg->grid;
+  size_t ncells = (size_t)grid->Rows * (size_t)grid->Columns;
+  size_t nclear = 0;
+  size_t nredraw = 0;
+  bool known = true;
+  for (size_t i = 0; i < ncells; i++) {
+    if (shadow_blank(grid, i)) {
+      continue;
+    } else if (sg->drawn[i]) {
+      nredraw++;
+      known = known && grid->attrs[i] >= 0;
+    } else {
+      nclear++;
+    }
+  }
+
+  bool clear = known && nredraw < nclear;
+  if (clear) {
+    Array args = ARRAY_DICT_INIT;
+    ADD(args, INTEGER_OBJ(handle));
+    push_call(ui, "grid_clear", args);
+    for (size_t i = 0; i < ncells; i++) {
+      if (!sg->drawn[i]) {
+        STRCPY(grid->chars[i], " ");
+        grid->attrs[i] = 0;
+      }
+    }
+  }
+
+  for (int row = 0; row < grid->Rows; row++) {
+    unsigned off = grid->line_offset[row];
+    int runstart = -1;
+    int runend = -1;
+    for (int col = 0; col <= grid->Columns; col++) {
+      bool last = col == grid->Columns;
+      size_t i = off + (unsigned)col;
+      bool drawn = !last && sg->drawn[i];
+      // Blank cells need not be sent, but can be part of a run.
+      if (!last && (clear || !drawn) && shadow_blank(grid, i)) {
+        continue;
+      }
+      bool send = !last && drawn == clear;
+      if (runstart >= 0 && (!send || col - runend >= GRID_LINE_GAP)) {
+        if (clear) {
+          push_grid_line(ui, handle, row, runstart, runend, runend, 0,
+                         grid->chars + off + runstart,
+                         grid->attrs + off + runstart);
+        } else {
+          push_grid_line(ui, handle, row, runstart, runstart, runend, 0,
+                         NULL, NULL);
+          for (unsigned c = (unsigned)runstart; c < (unsigned)runend; c++) {
+            STRCPY(grid->chars[off + c], " ");
+            grid->attrs[off + c] = 0;
+          }
+        }
+        runstart = -1;
+      }
+      if (send) {
+        if (runstart < 0) {
+          runstart = col;
+        }
+        runend = col + 1;
+      }
+    }
+  }
+  XFREE_CLEAR(sg->drawn);
+}
+
+/// Whether cell "off" is shown as after grid_clear.
+static bool shadow_blank(const ScreenGrid *grid, size_t off)
+{
+  return grid->attrs[off] == 0 && !STRCMP(grid->chars[off], " ");
+}
+
+/// Moves the cells like the grid_scroll event does. The cells that are
+/// scrolled in become unknown.
+static void shadow_scroll(ShadowGrid *sg, int top, int bot, int left,
+                          int right, int rows)
+{
+  ScreenGrid *grid = &sg->grid;
+  if (bot > grid->Rows || right > grid->Columns || left >= right) {
+    grid_invalidate(grid);
+    return;
+  }
+  size_t width = (size_t)(right - left);
+  int start = rows > 0 ? top : bot - 1;
+  int end = rows > 0 ? bot : top - 1;
+  int step = rows > 0 ? 1 : -1;
+  for (int row = start; row != end; row += step) {
+    unsigned to = grid->line_offset[row] + (unsigned)left;
+    if (row + rows >= top && row + rows < bot) {
+      unsigned from = grid->line_offset[row + rows] + (unsigned)left;
+      memmove(grid->chars + to, grid->chars + from, width * sizeof(schar_T));
+      memmove(grid->attrs + to, grid->attrs + from, width * sizeof(sattr_T));
+    } else {
+      memset(grid->attrs + to, -1, width * sizeof(sattr_T));
+    }
+  }
+}
+
+static void shadow_free(ShadowGrid *sg)
+{
+  grid_free(&sg->grid);
+  xfree(sg->drawn);
+  xfree(sg);
+}
+
+static bool shadow_hl_equal(ShadowHl a, ShadowHl b)
+{
+  HlAttrs *x[2] = { &a.rgb, &a.cterm };
+  HlAttrs *y[2] = { &b.rgb, &b.cterm };
+  for (int i = 0; i < 2; i++) {
+    if (x[i]->rgb_ae_attr != y[i]->rgb_ae_attr
+        || x[i]->cterm_ae_attr != y[i]->cterm_ae_attr
+        || x[i]->rgb_fg_color != y[i]->rgb_fg_color
+        || x[i]->rgb_bg_color != y[i]->rgb_bg_color
+        || x[i]->rgb_sp_color != y[i]->rgb_sp_color
+        || x[i]->cterm_fg_color != y[i]->cterm_fg_color
+        || x[i]->cterm_bg_color != y[i]->cterm_bg_color
+        || x[i]->hl_blend != y[i]->hl_blend) {
+      return false;
+    }
+  }
+  return true;
+}
+
 static void remote_ui_inspect(UI *ui, Dictionary *info)
 {
   UIData *data = ui->data;
@@ -51,6 +51,13 @@
 
 #define LINE_BUFFER_SIZE 4096
 
+/// A call of nvim__call_batch(), checked before the first call is made.
+typedef struct {
+  MsgpackRpcRequestHandler handler;
+  Array args;
+  Array refs;  ///< [arg index, call index] pairs
+} BatchCall;
+
 #ifdef INCLUDE_GENERATED_DECLARATIONS
 # include "api/vim.c.generated.h"
 #endif
@@ -1766,7 +1773,8 @@ Array nvim_list_chans(void)
 ///
 /// @param channel_id
 /// @param calls an array of calls, where each call is described by an array
-///              with two elements: the request name, and an array of arguments.
+///              with two elements: the request name (or method id, see
+///              |api-metadata|), and an array of arguments.
 /// @param[out] err Validation error details (malformed `calls` parameter),
 ///             if any. Errors from batched calls are given in the return value.
 ///
@@ -1798,13 +1806,13 @@ Array nvim_call_atomic(uint64_t channel_id, Array calls, Error *err)
       goto validation_error;
     }
 
-    if (call.items[0].type != kObjectTypeString) {
+    if (call.items[0].type != kObjectTypeString
+        && call.items[0].type != kObjectTypeInteger) {
       api_set_error(err,
                     kErrorTypeValidation,
-                    "Name must be String");
+                    "Name must be String or method id");
       goto validation_error;
     }
-    String name = call.items[0].data.string;
 
     if (call.items[1].type != kObjectTypeArray) {
       api_set_error(err,
@@ -1814,10 +1822,8 @@ Array nvim_call_atomic(uint64_t channel_id, Array calls, Error *err)
     }
     Array args = call.items[1].data.array;
 
-    MsgpackRpcRequestHandler handler =
-        msgpack_rpc_get_handler_for(name.data,
-                                    name.size,
-                                    &nested_error);
+    MsgpackRpcRequestHandler handler = call_handler(call.items[0],
+                                                    &nested_error);
 
     if (ERROR_SET(&nested_error)) {
       break;
@@ -1831,25 +1837,166 @@ Array nvim_call_atomic(uint64_t channel_id, Array calls, Error *err)
     ADD(results, result);
   }
 
+  rv = call_results(results, i, &nested_error);
+  goto theend;
+
+validation_error:
+  api_free_array(results);
+theend:
+  api_clear_error(&nested_error);
+  return rv;
+}
+
+/// Calls many API methods atomically, like |nvim_call_atomic()|, but checks
+/// all the calls before making the first one.
+///
+/// Each call is an array `[method, args]` or `[method, args, refs]`. The
+/// method is a method name or a method id from |api-metadata|. `refs` is an
+/// array of `[arg_index, call_index]` pairs: the argument at `arg_index` is
+/// replaced by the result of the earlier call `call_index` (both zero-based).
+///
+/// @param channel_id
+/// @param calls array of calls
+/// @param[out] err Validation error details (malformed `calls` parameter or
+///             unknown method), if any. No call is made then.
+///
+/// @return Same as |nvim_call_atomic()|.
+Array nvim__call_batch(uint64_t channel_id, Array calls, Error *err)
+  FUNC_API_REMOTE_ONLY
+{
+  Array rv = ARRAY_DICT_INIT;
+  BatchCall *batch = xmalloc(calls.size * sizeof(*batch));
+
+  if (!batch_compile(calls, batch, err)) {
+    xfree(batch);
+    return rv;
+  }
+
+  Array results = ARRAY_DICT_INIT;
+  Error nested_error = ERROR_INIT;
+
+  size_t i;
+  for (i = 0; i < calls.size; i++) {
+    Array args = batch[i].args;
+    if (batch[i].refs.size > 0) {
+      // Like the arguments, the results are only borrowed by the call.
+      args.items = xmemdup(args.items, args.size * sizeof(*args.items));
+      for (size_t j = 0; j < batch[i].refs.size; j++) {
+        Array ref = batch[i].refs.items[j].data.array;
+        args.items[ref.items[0].data.integer] =
+          results.items[ref.items[1].data.integer];
+      }
+    }
+
+    Object result = batch[i].handler.fn(channel_id, args, &nested_error);
+    if (args.items != batch[i].args.items) {
+      xfree(args.items);
+    }
+    if (ERROR_SET(&nested_error)) {
+      break;
+    }
+
+    ADD(results, result);
+  }
+
+  rv = call_results(results, i, &nested_error);
+  api_clear_error(&nested_error);
+  xfree(batch);
+  return rv;
+}
+
+/// Gets the handler of a method given by its name or its method id.
+static MsgpackRpcRequestHandler call_handler(Object method, Error *err)
+{
+  if (method.type == kObjectTypeString) {
+    return msgpack_rpc_get_handler_for(method.data.string.data,
+                                       method.data.string.size, err);
+  }
+  if (method.type == kObjectTypeInteger && method.data.integer >= 0) {
+    return msgpack_rpc_get_handler_for_id((uint64_t)method.data.integer,
+                                          err);
+  }
+  api_set_error(err, kErrorTypeValidation, "Invalid method id");
+  return (MsgpackRpcRequestHandler){ .name = NULL, .fn = NULL };
+}
+
+/// Builds the return value of nvim_call_atomic() and nvim__call_batch().
+///
+/// @param results results of the calls made, moved into the return value
+/// @param i index of the last call, which failed if `err` is set
+static Array call_results(Array results, size_t i, Error *err)
+{
+  Array rv = ARRAY_DICT_INIT;
   ADD(rv, ARRAY_OBJ(results));
-  if (ERROR_SET(&nested_error)) {
+  if (ERROR_SET(err)) {
     Array errval = ARRAY_DICT_INIT;
     ADD(errval, INTEGER_OBJ((Integer)i));
-    ADD(errval, INTEGER_OBJ(nested_error.type));
-    ADD(errval, STRING_OBJ(cstr_to_string(nested_error.msg)));
+    ADD(errval, INTEGER_OBJ(err->type));
+    ADD(errval, STRING_OBJ(cstr_to_string(err->msg)));
     ADD(rv, ARRAY_OBJ(errval));
   } else {
     ADD(rv, NIL);
   }
-  goto theend;
-
-validation_error:
-  api_free_array(results);
-theend:
-  api_clear_error(&nested_error);
   return rv;
 }
 
+/// Checks the calls of nvim__call_batch() and looks up their handlers.
+///
+/// @param[out] batch checked calls, as many as in `calls`
+/// @return false if a call is malformed, with `err` set
+static bool batch_compile(Array calls, BatchCall *batch, Error *err)
+{
+  for (size_t i = 0; i < calls.size; i++) {
+    if (calls.items[i].type != kObjectTypeArray) {
+      api_set_error(err, kErrorTypeValidation,
+                    "Items in calls array must be arrays");
+      return false;
+    }
+    Array call = calls.items[i].data.array;
+    if (call.size != 2 && call.size != 3) {
+      api_set_error(err, kErrorTypeValidation,
+                    "Items in calls array must be arrays of size 2 or 3");
+      return false;
+    }
+
+    if (call.items[1].type != kObjectTypeArray) {
+      api_set_error(err, kErrorTypeValidation, "Args must be Array");
+      return false;
+    }
+    batch[i].args = call.items[1].data.array;
+
+    batch[i].refs = (Array)ARRAY_DICT_INIT;
+    if (call.size == 3) {
+      if (call.items[2].type != kObjectTypeArray) {
+        api_set_error(err, kErrorTypeValidation, "Refs must be Array");
+        return false;
+      }
+      batch[i].refs = call.items[2].data.array;
+    }
+    for (size_t j = 0; j < batch[i].refs.size; j++) {
+      Object ref = batch[i].refs.items[j];
+      if (ref.type != kObjectTypeArray || ref.data.array.size != 2
+          || ref.data.array.items[0].type != kObjectTypeInteger
+          || ref.data.array.items[1].type != kObjectTypeInteger
+          || ref.data.array.items[0].data.integer < 0
+          || (size_t)ref.data.array.items[0].data.integer
+          >= batch[i].args.size
+          || ref.data.array.items[1].data.integer < 0
+          || (size_t)ref.data.array.items[1].data.integer >= i) {
+        api_set_error(err, kErrorTypeValidation,
+                      "Invalid ref in call %zu", i);
+        return false;
+      }
+    }
+
+    batch[i].handler = call_handler(call.items[0], err);
+    if (ERROR_SET(err)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 typedef struct {
   ExprASTNode **node_p;
   Object *ret_node_p;
@@ -462,9 +462,17 @@ typedef struct {
   LuaRef on_changedtick;
   LuaRef on_detach;
   bool utf_sizes;
+  bool coalesce;
+  bool bytes;
 } BufUpdateCallbacks;
 #define BUF_UPDATE_CALLBACKS_INIT { LUA_NOREF, LUA_NOREF, LUA_NOREF, \
-                                    LUA_NOREF, false }
+                                    LUA_NOREF, false, false, false }
+
+typedef struct {
+  uint64_t channel_id;
+  bool coalesce;  // send one merged nvim_buf_lines_event per tick
+  bool bytes;  // send nvim_buf_bytes_event instead of nvim_buf_lines_event
+} BufUpdateChannel;
 
 EXTERN int curbuf_splice_pending INIT(= 0);
 
@@ -594,6 +602,14 @@ struct file_buffer {
   u_header_T  *b_u_curhead;     /* pointer to current header */
   int b_u_numhead;              /* current number of headers */
   bool b_u_synced;              /* entry lists are synced */
+  size_t b_u_bytes;             // memory used by the undo entries
+  int b_u_delta_count;          // number of entries with ue_delta set
+  // The undo file as last written or read, changes are appended to it while
+  // it stays the same.
+  FileID b_u_file_id;
+  bool b_u_file_id_valid;
+  uint64_t b_u_file_size;       // size of the undo file
+  uint64_t b_u_file_base;       // size without the appended changes
   long b_u_seq_last;            /* last used undo sequence number */
   long b_u_save_nr_last;          /* counter for last file write */
   long b_u_seq_cur;             /* hu_seq of header below which we are now */
@@ -809,9 +825,18 @@ struct file_buffer {
   Map(uint64_t, ExtmarkItem) *b_extmark_index;
   Map(uint64_t, ExtmarkNs) *b_extmark_ns;         // extmark namespaces
 
-  // array of channel_id:s which have asked to receive updates for this
+  // array of channels which have asked to receive updates for this
   // buffer.
-  kvec_t(uint64_t) update_channels;
+  kvec_t(BufUpdateChannel) update_channels;
+  // lines changed since the coalesced channels were last notified, see
+  // buf_updates_flush(). One-based with exclusive end: the lines
+  // update_pending_top..update_pending_old_bot before the changes are now
+  // update_pending_top..update_pending_bot. Zero top when nothing changed.
+  linenr_T update_pending_top;
+  linenr_T update_pending_old_bot;
+  linenr_T update_pending_bot;
+  bool update_pending_tick;  // any of the changes incremented b:changedtick
+
   // array of lua callbacks for buffer updates.
   kvec_t(BufUpdateCallbacks) update_callbacks;
 
@@ -8,11 +8,38 @@
 #include "nvim/lua/executor.h"
 #include "nvim/assert.h"
 #include "nvim/buffer.h"
+#include "nvim/main.h"
+#include "nvim/event/multiqueue.h"
+#include "nvim/api/private/handle.h"
+#include "nvim/extmark.h"
+
+typedef struct {
+  handle_T buf;
+  varnumber_T changedtick;
+  ExtmarkSplice splice;
+} PendingSplice;
 
 #ifdef INCLUDE_GENERATED_DECLARATIONS
 # include "buffer_updates.c.generated.h"
 #endif
 
+// splices for the "bytes" channels, made while a splice batch is collected
+static kvec_t(PendingSplice) splice_pending = KV_INITIAL_VALUE;
+
+// A change only reported by buf_updates_send_changes(). It is sent to the
+// "bytes" channels as a replacement of whole lines, unless a splice for it
+// follows. Zero buf when there is none.
+static PendingSplice lines_pending = { .buf = 0 };
+static Array lines_pending_text = ARRAY_DICT_INIT;
+
+// a splice was sent for this buffer, the buf_updates_send_changes() for it
+// did not follow yet
+static handle_T spliced_buf = 0;
+static bool bytes_event_scheduled = false;
+
+// splices are not sent to the "bytes" channels, see buf_updates_skip_splices()
+static bool splice_skip = false;
+
 // Register a channel. Return True if the channel was added, or already added.
 // Return False if the channel couldn't be added because the buffer is
 // unloaded.
@@ -36,15 +63,22 @@ bool buf_updates_register(buf_T *buf, uint64_t channel_id,
   size_t size = kv_size(buf->update_channels);
   if (size) {
     for (size_t i = 0; i < size; i++) {
-      if (kv_A(buf->update_channels, i) == channel_id) {
+      if (kv_A(buf->update_channels, i).channel_id == channel_id) {
         // buffer is already registered ... nothing to do
         return true;
       }
     }
   }
 
+  // the new channel must not see changes made before it was attached
+  buf_updates_flush(buf);
+
   // append the channelid to the list
-  kv_push(buf->update_channels, channel_id);
+  kv_push(buf->update_channels, ((BufUpdateChannel) {
+    .channel_id = channel_id,
+    .coalesce = cb.coalesce,
+    .bytes = cb.bytes,
+  }));
 
   if (send_buffer) {
     Array args = ARRAY_DICT_INIT;
@@ -104,12 +138,15 @@ void buf_updates_unregister(buf_T *buf, uint64_t channelid)
     return;
   }
 
+  buf_updates_flush(buf);
+  size = kv_size(buf->update_channels);
+
   // go through list backwards and remove the channel id each time it appears
   // (it should never appear more than once)
   size_t j = 0;
   size_t found = 0;
   for (size_t i = 0; i < size; i++) {
-    if (kv_A(buf->update_channels, i) == channelid) {
+    if (kv_A(buf->update_channels, i).channel_id == channelid) {
       found++;
     } else {
       // copy item backwards into prior slot if needed
@@ -136,10 +173,11 @@ void buf_updates_unregister(buf_T *buf, uint64_t channelid)
 
 void buf_updates_unregister_all(buf_T *buf)
 {
+  buf_updates_flush(buf);
   size_t size = kv_size(buf->update_channels);
   if (size) {
     for (size_t i = 0; i < size; i++) {
-      buf_updates_send_end(buf, kv_A(buf->update_channels, i));
+      buf_updates_send_end(buf, kv_A(buf->update_channels, i).channel_id);
     }
     kv_destroy(buf->update_channels);
     kv_init(buf->update_channels);
@@ -166,6 +204,130 @@ void buf_updates_unregister_all(buf_T *buf)
   kv_init(buf->update_callbacks);
 }
 
+static bool send_lines_event(buf_T *buf, uint64_t channelid,
+                             linenr_T firstline, int64_t num_added,
+                             int64_t num_removed, bool send_tick)
+{
+  // send through the changes now channel contents now
+  Array args = ARRAY_DICT_INIT;
+  args.size = 6;
+  args.items = xcalloc(sizeof(Object), args.size);
+
+  // the first argument is always the buffer handle
+  args.items[0] = BUFFER_OBJ(buf->handle);
+
+  // next argument is b:changedtick
+  args.items[1] = send_tick ? INTEGER_OBJ(buf_get_changedtick(buf)) : NIL;
+
+  // the first line that changed (zero-indexed)
+  args.items[2] = INTEGER_OBJ(firstline - 1);
+
+  // the last line that was changed
+  args.items[3] = INTEGER_OBJ(firstline - 1 + num_removed);
+
+  // linedata of lines being swapped in
+  Array linedata = ARRAY_DICT_INIT;
+  if (num_added > 0) {
+    STATIC_ASSERT(SIZE_MAX >= MAXLNUM, "size_t smaller than MAXLNUM");
+    linedata.size = (size_t)num_added;
+    linedata.items = xcalloc(sizeof(Object), (size_t)num_added);
+    buf_collect_lines(buf, (size_t)num_added, firstline, true, &linedata,
+                      NULL);
+  }
+  args.items[4] = ARRAY_OBJ(linedata);
+  args.items[5] = BOOLEAN_OBJ(false);
+  return rpc_send_event(channelid, "nvim_buf_lines_event", args);
+}
+
+/// Merges a change into the line range pending for the coalesced channels.
+///
+/// The first change after a flush schedules the next one on the main loop, so
+/// all changes made before the editor gets back to processing events (a
+/// whole :normal, :substitute or API request) reach the channels as a single
+/// replacement of the lines they touched.
+static void buf_updates_pend(buf_T *buf, linenr_T firstline,
+                             int64_t num_added, int64_t num_removed,
+                             bool send_tick)
+{
+  linenr_T old_bot = firstline + (linenr_T)num_removed;
+  linenr_T bot = firstline + (linenr_T)num_added;
+
+  if (buf->update_pending_top == 0) {
+    buf->update_pending_top = firstline;
+    buf->update_pending_old_bot = old_bot;
+    buf->update_pending_bot = bot;
+    buf->update_pending_tick = send_tick;
+    multiqueue_put(main_loop.events, buf_updates_flush_event, 1,
+                   (void *)(intptr_t)buf->handle);
+    return;
+  }
+
+  linenr_T top = buf->update_pending_top;
+  linenr_T pending_bot = buf->update_pending_bot;
+  // Where the end of the replaced lines was before the pending changes.
+  // Lines below the pending range only moved, lines inside it are new.
+  linenr_T orig_bot = old_bot;
+  if (old_bot >= pending_bot) {
+    orig_bot -= pending_bot - buf->update_pending_old_bot;
+  } else if (old_bot > top) {
+    orig_bot = buf->update_pending_old_bot;
+  }
+
+  buf->update_pending_top = MIN(top, firstline);
+  buf->update_pending_old_bot = MAX(buf->update_pending_old_bot, orig_bot);
+  if (old_bot <= pending_bot) {
+    buf->update_pending_bot = pending_bot + (linenr_T)(num_added - num_removed);
+  } else {
+    buf->update_pending_bot = bot;
+  }
+  buf->update_pending_tick |= send_tick;
+}
+
+static void buf_updates_flush_event(void **argv)
+{
+  buf_T *buf = handle_get_buffer((handle_T)(intptr_t)argv[0]);
+  if (buf) {
+    buf_updates_flush(buf);
+  }
+}
+
+/// Sends the lines changed since the last flush to the channels attached
+/// with "coalesce", as one nvim_buf_lines_event per channel.
+void buf_updates_flush(buf_T *buf)
+{
+  if (lines_pending.buf == buf->handle) {
+    send_lines_pending();
+  }
+
+  linenr_T top = buf->update_pending_top;
+  if (top == 0) {
+    return;
+  }
+  buf->update_pending_top = 0;
+
+  // the buffer is being unloaded, the channels only get detached
+  if (buf->b_ml.ml_mfp == NULL) {
+    return;
+  }
+
+  uint64_t badchannelid = 0;
+  for (size_t i = 0; i < kv_size(buf->update_channels); i++) {
+    BufUpdateChannel chan = kv_A(buf->update_channels, i);
+    if (chan.coalesce
+        && !send_lines_event(buf, chan.channel_id, top,
+                             buf->update_pending_bot - top,
+                             buf->update_pending_old_bot - top,
+                             buf->update_pending_tick)) {
+      badchannelid = chan.channel_id;
+    }
+  }
+
+  if (badchannelid != 0) {
+    ELOG("Disabling buffer updates for dead channel %"PRIu64, badchannelid);
+    buf_updates_unregister(buf, badchannelid);
+  }
+}
+
 void buf_updates_send_changes(buf_T *buf,
                               linenr_T firstline,
                               int64_t num_added,
@@ -182,47 +344,48 @@ void buf_updates_send_changes(buf_T *buf,
 
   // if one the channels doesn't work, put its ID here so we can remove it later
   uint64_t badchannelid = 0;
+  bool pend = false;
+  bool send_bytes = false;
 
   // notify each of the active channels
   for (size_t i = 0; i < kv_size(buf->update_channels); i++) {
-    uint64_t channelid = kv_A(buf->update_channels, i);
-
-    // send through the changes now channel contents now
-    Array args = ARRAY_DICT_INIT;
-    args.size = 6;
-    args.items = xcalloc(sizeof(Object), args.size);
-
-    // the first argument is always the buffer handle
-    args.items[0] = BUFFER_OBJ(buf->handle);
-
-    // next argument is b:changedtick
-    args.items[1] = send_tick ? INTEGER_OBJ(buf_get_changedtick(buf)) : NIL;
-
-    // the first line that changed (zero-indexed)
-    args.items[2] = INTEGER_OBJ(firstline - 1);
-
-    // the last line that was changed
-    args.items[3] = INTEGER_OBJ(firstline - 1 + num_removed);
-
-    // linedata of lines being swapped in
-    Array linedata = ARRAY_DICT_INIT;
-    if (num_added > 0) {
-        STATIC_ASSERT(SIZE_MAX >= MAXLNUM, "size_t smaller than MAXLNUM");
-        linedata.size = (size_t)num_added;
-        linedata.items = xcalloc(sizeof(Object), (size_t)num_added);
-        buf_collect_lines(buf, (size_t)num_added, firstline, true, &linedata,
-                          NULL);
-    }
-    args.items[4] = ARRAY_OBJ(linedata);
-    args.items[5] = BOOLEAN_OBJ(false);
-    if (!rpc_send_event(channelid, "nvim_buf_lines_event", args)) {
+    BufUpdateChannel chan = kv_A(buf->update_channels, i);
+    if (chan.bytes) {
+      send_bytes = true;
+    } else if (chan.coalesce) {
+      pend = true;
+    } else if (!send_lines_event(buf, chan.channel_id, firstline, num_added,
+                                 num_removed, send_tick)) {
       // We can't unregister the channel while we're iterating over the
       // update_channels array, so we remember its ID to unregister it at
       // the end.
-      badchannelid = channelid;
+      badchannelid = chan.channel_id;
     }
   }
 
+  if (pend) {
+    buf_updates_pend(buf, firstline, num_added, num_removed, send_tick);
+  }
+
+  // Most changes reach the "bytes" channels as splices, made before or after
+  // this call. Some, like setline(), only end up here: they are sent as a
+  // replacement of the whole lines.
+  if (spliced_buf == buf->handle || extmark_splice_batch_active()) {
+    spliced_buf = 0;
+  } else if (send_bytes) {
+    send_lines_pending();
+    int start_row = (int)firstline - 1;
+    lines_pending = (PendingSplice){
+      .buf = buf->handle,
+      .changedtick = buf_get_changedtick(buf),
+      .splice = { .start_row = start_row,
+                  .oldextent_row = (int)num_removed,
+                  .newextent_row = (int)num_added } };
+    lines_pending_text = splice_text(buf, start_row, 0,
+                                     (linenr_T)num_added, 0);
+    schedule_bytes_event();
+  }
+
   // We can only ever remove one dead channel at a time. This is OK because the
   // change notifications are so frequent that many dead channels will be
   // cleared up quickly.
@@ -281,6 +444,147 @@ void buf_updates_send_changes(buf_T *buf,
   kv_size(buf->update_callbacks) = j;
 }
 
+/// Gets the text of a splice after it was made, one item for each line of it.
+static Array splice_text(buf_T *buf, linenr_T start_line, colnr_T start_col,
+                         linenr_T extent_line, colnr_T extent_col)
+{
+  Array text = ARRAY_DICT_INIT;
+  for (linenr_T i = 0; i <= extent_line; i++) {
+    linenr_T lnum = start_line + i + 1;
+    const char *line = "";
+    if (lnum <= buf->b_ml.ml_line_count) {
+      line = (const char *)ml_get_buf(buf, lnum, false);
+    }
+    size_t len = STRLEN(line);
+    size_t start = i == 0 ? (size_t)start_col : 0;
+    size_t end = i == extent_line ? start + (size_t)extent_col : len;
+    start = MIN(start, len);
+    end = MIN(end, len);
+
+    String str = cbuf_to_string(line + start, end - start);
+    // Vim represents NULs as NLs, but this may confuse clients.
+    memchrsub(str.data, '\n', '\0', str.size);
+    ADD(text, STRING_OBJ(str));
+  }
+  return text;
+}
+
+/// Sends a splice to the channels attached with "bytes". "text" is the
+/// inserted text, it is read from the buffer when empty. It is freed.
+static void send_bytes_event(buf_T *buf, varnumber_T changedtick,
+                             ExtmarkSplice splice, Array text)
+{
+  uint64_t badchannelid = 0;
+  for (size_t i = 0; i < kv_size(buf->update_channels); i++) {
+    BufUpdateChannel chan = kv_A(buf->update_channels, i);
+    if (!chan.bytes) {
+      continue;
+    }
+    if (!text.size) {
+      text = splice_text(buf, splice.start_row, splice.start_col,
+                         splice.newextent_row, splice.newextent_col);
+    }
+
+    Array args = ARRAY_DICT_INIT;
+    args.size = 9;
+    args.items = xcalloc(sizeof(Object), args.size);
+
+    // the first argument is always the buffer handle
+    args.items[0] = BUFFER_OBJ(buf->handle);
+
+    // next argument is b:changedtick
+    args.items[1] = INTEGER_OBJ(changedtick);
+
+    args.items[2] = INTEGER_OBJ(splice.start_row);
+    args.items[3] = INTEGER_OBJ(splice.start_col);
+    args.items[4] = INTEGER_OBJ(splice.oldextent_row);
+    args.items[5] = INTEGER_OBJ(splice.oldextent_col);
+    args.items[6] = INTEGER_OBJ(splice.newextent_row);
+    args.items[7] = INTEGER_OBJ(splice.newextent_col);
+
+    // the inserted text, the replaced text is already known to the client
+    args.items[8] = copy_object(ARRAY_OBJ(text));
+
+    if (!rpc_send_event(chan.channel_id, "nvim_buf_bytes_event", args)) {
+      badchannelid = chan.channel_id;
+    }
+  }
+  api_free_array(text);
+
+  if (badchannelid != 0) {
+    ELOG("Disabling buffer updates for dead channel %"PRIu64, badchannelid);
+    buf_updates_unregister(buf, badchannelid);
+  }
+}
+
+/// Sends the splices held back by buf_updates_send_splice() while a splice
+/// batch was collected. Called when the batch ends, when the buffer text is
+/// in its final state.
+void buf_updates_send_pending_splices(void)
+{
+  for (size_t i = 0; i < kv_size(splice_pending); i++) {
+    PendingSplice item = kv_A(splice_pending, i);
+    buf_T *buf = handle_get_buffer(item.buf);
+    if (buf && buf->b_ml.ml_mfp != NULL) {
+      send_bytes_event(buf, item.changedtick, item.splice,
+                       (Array)ARRAY_DICT_INIT);
+    }
+  }
+  kv_size(splice_pending) = 0;
+}
+
+/// Whether "splice" changes one of the rows replaced by the whole lines
+/// change "lines".
+static bool splice_overlaps(ExtmarkSplice lines, ExtmarkSplice splice)
+{
+  int last_row = lines.start_row + MAX(lines.newextent_row, 1) - 1;
+  return splice.start_row <= last_row
+         && splice.start_row + splice.oldextent_row >= lines.start_row;
+}
+
+/// Sends the change held back by buf_updates_send_changes() as a
+/// replacement of whole lines.
+static void send_lines_pending(void)
+{
+  if (lines_pending.buf == 0) {
+    return;
+  }
+  buf_T *buf = handle_get_buffer(lines_pending.buf);
+  lines_pending.buf = 0;
+  Array text = lines_pending_text;
+  lines_pending_text = (Array)ARRAY_DICT_INIT;
+  if (buf) {
+    send_bytes_event(buf, lines_pending.changedtick, lines_pending.splice,
+                     text);
+  } else {
+    api_free_array(text);
+  }
+}
+
+static void schedule_bytes_event(void)
+{
+  if (!bytes_event_scheduled) {
+    bytes_event_scheduled = true;
+    multiqueue_put(main_loop.events, buf_updates_bytes_event, 0);
+  }
+}
+
+/// Ends the changes made before the editor got back to processing events:
+/// the change held back is not followed by its splice anymore.
+static void buf_updates_bytes_event(void **argv)
+{
+  bytes_event_scheduled = false;
+  send_lines_pending();
+  spliced_buf = 0;
+}
+
+/// Stops or resumes sending splices to the "bytes" channels. Used by undo,
+/// which restores the extmarks after it already sent the changed lines.
+void buf_updates_skip_splices(bool skip)
+{
+  splice_skip = skip;
+}
+
 void buf_updates_send_splice(buf_T *buf,
                              linenr_T start_line, colnr_T start_col,
                              linenr_T oldextent_line, colnr_T oldextent_col,
@@ -290,6 +594,44 @@ void buf_updates_send_splice(buf_T *buf,
     return;
   }
 
+  bool send_bytes = false;
+  for (size_t i = 0; i < kv_size(buf->update_channels); i++) {
+    if (kv_A(buf->update_channels, i).bytes) {
+      send_bytes = true;
+    }
+  }
+
+  if (send_bytes && !splice_skip) {
+    ExtmarkSplice splice = { (int)start_line, start_col,
+                             (int)oldextent_line, oldextent_col,
+                             (int)newextent_line, newextent_col };
+    if (lines_pending.buf == buf->handle
+        && splice_overlaps(lines_pending.splice, splice)) {
+      // the change was reported before it was spliced, it is sent as the
+      // splice and its buf_updates_send_changes() is already done
+      api_free_array(lines_pending_text);
+      lines_pending_text = (Array)ARRAY_DICT_INIT;
+      lines_pending.buf = 0;
+    } else {
+      send_lines_pending();
+      spliced_buf = buf->handle;
+      schedule_bytes_event();
+    }
+
+    // The batched commands change the text from the top down and only update
+    // the buffer after they made the splices. The inserted text is read when
+    // the batch is done: later splices do not move the text of earlier ones.
+    if (extmark_splice_batch_active()) {
+      kv_push(splice_pending, ((PendingSplice){
+        .buf = buf->handle,
+        .changedtick = buf_get_changedtick(buf),
+        .splice = splice }));
+    } else {
+      send_bytes_event(buf, buf_get_changedtick(buf), splice,
+                       (Array)ARRAY_DICT_INIT);
+    }
+  }
+
   // notify each of the active callbakcs
   size_t j = 0;
   for (size_t i = 0; i < kv_size(buf->update_callbacks); i++) {
@@ -331,9 +673,12 @@ void buf_updates_send_splice(buf_T *buf,
 }
 void buf_updates_changedtick(buf_T *buf)
 {
+  // the tick must not overtake the lines changed before it
+  buf_updates_flush(buf);
+
   // notify each of the active channels
   for (size_t i = 0; i < kv_size(buf->update_channels); i++) {
-    uint64_t channel_id = kv_A(buf->update_channels, i);
+    uint64_t channel_id = kv_A(buf->update_channels, i).channel_id;
     buf_updates_changedtick_single(buf, channel_id);
   }
   size_t j = 0;
@@ -901,7 +901,10 @@ int do_move(linenr_T line1, linenr_T line2, linenr_T dest)
   mark_adjust_nofold(last_line - num_lines + 1, last_line,
                      -(last_line - dest - extra), 0L, kExtmarkNOOP);
 
-  // extmarks are handled separately
+  // extmarks are handled separately, the text of the move is sent to the
+  // "bytes" channels when the original lines are deleted and both changes
+  // were reported
+  extmark_splice_batch_start();
   int size = line2-line1+1;
   int off = dest >= line2 ? -size : 0;
   extmark_move_region(curbuf, line1-1, 0,
@@ -916,8 +919,10 @@ int do_move(linenr_T line1, linenr_T line2, linenr_T dest)
   /*
    * Now we delete the original text -- webb
    */
-  if (u_save(line1 + extra - 1, line2 + extra + 1) == FAIL)
+  if (u_save(line1 + extra - 1, line2 + extra + 1) == FAIL) {
+    extmark_splice_batch_end();
     return FAIL;
+  }
 
   for (l = line1; l <= line2; l++) {
     ml_delete(line1 + extra, true);
@@ -949,6 +954,7 @@ int do_move(linenr_T line1, linenr_T line2, linenr_T dest)
 
   // send nvim_buf_lines_event regarding lines that were deleted
   buf_updates_send_changes(curbuf, line1 + extra, 0, num_lines, true);
+  extmark_splice_batch_end();
 
   return OK;
 }
@@ -3441,6 +3447,7 @@ static buf_T *do_sub(exarg_T *eap, proftime_T timeout,
   // If preview: limit to max('cmdwinheight', viewport).
   linenr_T line2 = eap->line2;
 
+  extmark_splice_batch_start();
   for (linenr_T lnum = eap->line1;
        lnum <= line2 && !got_quit && !aborting()
        && (!preview || preview_lines.lines_needed <= (linenr_T)p_cwh
@@ -4108,6 +4115,7 @@ skip:
       got_quit = true;
     }
   }
+  extmark_splice_batch_end();
 
   if (first_line != 0) {
     /* Need to subtract the number of added lines from "last_line" to get
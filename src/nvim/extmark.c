@@ -8,7 +8,10 @@
 // A map of pointers to the marks is used for fast lookup by mark id.
 //
 // Marks are moved by calls to extmark_splice. Additionally mark_adjust
-// might adjust extmarks to line inserts/deletes.
+// might adjust extmarks to line inserts/deletes. Inside a batch, see
+// extmark_splice_batch_start(), the splices are only collected and then
+// applied together by extmark_splice_flush(). Everything reading or changing
+// the marks must flush first.
 //
 // Undo/Redo of marks is implemented by storing the call arguments to
 // extmark_splice. The list of arguments is applied in extmark_apply_undo.
@@ -48,6 +51,13 @@
 # include "extmark.c.generated.h"
 #endif
 
+// splices not yet applied to the marks of "splice_buf", all with the same
+// "splice_undo". Each starts at or after the new end of the one before.
+static kvec_t(mtsplice_t) splice_pending = KV_INITIAL_VALUE;
+static buf_T *splice_buf = NULL;
+static ExtmarkOp splice_undo = kExtmarkNOOP;
+static int splice_batch = 0;
+
 static ExtmarkNs *buf_ns_ref(buf_T *buf, uint64_t ns_id, bool put) {
   if (!buf->b_extmark_ns) {
     if (!put) {
@@ -73,6 +83,7 @@ static ExtmarkNs *buf_ns_ref(buf_T *buf, uint64_t ns_id, bool put) {
 uint64_t extmark_set(buf_T *buf, uint64_t ns_id, uint64_t id,
                      int row, colnr_T col, ExtmarkOp op)
 {
+  extmark_splice_flush();
   ExtmarkNs *ns = buf_ns_ref(buf, ns_id, true);
   mtpos_t old_pos;
   uint64_t mark = 0;
@@ -101,7 +112,7 @@ uint64_t extmark_set(buf_T *buf, uint64_t ns_id, uint64_t id,
     }
   }
 
-  mark = marktree_put(buf->b_marktree, row, col, true);
+  mark = marktree_put(buf->b_marktree, row, col, true, ns_id);
 revised:
   map_put(uint64_t, ExtmarkItem)(buf->b_extmark_index, mark,
                                  (ExtmarkItem){ ns_id, id, 0,
@@ -119,6 +130,7 @@ revised:
 
 static bool extmark_setraw(buf_T *buf, uint64_t mark, int row, colnr_T col)
 {
+  extmark_splice_flush();
   MarkTreeIter itr[1];
   mtpos_t pos = marktree_lookup(buf->b_marktree, mark, itr);
   if (pos.row == -1) {
@@ -137,6 +149,7 @@ static bool extmark_setraw(buf_T *buf, uint64_t mark, int row, colnr_T col)
 // Returns 0 on missing id
 bool extmark_del(buf_T *buf, uint64_t ns_id, uint64_t id)
 {
+  extmark_splice_flush();
   ExtmarkNs *ns = buf_ns_ref(buf, ns_id, false);
   if (!ns) {
     return false;
@@ -182,6 +195,7 @@ bool extmark_clear(buf_T *buf, uint64_t ns_id,
                    int l_row, colnr_T l_col,
                    int u_row, colnr_T u_col)
 {
+  extmark_splice_flush();
   if (!buf->b_extmark_ns) {
     return false;
   }
@@ -190,15 +204,15 @@ bool extmark_clear(buf_T *buf, uint64_t ns_id,
 
   bool all_ns = (ns_id == 0);
   ExtmarkNs *ns = NULL;
+  // only visit the parts of the tree with marks of the namespace
+  uint64_t mask = UINT64_MAX;
   if (!all_ns) {
     ns = buf_ns_ref(buf, ns_id, false);
     if (!ns) {
       // nothing to do
       return false;
     }
-
-    // TODO(bfredl): if map_size(ns->map) << buf->b_marktree.n_nodes
-    // it could be faster to iterate over the map instead
+    mask = marktree_group_mask(ns_id);
   }
 
   // the value is either zero or the lnum (row+1) if highlight was present.
@@ -208,7 +222,8 @@ bool extmark_clear(buf_T *buf, uint64_t ns_id,
   }
 
   MarkTreeIter itr[1];
-  marktree_itr_get(buf->b_marktree, l_row, l_col, itr);
+  marktree_itr_get_filter(buf->b_marktree, (mtpos_t){ l_row, l_col }, itr,
+                          false, mask);
   while (true) {
     mtmark_t mark = marktree_itr_current(itr);
     if (mark.row < 0
@@ -248,7 +263,7 @@ bool extmark_clear(buf_T *buf, uint64_t ns_id,
       map_del(uint64_t, ExtmarkItem)(buf->b_extmark_index, mark.id);
       marktree_del_itr(buf->b_marktree, itr, false);
     } else {
-      marktree_itr_next(buf->b_marktree, itr);
+      marktree_itr_next_filter(buf->b_marktree, itr, mask);
     }
   }
   uint64_t id, status;
@@ -275,11 +290,14 @@ ExtmarkArray extmark_get(buf_T *buf, uint64_t ns_id,
                          int u_row, colnr_T u_col,
                          int64_t amount, bool reverse)
 {
+  extmark_splice_flush();
   ExtmarkArray array = KV_INITIAL_VALUE;
   MarkTreeIter itr[1];
-  // Find all the marks
-  marktree_itr_get_ext(buf->b_marktree, (mtpos_t){ l_row, l_col },
-                       itr, reverse, false, NULL);
+  // Find all the marks, skipping parts of the tree without marks of the
+  // namespace
+  uint64_t mask = marktree_group_mask(ns_id);
+  marktree_itr_get_filter(buf->b_marktree, (mtpos_t){ l_row, l_col },
+                          itr, reverse, mask);
   int order = reverse ? -1 : 1;
   while ((int64_t)kv_size(array) < amount) {
     mtmark_t mark = marktree_itr_current(itr);
@@ -296,9 +314,9 @@ ExtmarkArray extmark_get(buf_T *buf, uint64_t ns_id,
                                       .row = mark.row, .col = mark.col }));
     }
     if (reverse) {
-      marktree_itr_prev(buf->b_marktree, itr);
+      marktree_itr_prev_filter(buf->b_marktree, itr, mask);
     } else {
-      marktree_itr_next(buf->b_marktree, itr);
+      marktree_itr_next_filter(buf->b_marktree, itr, mask);
     }
   }
   return array;
@@ -307,6 +325,7 @@ ExtmarkArray extmark_get(buf_T *buf, uint64_t ns_id,
 // Lookup an extmark by id
 ExtmarkInfo extmark_from_id(buf_T *buf, uint64_t ns_id, uint64_t id)
 {
+  extmark_splice_flush();
   ExtmarkNs *ns = buf_ns_ref(buf, ns_id, false);
   ExtmarkInfo ret = { 0, 0, -1, -1 };
   if (!ns) {
@@ -333,6 +352,11 @@ ExtmarkInfo extmark_from_id(buf_T *buf, uint64_t ns_id, uint64_t id)
 // free extmarks from the buffer
 void extmark_free_all(buf_T *buf)
 {
+  if (buf == splice_buf) {
+    kv_size(splice_pending) = 0;
+    splice_buf = NULL;
+  }
+
   if (!buf->b_extmark_ns) {
     return;
   }
@@ -511,70 +535,214 @@ void extmark_splice(buf_T *buf,
                           oldextent_row, oldextent_col,
                           newextent_row, newextent_col);
 
-  if (undo == kExtmarkUndo && (oldextent_row > 0 || oldextent_col > 0)) {
+  if (splice_batch == 0 && !reg_executing) {
+    extmark_splice_flush();
+    splice_apply(buf, (ExtmarkSplice){ start_row, start_col,
+                                       oldextent_row, oldextent_col,
+                                       newextent_row, newextent_col }, undo);
+    return;
+  }
+
+  if (kv_size(splice_pending)) {
+    mtsplice_t last = kv_last(splice_pending);
+    int end_row = last.start.row + last.new_extent.row;
+    colnr_T end_col = (last.new_extent.row ? 0 : last.start.col)
+                      + last.new_extent.col;
+    if (buf != splice_buf || undo != splice_undo || start_row < end_row
+        || (start_row == end_row && start_col < end_col)) {
+      extmark_splice_flush();
+    }
+  }
+  splice_buf = buf;
+  splice_undo = undo;
+  kv_push(splice_pending, ((mtsplice_t){
+    .start = { start_row, start_col },
+    .old_extent = { oldextent_row, oldextent_col },
+    .new_extent = { newextent_row, newextent_col } }));
+}
+
+/// Start collecting the splices of text changes, to apply them in one go at
+/// the matching extmark_splice_batch_end(). Used by commands which change
+/// many places from the top down, like ":s" with many matches. Splices are
+/// also collected while a register is executed, until it is done.
+void extmark_splice_batch_start(void)
+{
+  splice_batch++;
+}
+
+void extmark_splice_batch_end(void)
+{
+  assert(splice_batch > 0);
+  splice_batch--;
+  if (splice_batch == 0) {
+    if (!reg_executing) {
+      extmark_splice_flush();
+    }
+    buf_updates_send_pending_splices();
+  }
+}
+
+/// Whether the splices are collected by extmark_splice_batch_start().
+bool extmark_splice_batch_active(void)
+{
+  return splice_batch > 0;
+}
+
+/// Apply the splices collected since extmark_splice_batch_start().
+///
+/// When there are few marks in the changed range, the whole range is
+/// spliced once and undo gets a single splice, see marktree_splice_batch().
+void extmark_splice_flush(void)
+{
+  if (kv_size(splice_pending) == 0) {
+    return;
+  }
+  // take the list, flushing again must not see it
+  mtsplice_t *items = splice_pending.items;
+  size_t n = kv_size(splice_pending);
+  buf_T *buf = splice_buf;
+  ExtmarkOp undo = splice_undo;
+  kv_init(splice_pending);
+  splice_buf = NULL;
+
+  mtsplice_t total;
+  mtmoves_t moved = KV_INITIAL_VALUE;
+  if (n > 1
+      && marktree_splice_batch(buf->b_marktree, items, n, &total, &moved)) {
+    if (undo == kExtmarkUndo) {
+      u_extmark_splice_batch(buf, total, moved);
+    }
+  } else {
+    for (size_t i = 0; i < n; i++) {
+      mtsplice_t item = items[i];
+      splice_apply(buf, (ExtmarkSplice){ item.start.row, item.start.col,
+                                         item.old_extent.row,
+                                         item.old_extent.col,
+                                         item.new_extent.row,
+                                         item.new_extent.col }, undo);
+    }
+  }
+  kv_destroy(moved);
+  xfree(items);
+}
+
+static void splice_apply(buf_T *buf, ExtmarkSplice splice, ExtmarkOp undo)
+{
+  if (undo == kExtmarkUndo
+      && (splice.oldextent_row > 0 || splice.oldextent_col > 0)) {
     // Copy marks that would be effected by delete
     // TODO(bfredl): Be "smart" about gravity here, left-gravity at the
     // beginning and right-gravity at the end need not be preserved.
     // Also be smart about marks that already have been saved (important for
     // merge!)
-    int end_row = start_row + oldextent_row;
-    int end_col = (oldextent_row ? 0 : start_col) + oldextent_col;
-    u_extmark_copy(buf, start_row, start_col, end_row, end_col);
+    int end_row = splice.start_row + splice.oldextent_row;
+    int end_col = (splice.oldextent_row ? 0 : splice.start_col)
+                  + splice.oldextent_col;
+    u_extmark_copy(buf, splice.start_row, splice.start_col, end_row, end_col);
   }
 
 
-  marktree_splice(buf->b_marktree, start_row, start_col,
-                  oldextent_row, oldextent_col,
-                  newextent_row, newextent_col);
+  marktree_splice(buf->b_marktree, splice.start_row, splice.start_col,
+                  splice.oldextent_row, splice.oldextent_col,
+                  splice.newextent_row, splice.newextent_col);
 
   if (undo == kExtmarkUndo) {
-    u_header_T  *uhp = u_force_get_undo_header(buf);
-    if (!uhp) {
-      return;
-    }
+    u_extmark_splice(buf, splice);
+  }
+}
+
+// Save info for undo/redo of a splice
+static void u_extmark_splice(buf_T *buf, ExtmarkSplice splice)
+{
+  u_header_T  *uhp = u_force_get_undo_header(buf);
+  if (!uhp) {
+    return;
+  }
 
-    bool merged = false;
-    // TODO(bfredl): this is quite rudimentary. We merge small (within line)
-    // inserts with each other and small deletes with each other. Add full
-    // merge algorithm later.
-    if (oldextent_row == 0 && newextent_row == 0 && kv_size(uhp->uh_extmark))  {
-      ExtmarkUndoObject *item = &kv_A(uhp->uh_extmark,
-                                      kv_size(uhp->uh_extmark)-1);
-      if (item->type == kExtmarkSplice) {
-        ExtmarkSplice *splice = &item->data.splice;
-        if (splice->start_row == start_row && splice->oldextent_row == 0
-            && splice->newextent_row == 0) {
-          if (oldextent_col == 0 && start_col >= splice->start_col
-              && start_col <= splice->start_col+splice->newextent_col) {
-            splice->newextent_col += newextent_col;
-            merged = true;
-          } else if (newextent_col == 0
-                     && start_col == splice->start_col+splice->newextent_col) {
-            splice->oldextent_col += oldextent_col;
-            merged = true;
-          } else if (newextent_col == 0
-                     && start_col + oldextent_col == splice->start_col) {
-            splice->start_col = start_col;
-            splice->oldextent_col += oldextent_col;
-            merged = true;
-          }
+  // TODO(bfredl): this is quite rudimentary. We merge small (within line)
+  // inserts with each other and small deletes with each other. Add full
+  // merge algorithm later.
+  if (splice.oldextent_row == 0 && splice.newextent_row == 0
+      && kv_size(uhp->uh_extmark))  {
+    ExtmarkUndoObject *item = &kv_A(uhp->uh_extmark,
+                                    kv_size(uhp->uh_extmark)-1);
+    if (item->type == kExtmarkSplice) {
+      ExtmarkSplice *last = &item->data.splice;
+      if (last->start_row == splice.start_row && last->oldextent_row == 0
+          && last->newextent_row == 0) {
+        if (splice.oldextent_col == 0 && splice.start_col >= last->start_col
+            && splice.start_col <= last->start_col+last->newextent_col) {
+          last->newextent_col += splice.newextent_col;
+          return;
+        } else if (splice.newextent_col == 0
+                   && splice.start_col == last->start_col+last->newextent_col) {
+          last->oldextent_col += splice.oldextent_col;
+          return;
+        } else if (splice.newextent_col == 0
+                   && splice.start_col + splice.oldextent_col
+                   == last->start_col) {
+          last->start_col = splice.start_col;
+          last->oldextent_col += splice.oldextent_col;
+          return;
         }
       }
     }
+  }
+
+  kv_push(uhp->uh_extmark,
+          ((ExtmarkUndoObject){ .type = kExtmarkSplice,
+                                .data.splice = splice }));
+}
 
-    if (!merged) {
-      ExtmarkSplice splice;
-      splice.start_row = start_row;
-      splice.start_col = start_col;
-      splice.oldextent_row = oldextent_row;
-      splice.oldextent_col = oldextent_col;
-      splice.newextent_row = newextent_row;
-      splice.newextent_col = newextent_col;
+// Save info for undo/redo of the splices applied together by
+// marktree_splice_batch(). Undo first reverts the whole range and then puts
+// back the marks that were in it, redo puts them at their new positions after
+// the whole range is spliced again.
+static void u_extmark_splice_batch(buf_T *buf, mtsplice_t total,
+                                   mtmoves_t moved)
+{
+  u_header_T  *uhp = u_force_get_undo_header(buf);
+  if (!uhp) {
+    return;
+  }
 
-      kv_push(uhp->uh_extmark,
-              ((ExtmarkUndoObject){ .type = kExtmarkSplice,
-                                    .data.splice = splice }));
+  mtpos_t start = total.start;
+  mtpos_t old_end = { start.row + total.old_extent.row,
+                      (total.old_extent.row ? 0 : start.col)
+                      + total.old_extent.col };
+  mtpos_t new_end = { start.row + total.new_extent.row,
+                      (total.new_extent.row ? 0 : start.col)
+                      + total.new_extent.col };
+
+  for (size_t i = 0; i < kv_size(moved); i++) {
+    mtmove_t move = kv_A(moved, i);
+    mtpos_t undone = move.right_gravity ? old_end : start;
+    if (move.old.row == undone.row && move.old.col == undone.col) {
+      continue;
     }
+    ExtmarkSavePos pos = { .mark = move.id,
+                           .old_row = move.old.row, .old_col = move.old.col,
+                           .row = -1, .col = -1 };
+    kv_push(uhp->uh_extmark, ((ExtmarkUndoObject){ .type = kExtmarkSavePos,
+                                                   .data.savepos = pos }));
+  }
+
+  u_extmark_splice(buf, (ExtmarkSplice){ start.row, start.col,
+                                         total.old_extent.row,
+                                         total.old_extent.col,
+                                         total.new_extent.row,
+                                         total.new_extent.col });
+
+  for (size_t i = 0; i < kv_size(moved); i++) {
+    mtmove_t move = kv_A(moved, i);
+    mtpos_t redone = move.right_gravity ? new_end : start;
+    if (move.new.row == redone.row && move.new.col == redone.col) {
+      continue;
+    }
+    ExtmarkSavePos pos = { .mark = move.id, .old_row = -1, .old_col = -1,
+                           .row = move.new.row, .col = move.new.col };
+    kv_push(uhp->uh_extmark, ((ExtmarkUndoObject){ .type = kExtmarkSavePos,
+                                                   .data.savepos = pos }));
   }
 }
 
@@ -585,9 +753,11 @@ void extmark_move_region(buf_T *buf,
                          int new_row, colnr_T new_col,
                          ExtmarkOp undo)
 {
+  extmark_splice_flush();
   // TODO(bfredl): this is not synced to the buffer state inside the callback.
   // But unless we make the undo implementation smarter, this is not ensured
-  // anyway.
+  // anyway. The "bytes" channels get the moved text when do_move() ends its
+  // splice batch.
   buf_updates_send_splice(buf, start_row, start_col,
                           extent_row, extent_col,
                           0, 0);
@@ -652,6 +822,7 @@ uint64_t extmark_add_decoration(buf_T *buf, uint64_t ns_id, int hl_id,
                                 int end_row, colnr_T end_col,
                                 VirtText virt_text)
 {
+  extmark_splice_flush();
   ExtmarkNs *ns = buf_ns_ref(buf, ns_id, true);
   ExtmarkItem item;
   item.ns_id = ns_id;
@@ -664,9 +835,9 @@ uint64_t extmark_add_decoration(buf_T *buf, uint64_t ns_id, int hl_id,
   if (end_row > -1) {
     mark = marktree_put_pair(buf->b_marktree,
                              start_row, start_col, true,
-                             end_row, end_col, false);
+                             end_row, end_col, false, ns_id);
   } else {
-    mark = marktree_put(buf->b_marktree, start_row, start_col, true);
+    mark = marktree_put(buf->b_marktree, start_row, start_col, true, ns_id);
   }
 
   map_put(uint64_t, ExtmarkItem)(buf->b_extmark_index, mark, item);
@@ -677,6 +848,48 @@ uint64_t extmark_add_decoration(buf_T *buf, uint64_t ns_id, int hl_id,
   return item.mark_id;
 }
 
+/// Add many extmarks or highlights to a buffer at once.
+///
+/// Much faster than extmark_set() or extmark_add_decoration() for each of
+/// them, see marktree_put_batch().
+///
+/// @param buf The buffer to add the marks to
+/// @param ns_id A valid namespace id.
+/// @param hl_id Id of the highlight group of the ranges (or zero)
+/// @param[in,out] items Positions of the marks, the extmark ids are returned
+///                      in the "id" fields
+/// @param n Number of items
+void extmark_add_batch(buf_T *buf, uint64_t ns_id, int hl_id,
+                       mtbatch_t *items, size_t n)
+{
+  extmark_splice_flush();
+  ExtmarkNs *ns = buf_ns_ref(buf, ns_id, true);
+  marktree_put_batch(buf->b_marktree, items, n, ns_id);
+
+  int min_row = MAXLNUM, max_row = -1;
+  for (size_t i = 0; i < n; i++) {
+    mtbatch_t *it = &items[i];
+    uint64_t mark = it->id;
+    bool paired = it->end_row >= 0;
+    uint64_t id = ns->free_id++;
+    map_put(uint64_t, ExtmarkItem)(buf->b_extmark_index, mark,
+                                   (ExtmarkItem){ ns_id, id,
+                                                  paired ? hl_id : 0,
+                                                  KV_INITIAL_VALUE });
+    map_put(uint64_t, uint64_t)(ns->map, id, mark);
+    if (!paired) {
+      u_extmark_set(buf, mark, it->start_row, it->start_col);
+    }
+    min_row = MIN(min_row, it->start_row);
+    max_row = MAX(max_row, MAX(it->start_row, it->end_row));
+    it->id = id;
+  }
+
+  if (hl_id && max_row >= 0) {
+    redraw_buf_range_later(buf, min_row+1, max_row+1);
+  }
+}
+
 /// Add highlighting to a buffer, bounded by two cursor positions,
 /// with an offset.
 ///
@@ -729,6 +942,7 @@ void clear_virttext(VirtText *text)
 
 VirtText *extmark_find_virttext(buf_T *buf, int row, uint64_t ns_id)
 {
+  extmark_splice_flush();
   MarkTreeIter itr[1];
   marktree_itr_get(buf->b_marktree, row, 0,  itr);
   while (true) {
@@ -757,54 +971,33 @@ bool extmark_decorations_reset(buf_T *buf, DecorationState *state)
 
 bool extmark_decorations_start(buf_T *buf, int top_row, DecorationState *state)
 {
+  extmark_splice_flush();
   kv_size(state->active) = 0;
   state->top_row = top_row;
-  marktree_itr_get(buf->b_marktree, top_row, 0, state->itr);
-  if (!state->itr->node) {
+  if (buf->b_marktree->n_keys == 0) {
+    state->itr->node = NULL;
     return false;
   }
-  marktree_itr_rewind(buf->b_marktree, state->itr);
-  while (true) {
-    mtmark_t mark = marktree_itr_current(state->itr);
-    if (mark.row < 0) {  // || mark.row > end_row
-      break;
-    }
-    // TODO(bfredl): dedicated flag for being a decoration?
-    if ((mark.row < top_row && mark.id&MARKTREE_END_FLAG)) {
-      goto next_mark;
-    }
-    mtpos_t altpos = marktree_lookup(buf->b_marktree,
-                                     mark.id^MARKTREE_END_FLAG, NULL);
 
-    uint64_t start_id = mark.id & ~MARKTREE_END_FLAG;
+  // ranges which started above top_row and continue into it
+  mtpairs_t pairs = KV_INITIAL_VALUE;
+  marktree_get_overlap(buf->b_marktree, top_row, 0, &pairs);
+  for (size_t i = 0; i < kv_size(pairs); i++) {
+    mtpair_t pair = kv_A(pairs, i);
     ExtmarkItem *item = map_ref(uint64_t, ExtmarkItem)(buf->b_extmark_index,
-                                                       start_id, false);
-    if ((!(mark.id&MARKTREE_END_FLAG) && altpos.row < top_row
-         && !kv_size(item->virt_text))
-        || ((mark.id&MARKTREE_END_FLAG) && altpos.row >= top_row)) {
-      goto next_mark;
-    }
-
+                                                       pair.id, false);
     if (item && (item->hl_id > 0 || kv_size(item->virt_text))) {
       int attr_id = item->hl_id > 0 ? syn_id2attr(item->hl_id) : 0;
       VirtText *vt = kv_size(item->virt_text) ? &item->virt_text : NULL;
-      HlRange range;
-      if (mark.id&MARKTREE_END_FLAG) {
-        range = (HlRange){ altpos.row, altpos.col, mark.row, mark.col,
-                           attr_id, vt };
-      } else {
-        range = (HlRange){ mark.row, mark.col, altpos.row,
-                           altpos.col, attr_id, vt };
-      }
-      kv_push(state->active, range);
-    }
-next_mark:
-    if (marktree_itr_node_done(state->itr)) {
-      break;
+      kv_push(state->active, ((HlRange){ pair.start.row, pair.start.col,
+                                         pair.end.row, pair.end.col,
+                                         attr_id, vt }));
     }
-    marktree_itr_next(buf->b_marktree, state->itr);
   }
+  kv_destroy(pairs);
 
+  // marks from top_row on are read by extmark_decorations_col()
+  marktree_itr_get(buf->b_marktree, top_row, 0, state->itr);
   return true;  // TODO(bfredl): check if available in the region
 }
 
@@ -10,6 +10,16 @@
 #include <inttypes.h>
 #include <fcntl.h>
 
+#include "auto/config.h"
+
+#ifdef HAVE_SYS_UIO_H
+# include <sys/uio.h>
+#endif
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 #include "nvim/vim.h"
 #include "nvim/api/private/handle.h"
 #include "nvim/ascii.h"
@@ -29,6 +39,7 @@
 #include "nvim/getchar.h"
 #include "nvim/hashtab.h"
 #include "nvim/iconv.h"
+#include "nvim/lib/kvec.h"
 #include "nvim/mbyte.h"
 #include "nvim/memfile.h"
 #include "nvim/memline.h"
@@ -61,6 +72,9 @@
 
 #define BUFSIZE         8192    /* size of normal write buffer */
 #define SMBUFSIZE       256     /* size of emergency write buffer */
+// Size of the write buffer when lines are written without conversion, see
+// buf_write_lines().
+#define WRITE_LINES_BUFSIZE (64 * 1024)
 
 //
 // The autocommands are stored in a list for each event.
@@ -121,6 +135,13 @@ typedef struct AutoPat {
   char last;                            // last pattern for apply_autocmds()
 } AutoPat;
 
+/// Lines found by readfile() that were not added to the buffer yet.  The text
+/// is in the read buffer, not NUL terminated.
+typedef struct {
+  kvec_t(char_u *) text;
+  kvec_t(colnr_T) len;                  // length plus one, as for ml_append()
+} ReadLines;
+
 ///
 /// Struct used to keep status while executing autocommands for an event.
 ///
@@ -160,6 +181,10 @@ typedef struct AutoPatCmd {
  * with iconv() to be able to allocate a buffer. */
 #define ICONV_MULT 8
 
+// Number of bytes of a memory mapped file handed out at a time, see
+// 'mmapsize'.
+#define READ_MAP_WINDOW (1024L * 1024L)
+
 /*
  * Structure to pass arguments from buf_write() to buf_write_bytes().
  */
@@ -239,7 +264,8 @@ static AutoPat *last_autopat[NUM_EVENTS] = {
  *
  * 1. We allocate blocks with try_malloc, as big as possible.
  * 2. Each block is filled with characters from the file with a single read().
- * 3. The lines are inserted in the buffer with ml_append().
+ * 3. The lines are inserted in the buffer with ml_append_lines(), once for
+ *    each block.
  *
  * (caller must check that fname != NULL, unless READ_STDIN is used)
  *
@@ -313,6 +339,10 @@ readfile(
   linenr_T read_no_eol_lnum = 0;        // non-zero lnum when last line of
                                         // last read was missing the eol
   bool file_rewind = false;
+  off_T resume_off = -1;                // when rewinding: offset where to
+                                        // continue reading, -1 for the start
+  bool ascii_only = true;               // all lines read so far are ASCII
+  ReadLines read_lines = { KV_INITIAL_VALUE, KV_INITIAL_VALUE };
   int can_retry;
   linenr_T conv_error = 0;              // line nr with conversion error
   linenr_T illegal_byte = 0;            // line nr with illegal byte
@@ -338,6 +368,11 @@ readfile(
                                            wasn't possible */
   char_u conv_rest[CONV_RESTLEN];
   int conv_restlen = 0;                 /* nr of bytes in conv_rest[] */
+  char_u      *map_base = NULL;         // memory mapping of the file or NULL
+  size_t map_len = 0;                   // length of "map_base"
+  size_t map_off = 0;                   // offset of next byte to hand out
+  size_t map_freed = 0;                 // offset up to where pages were freed
+  bool map_active = false;              // bytes are taken from "map_base"
   buf_T       *old_curbuf;
   char_u      *old_b_ffname;
   char_u      *old_b_fname;
@@ -802,7 +837,7 @@ readfile(
    */
 retry:
 
-  if (file_rewind) {
+  if (file_rewind && resume_off < 0) {
     if (read_buffer) {
       read_buf_lnum = 1;
       read_buf_col = 0;
@@ -965,7 +1000,27 @@ retry:
    * stdin or fixed at a specific encoding. */
   can_retry = (*fenc != NUL && !read_stdin && !keep_dest_enc && !read_fifo);
 
-  if (!skip_read) {
+  if (resume_off >= 0) {
+    if ((fio_flags == 0 || fio_flags == FIO_LATIN1)
+# ifdef HAVE_ICONV
+        && iconv_fd == (iconv_t)-1
+# endif
+        && tmpname == NULL
+        && vim_lseek(fd, resume_off, SEEK_SET) == resume_off) {
+      // The lines read so far are the same in "fenc", continue after them.
+      file_rewind = false;
+      filesize -= linerest;
+      linerest = 0;
+      conv_restlen = 0;
+    } else {
+      // Need to read the whole file again.
+      resume_off = -1;
+      goto retry;
+    }
+  }
+
+  if (!skip_read && resume_off < 0) {
+    ascii_only = true;
     linerest = 0;
     filesize = 0;
     skip_count = lines_to_skip;
@@ -982,6 +1037,50 @@ retry:
       sha256_start(&sha_ctx);
   }
 
+#ifdef HAVE_SYS_MMAN_H
+  // Take the bytes from a memory mapping of the file, unless a conversion is
+  // needed that requires room in the read buffer.  Dropping bad bytes would
+  // make the text no longer end where the mapped bytes end.
+  bool want_map = p_mms > 0 && !read_buffer && !read_stdin && !read_fifo
+                  && tmpname == NULL && bad_char_behavior != BAD_DROP
+                  && (fio_flags == 0 || fio_flags == FIO_UCSBOM)
+# ifdef HAVE_ICONV
+                  && iconv_fd == (iconv_t)-1
+# endif
+                  ;
+  if (map_active && !want_map) {
+    // A BOM was found that requires converting: read the file with read(),
+    // starting at the first byte that was not used yet.
+    map_active = false;
+    if (skip_read) {
+      off_T off = (off_T)(ptr - map_base);
+      if (tmpname == NULL && vim_lseek(fd, off, SEEK_SET) != off) {
+        error = true;
+        goto failed;
+      }
+      skip_read = false;
+    }
+  } else if (want_map && !skip_read) {
+    FileInfo map_info;
+    if (map_base == NULL
+        && os_fileinfo_fd(fd, &map_info)
+        && S_ISREG(map_info.stat.st_mode)
+        && os_fileinfo_size(&map_info) >= (uint64_t)p_mms * 1024
+        && os_fileinfo_size(&map_info) <= SIZE_MAX) {
+      map_len = (size_t)os_fileinfo_size(&map_info);
+      map_base = (char_u *)os_mmap_read(fd, map_len);
+    }
+    map_active = map_base != NULL;
+    if (resume_off < 0) {
+      map_off = 0;
+      map_freed = 0;
+    } else {
+      map_off = (size_t)resume_off;
+    }
+  }
+#endif
+  resume_off = -1;
+
   while (!error && !got_int) {
     /*
      * We allocate as much space for the file as we can get, plus
@@ -991,6 +1090,21 @@ retry:
      */
     {
       if (!skip_read) {
+#ifdef HAVE_SYS_MMAN_H
+        if (map_active && map_off < map_len) {
+          // Hand out the next part of the mapping.  The rest of the previous
+          // line and the unconverted bytes are right in front of it.
+          ptr = map_base + map_off;
+          line_start = ptr - conv_restlen - linerest;
+          size = (long)MIN(map_len - map_off, (size_t)READ_MAP_WINDOW);
+          real_size = size;
+          map_off += (size_t)size;
+          // Lines before "line_start" have been stored in the memline.
+          map_freed += os_mmap_discard((char *)map_base + map_freed,
+                                       (size_t)(line_start - map_base)
+                                       - map_freed);
+        } else {
+#endif
         size = 0x10000L;                            /* use buffer >= 64K */
 
         for (; size >= 10; size /= 2) {
@@ -1095,6 +1209,9 @@ retry:
               }
             }
           }
+        } else if (map_active) {
+          // All of the mapping was used, no more bytes to read.
+          size = 0;
         } else {
           /*
            * Read bytes from the file.
@@ -1155,6 +1272,9 @@ retry:
             }
           }
         }
+#ifdef HAVE_SYS_MMAN_H
+        }
+#endif
       }
 
       skip_read = FALSE;
@@ -1183,7 +1303,13 @@ retry:
           /* Remove BOM from the text */
           filesize += blen;
           size -= blen;
-          memmove(ptr, ptr + blen, (size_t)size);
+          if (map_active) {
+            ptr += blen;
+            line_start = ptr;
+          } else {
+            memmove(ptr, ptr + blen, (size_t)size);
+          }
+          ascii_only = false;
           if (set_options) {
             curbuf->b_p_bomb = TRUE;
             curbuf->b_start_bomb = TRUE;
@@ -1437,9 +1563,11 @@ retry:
         ptr = dest;
       } else if (enc_utf8 && !curbuf->b_p_bin) {
         int incomplete_tail = FALSE;
+        bool non_ascii = false;
 
         // Reading UTF-8: Check if the bytes are valid UTF-8.
         for (p = ptr;; p++) {
+          p = readfile_skip_ascii(p, ptr + size);
           int todo = (int)((ptr + size) - p);
           int l;
 
@@ -1447,6 +1575,7 @@ retry:
             break;
           }
           if (*p >= 0x80) {
+            non_ascii = true;
             // A length of 1 means it's an illegal byte.  Accept
             // an incomplete character at the end though, the next
             // read() will get the next bytes, we'll check it
@@ -1498,6 +1627,21 @@ retry:
         }
         if (p < ptr + size && !incomplete_tail) {
           /* Detected a UTF-8 error. */
+          if (ascii_only && fio_flags == 0
+# ifdef HAVE_ICONV
+              && iconv_fd == (iconv_t)-1
+# endif
+              && tmpname == NULL && !read_buffer && !read_stdin) {
+            // All lines before "line_start" are ASCII.  The next encoding
+            // may read them the same way, then only the bytes from
+            // "line_start" need to be read again.
+            off_T end_off = map_active ? (off_T)map_off
+                                       : vim_lseek(fd, (off_T)0L, SEEK_CUR);
+            if (end_off >= 0) {
+              resume_off = end_off - (off_T)((ptr + size) - line_start);
+              keep_fileformat = true;
+            }
+          }
 rewind_retry:
           // Retry reading with another conversion.
 # ifdef HAVE_ICONV
@@ -1514,6 +1658,9 @@ rewind_retry:
           file_rewind = true;
           goto retry;
         }
+        if (non_ascii) {
+          ascii_only = false;
+        }
       }
 
       /* count the number of characters (after conversion!) */
@@ -1583,29 +1730,32 @@ rewind_retry:
     }
 
     /*
-     * This loop is executed once for every character read.
+     * This loop is executed once for every line read.
      * Keep it fast!
      */
     if (fileformat == EOL_MAC) {
-      --ptr;
-      while (++ptr, --size >= 0) {
-        /* catch most common case first */
-        if ((c = *ptr) != NUL && c != CAR && c != NL)
-          continue;
+      while (size > 0) {
+        // Skip to the next NUL, CR or NL, most bytes are none of these.
+        p = readfile_find_eol(ptr, ptr + size, true);
+        size -= (long)(p - ptr);
+        ptr = p;
+        if (--size < 0) {
+          break;
+        }
+        c = *ptr;
         if (c == NUL)
           *ptr = NL;            /* NULs are replaced by newlines! */
         else if (c == NL)
           *ptr = CAR;           /* NLs are replaced by CRs! */
         else {
           if (skip_count == 0) {
-            *ptr = NUL;                     /* end of line */
+            // End of line.  Not replaced with a NUL, the buffer may be a
+            // memory mapping of the file.
             len = (colnr_T) (ptr - line_start + 1);
-            if (ml_append(lnum, line_start, len, newfile) == FAIL) {
-              error = TRUE;
-              break;
+            readfile_add_line(&read_lines, line_start, len);
+            if (read_undo_file) {
+              readfile_sha256_line(&sha_ctx, line_start, len);
             }
-            if (read_undo_file)
-              sha256_update(&sha_ctx, line_start, len);
             ++lnum;
             if (--read_count == 0) {
               error = TRUE;                     /* break loop */
@@ -1616,22 +1766,28 @@ rewind_retry:
             --skip_count;
           line_start = ptr + 1;
         }
+        ptr++;
       }
     } else {
-      --ptr;
-      while (++ptr, --size >= 0) {
-        if ((c = *ptr) != NUL && c != NL)          /* catch most common case */
-          continue;
+      while (size > 0) {
+        // Skip to the next NUL or NL, most bytes are neither.
+        p = readfile_find_eol(ptr, ptr + size, false);
+        size -= (long)(p - ptr);
+        ptr = p;
+        if (--size < 0) {
+          break;
+        }
+        c = *ptr;
         if (c == NUL)
           *ptr = NL;            /* NULs are replaced by newlines! */
         else {
           if (skip_count == 0) {
-            *ptr = NUL;                         /* end of line */
+            // End of line.  Not replaced with a NUL, the buffer may be a
+            // memory mapping of the file.
             len = (colnr_T)(ptr - line_start + 1);
             if (fileformat == EOL_DOS) {
               if (ptr > line_start && ptr[-1] == CAR) {
                 // remove CR before NL
-                ptr[-1] = NUL;
                 len--;
               } else if (ff_error != EOL_DOS) {
                 // Reading in Dos format, but no CR-LF found!
@@ -1642,6 +1798,10 @@ rewind_retry:
                     && !read_stdin
                     && (read_buffer
                         || vim_lseek(fd, (off_T)0L, SEEK_SET) == 0)) {
+                  // The lines not added yet don't need to be deleted.
+                  lnum -= (linenr_T)kv_size(read_lines.text);
+                  kv_size(read_lines.text) = 0;
+                  kv_size(read_lines.len) = 0;
                   fileformat = EOL_UNIX;
                   if (set_options)
                     set_fileformat(EOL_UNIX, OPT_LOCAL);
@@ -1652,12 +1812,10 @@ rewind_retry:
                 ff_error = EOL_DOS;
               }
             }
-            if (ml_append(lnum, line_start, len, newfile) == FAIL) {
-              error = TRUE;
-              break;
+            readfile_add_line(&read_lines, line_start, len);
+            if (read_undo_file) {
+              readfile_sha256_line(&sha_ctx, line_start, len);
             }
-            if (read_undo_file)
-              sha256_update(&sha_ctx, line_start, len);
             ++lnum;
             if (--read_count == 0) {
               error = TRUE;                         /* break loop */
@@ -1668,13 +1826,21 @@ rewind_retry:
             --skip_count;
           line_start = ptr + 1;
         }
+        ptr++;
       }
     }
+    // Add the lines before the read buffer is reused.
+    if (readfile_append_lines(&read_lines, lnum, newfile) == FAIL) {
+      error = true;
+    }
     linerest = (long)(ptr - line_start);
     os_breakcheck();
   }
 
 failed:
+  kv_destroy(read_lines.text);
+  kv_destroy(read_lines.len);
+
   /* not an error, max. number of lines reached */
   if (error && read_count == 0)
     error = FALSE;
@@ -1694,13 +1860,13 @@ failed:
     /* remember for when writing */
     if (set_options)
       curbuf->b_p_eol = FALSE;
-    *ptr = NUL;
     len = (colnr_T)(ptr - line_start + 1);
     if (ml_append(lnum, line_start, len, newfile) == FAIL)
       error = TRUE;
     else {
-      if (read_undo_file)
-        sha256_update(&sha_ctx, line_start, len);
+      if (read_undo_file) {
+        readfile_sha256_line(&sha_ctx, line_start, len);
+      }
       read_no_eol_lnum = ++lnum;
     }
   }
@@ -1730,6 +1896,11 @@ failed:
     (void)os_set_cloexec(fd);
   }
   xfree(buffer);
+#ifdef HAVE_SYS_MMAN_H
+  if (map_base != NULL) {
+    os_munmap((char *)map_base, map_len);
+  }
+#endif
 
   if (read_stdin) {
     close(0);
@@ -2006,6 +2177,89 @@ bool is_dev_fd_file(char_u *fname)
 #endif
 
 
+/// Find the first byte in [p, end) that ends a line or needs to be replaced
+/// by readfile(): a NUL or NL, and a CR when "mac" is true.
+///
+/// @return Pointer to the found byte or "end" when there is none.
+static char_u *readfile_find_eol(char_u *p, char_u *const end, const bool mac)
+  FUNC_ATTR_NONNULL_ALL FUNC_ATTR_PURE
+{
+#ifdef __SSE2__
+  const __m128i nul = _mm_setzero_si128();
+  const __m128i nl = _mm_set1_epi8(NL);
+  const __m128i cr = _mm_set1_epi8(mac ? CAR : NL);
+  while (end - p >= 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)p);
+    const int mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, nul),
+                                  _mm_cmpeq_epi8(v, nl)),
+                     _mm_cmpeq_epi8(v, cr)));
+    if (mask != 0) {
+      return p + __builtin_ctz((unsigned)mask);
+    }
+    p += 16;
+  }
+#endif
+  for (; p < end; p++) {
+    if (*p == NUL || *p == NL || (mac && *p == CAR)) {
+      break;
+    }
+  }
+  return p;
+}
+
+/// Find the first byte in [p, end) that is not ASCII.
+///
+/// @return Pointer to the found byte or "end" when there is none.
+static char_u *readfile_skip_ascii(char_u *p, char_u *const end)
+  FUNC_ATTR_NONNULL_ALL FUNC_ATTR_PURE
+{
+#ifdef __SSE2__
+  while (end - p >= 16) {
+    const int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p));
+    if (mask != 0) {
+      return p + __builtin_ctz((unsigned)mask);
+    }
+    p += 16;
+  }
+#endif
+  while (p < end && *p < 0x80) {
+    p++;
+  }
+  return p;
+}
+
+/// Add a line read by readfile() to the hash of the text.  The line is hashed
+/// with a terminating NUL, like u_compute_hash() does, but "line[len - 1]"
+/// does not need to be a NUL.
+static void readfile_sha256_line(context_sha256_T *ctx, const char_u *line,
+                                 colnr_T len)
+{
+  sha256_update(ctx, line, (size_t)len - 1);
+  sha256_update(ctx, (const char_u *)"", 1);
+}
+
+/// Remember a line for readfile_append_lines().
+static inline void readfile_add_line(ReadLines *rl, char_u *line, colnr_T len)
+{
+  kv_push(rl->text, line);
+  kv_push(rl->len, len);
+}
+
+/// Append the lines remembered by readfile_add_line() to the current buffer,
+/// "lnum" is the line number the last of them gets.
+static int readfile_append_lines(ReadLines *rl, linenr_T lnum, bool newfile)
+{
+  const size_t count = kv_size(rl->text);
+  if (count == 0) {
+    return OK;
+  }
+  kv_size(rl->text) = 0;
+  kv_size(rl->len) = 0;
+  return ml_append_lines(lnum - (linenr_T)count, rl->text.items, rl->len.items,
+                         (long)count, newfile);
+}
+
 /*
  * From the current line count and characters read after that, estimate the
  * line number where we are now.
@@ -2270,7 +2524,6 @@ buf_write(
                                            backup or new file */
 #endif
   int write_undo_file = FALSE;
-  context_sha256_T sha_ctx;
   unsigned int bkc = get_bkc_value(buf);
 
   if (fname == NULL || *fname == NUL)   /* safety check */
@@ -3233,25 +3486,29 @@ restore_backup:
 
     write_undo_file = (buf->b_p_udf && overwriting && !append
                        && !filtering && reset_changed && !checking_conversion);
-    if (write_undo_file) {
-      // Prepare for computing the hash value of the text.
-      sha256_start(&sha_ctx);
-    }
-
     write_info.bw_len = bufsize;
 #ifdef HAS_BW_FLAGS
     write_info.bw_flags = wb_flags;
 #endif
     fileformat = get_fileformat_force(buf, eap);
+    if (fileformat == EOL_UNIX && !checking_conversion && wb_flags == 0
+#ifdef HAVE_ICONV
+        && write_info.bw_iconv_fd == (iconv_t)-1
+#endif
+        ) {
+      // Nothing to convert: write the text as it is.
+      if (buf_write_lines(buf, fd, start, end, write_bin, buffer,
+                          (size_t)bufsize, &lnum, &nchars, &no_eol) == FAIL) {
+        end = 0;
+      }
+      break;
+    }
     s = buffer;
     len = 0;
     for (lnum = start; lnum <= end; lnum++) {
       // The next while loop is done once for each character written.
       // Keep it fast!
       ptr = ml_get_buf(buf, lnum, false) - 1;
-      if (write_undo_file) {
-        sha256_update(&sha_ctx, ptr + 1, (uint32_t)(STRLEN(ptr + 1) + 1));
-      }
       while ((c = *++ptr) != NUL) {
         if (c == NL) {
           *s = NUL;                       // replace newlines with NULs
@@ -3668,7 +3925,7 @@ nofail:
   if (retval == OK && write_undo_file) {
     char_u hash[UNDO_HASH_SIZE];
 
-    sha256_finish(&sha_ctx, hash);
+    ml_hash(buf, hash);
     u_write_undo(NULL, FALSE, buf, hash);
   }
 
@@ -3877,6 +4134,119 @@ static bool time_differs(long t1, long t2) FUNC_ATTR_CONST
 #endif
 }
 
+/// Write lines "start" to "end" of "buf" to "fd" without any conversion and
+/// with NL line endings, the common case for buf_write().
+///
+/// Short lines are collected in a write buffer, using "wbuf" when a larger
+/// one can't be allocated.  Long lines are written directly from the memline
+/// with writev(), without copying them.
+///
+/// @param[out]  lnump  set to the line after the last one written
+/// @param[in,out]  nchars  incremented with the number of bytes written
+/// @param[out]  no_eol  set to true when the last line was written without
+///                      an EOL
+///
+/// @return FAIL for a write error or when interrupted, OK otherwise.
+static int buf_write_lines(buf_T *buf, int fd, linenr_T start, linenr_T end,
+                           bool write_bin, char_u *wbuf, size_t wbufsize,
+                           linenr_T *lnump, long *nchars, int *no_eol)
+{
+  char_u *alloc_buf = try_malloc(WRITE_LINES_BUFSIZE);
+  if (alloc_buf != NULL) {
+    wbuf = alloc_buf;
+    wbufsize = WRITE_LINES_BUFSIZE;
+  }
+  size_t wlen = 0;
+  size_t written = 0;
+  int retval = OK;
+  linenr_T lnum;
+
+  for (lnum = start; lnum <= end; lnum++) {
+    char_u *line = ml_get_buf(buf, lnum, false);
+    size_t len = STRLEN(line);
+    // A NL in the line is a NUL in the file.
+    bool has_nl = memchr(line, NL, len) != NULL;
+    bool eol = !(lnum == end
+                 && (write_bin || !buf->b_p_fixeol)
+                 && (lnum == buf->b_no_eol_lnum
+                     || (lnum == buf->b_ml.ml_line_count && !buf->b_p_eol)));
+    bool flushed = false;
+    bool direct = false;
+
+#ifdef HAVE_READV
+    direct = !has_nl && len >= wbufsize / 2;
+    if (direct) {
+      struct iovec iov[] = {
+        { .iov_base = wbuf, .iov_len = wlen },
+        { .iov_base = line, .iov_len = len },
+        { .iov_base = "\n", .iov_len = eol ? 1 : 0 },
+      };
+      size_t size = wlen + len + (eol ? 1 : 0);
+      if (os_writev(fd, iov, ARRAY_SIZE(iov)) != (ptrdiff_t)size) {
+        retval = FAIL;
+        break;
+      }
+      written += size;
+      wlen = 0;
+      flushed = true;
+    }
+#endif
+    for (size_t done = 0; !direct && (done < len || eol); ) {
+      if (wlen == wbufsize) {
+        if (os_write(fd, (char *)wbuf, wlen, false) != (ptrdiff_t)wlen) {
+          retval = FAIL;
+          break;
+        }
+        written += wlen;
+        wlen = 0;
+        flushed = true;
+      }
+      if (done == len) {
+        wbuf[wlen++] = NL;
+        break;
+      }
+      size_t n = MIN(len - done, wbufsize - wlen);
+      memcpy(wbuf + wlen, line + done, n);
+      if (has_nl) {
+        for (char_u *p = wbuf + wlen;
+             (p = memchr(p, NL, (size_t)(wbuf + wlen + n - p))) != NULL; p++) {
+          *p = NUL;
+        }
+      }
+      wlen += n;
+      done += n;
+    }
+    if (retval == FAIL) {
+      break;
+    }
+    if (!eol) {
+      // last line has no EOL: stop here
+      lnum++;
+      *no_eol = true;
+      break;
+    }
+    if (flushed) {
+      os_breakcheck();
+      if (got_int) {
+        retval = FAIL;
+        break;
+      }
+    }
+  }
+
+  if (retval == OK && wlen > 0) {
+    if (os_write(fd, (char *)wbuf, wlen, false) != (ptrdiff_t)wlen) {
+      retval = FAIL;
+    } else {
+      written += wlen;
+    }
+  }
+  xfree(alloc_buf);
+  *lnump = lnum;
+  *nchars += (long)written;
+  return retval;
+}
+
 /*
  * Call write() to write a number of bytes to the file.
  * Handles 'encoding' conversion.
@@ -134,9 +134,19 @@ for _,f in ipairs(shallowcopy(functions)) do
   end
 end
 
+-- Number the functions that can be called over RPC. Clients can send the
+-- id instead of the method name, see msgpack_rpc_get_handler_for_id().
+local rpc_functions = {}
+for _,f in ipairs(functions) do
+  if not f.lua_only then
+    f.id = #rpc_functions
+    rpc_functions[#rpc_functions+1] = f
+  end
+end
+
 -- don't expose internal attributes like "impl_name" in public metadata
 local exported_attributes = {'name', 'return_type', 'method',
-                             'since', 'deprecated_since'}
+                             'since', 'deprecated_since', 'id'}
 local exported_functions = {}
 for _,f in ipairs(functions) do
   if not startswith(f.name, "nvim__") then
@@ -300,26 +310,86 @@ for i = 1, #functions do
   end
 end
 
--- Generate a function that initializes method names with handler functions
+-- Generate the table of handlers, indexed by method id
+output:write('static const MsgpackRpcRequestHandler method_handlers[] = {\n')
+for _,fn in ipairs(rpc_functions) do
+  output:write('  { .name = "'..fn.name..'", '..
+               '.fn = handle_'..(fn.impl_name or fn.name)..', '..
+               '.fast = '..tostring(fn.fast)..' },\n')
+end
+output:write('};\n\n')
+
+-- Generate the lookup of method ids by name: switch on the length of the
+-- name, then on characters that tell the remaining names apart, until a
+-- single name is left to compare.
+local function write_id_switch(names, indent)
+  if #names == 1 then
+    output:write(indent..'if (!memcmp(str, "'..names[1].name..'", len)) {\n'..
+                 indent..'  return '..names[1].id..';\n'..
+                 indent..'}\n')
+    return
+  end
+  local best, best_count = nil, 0
+  for pos = 1, #names[1].name do
+    local seen, count = {}, 0
+    for _,fn in ipairs(names) do
+      local c = fn.name:sub(pos, pos)
+      if not seen[c] then
+        seen[c] = true
+        count = count + 1
+      end
+    end
+    if count > best_count then
+      best, best_count = pos, count
+    end
+  end
+  local buckets, chars = {}, {}
+  for _,fn in ipairs(names) do
+    local c = fn.name:sub(best, best)
+    if buckets[c] == nil then
+      buckets[c] = {}
+      chars[#chars+1] = c
+    end
+    table.insert(buckets[c], fn)
+  end
+  output:write(indent..'switch (str['..(best - 1)..']) {\n')
+  for _,c in ipairs(chars) do
+    output:write(indent.."  case '"..c.."':\n")
+    write_id_switch(buckets[c], indent..'    ')
+    output:write(indent..'    break;\n')
+  end
+  output:write(indent..'}\n')
+end
+
+local by_len, lens = {}, {}
+local sorted_functions = shallowcopy(rpc_functions)
+table.sort(sorted_functions, function(a, b) return a.name < b.name end)
+for _,fn in ipairs(sorted_functions) do
+  if by_len[#fn.name] == nil then
+    by_len[#fn.name] = {}
+    lens[#lens+1] = #fn.name
+  end
+  table.insert(by_len[#fn.name], fn)
+end
+table.sort(lens)
+
 output:write([[
-void msgpack_rpc_init_method_table(void)
+/// @return id of the method "str" with length "len", or -1 if there is none
+static int msgpack_rpc_method_id(const char *str, size_t len)
 {
-  methods = map_new(String, MsgpackRpcRequestHandler)();
-
+  switch (len) {
 ]])
-
-for i = 1, #functions do
-  local fn = functions[i]
-  if not fn.lua_only then
-      output:write('  msgpack_rpc_add_method_handler('..
-                   '(String) {.data = "'..fn.name..'", '..
-                   '.size = sizeof("'..fn.name..'") - 1}, '..
-                   '(MsgpackRpcRequestHandler) {.fn = handle_'..  (fn.impl_name or fn.name)..
-                   ', .fast = '..tostring(fn.fast)..'});\n')
-  end
+for _,len in ipairs(lens) do
+  output:write('    case '..len..':\n')
+  write_id_switch(by_len[len], '      ')
+  output:write('      break;\n')
 end
+output:write([[
+  }
+  return -1;
+}
 
-output:write('\n}\n\n')
+]])
 output:close()
 
 local mpack_output = io.open(mpack_outputf, 'wb')
@@ -24,6 +24,7 @@
 #include "nvim/cursor.h"
 #include "nvim/edit.h"
 #include "nvim/eval.h"
+#include "nvim/extmark.h"
 #include "nvim/ex_docmd.h"
 #include "nvim/ex_getln.h"
 #include "nvim/func_attr.h"
@@ -1677,7 +1678,11 @@ static int vgetorpeek(bool advance)
   init_typebuf();
   start_stuff();
   if (advance && typebuf.tb_maplen == 0) {
-    reg_executing = 0;
+    if (reg_executing) {
+      // done with the register, apply the extmark splices it collected
+      reg_executing = 0;
+      extmark_splice_flush();
+    }
   }
   do {
     /*
@@ -51,7 +51,6 @@ typedef struct ExtmarkNs {  // For namespacing extmarks
 MAP_DECLS(uint64_t, ExtmarkNs)
 MAP_DECLS(uint64_t, ExtmarkItem)
 MAP_DECLS(handle_T, ptr_t)
-MAP_DECLS(String, MsgpackRpcRequestHandler)
 MAP_DECLS(HlEntry, int)
 MAP_DECLS(String, handle_T)
 
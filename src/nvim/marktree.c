@@ -13,7 +13,8 @@
 // marktree_lookup to lookup a mark by its id (iterator optional in this case).
 // Use marktree_itr_current and marktree_itr_next/prev to read marks in a loop.
 // marktree_del_itr deletes the current mark of the iterator and implicitly
-// moves the iterator to the next mark.
+// moves the iterator to the next mark. marktree_itr_next_filter/prev_filter
+// only visit marks of some groups (extmark namespaces).
 //
 // Work is ongoing to fully support ranges (mark pairs).
 
@@ -55,6 +56,9 @@
 
 #define T MT_BRANCH_FACTOR
 #define ILEN (sizeof(mtnode_t)+(2 * T) * sizeof(void *))
+// the number of nodes in the first blocks of the pool, and the most in a block
+#define POOL_MIN_BLOCK 8
+#define POOL_MAX_BLOCK 256
 #define key_t SKRAPET
 
 #define RIGHT_GRAVITY (((uint64_t)1) << 63)
@@ -63,12 +67,23 @@
 
 #define PAIRED MARKTREE_PAIRED_FLAG
 #define END_FLAG MARKTREE_END_FLAG
-#define ID_INCR (((uint64_t)1) << 2)
+#define ID_INCR (((uint64_t)1) << 8)
+#define GROUP_BIT(id) (((uint64_t)1) << (((id) & MARKTREE_GROUP_MASK) \
+                                         >> MARKTREE_GROUP_SHIFT))
 
 #define PROP_MASK (RIGHT_GRAVITY|PAIRED|END_FLAG)
 
 #define rawkey(itr) (itr->node->key[itr->i])
 
+// pair end bound of a node, as an absolute position
+typedef struct {
+  mtnode_t *node;
+  mtpos_t end;
+} mtbound_t;
+
+typedef kvec_t(mtbound_t) mtbounds_t;
+#define NO_PAIRS(x) ((x)->max_end.row < 0)
+
 static bool pos_leq(mtpos_t a, mtpos_t b)
 {
   return a.row < b.row || (a.row == b.row && a.col <= b.col);
@@ -152,6 +167,125 @@ static inline void refkey(MarkTree *b, mtnode_t *x, int i)
   pmap_put(uint64_t)(b->id2node, ANTIGRAVITY(x->key[i].id), x);
 }
 
+/// Compute the group slots of node "x" from its keys and children.
+static void update_mask(mtnode_t *x)
+{
+  uint64_t mask = 0;
+  for (int i = 0; i < x->n; i++) {
+    mask |= GROUP_BIT(x->key[i].id);
+  }
+  if (x->level) {
+    for (int i = 0; i < x->n + 1; i++) {
+      mask |= x->ptr[i]->group_mask;
+    }
+  }
+  x->group_mask = mask;
+}
+
+/// Add group slots "mask" to node "x" and its parents.
+static void add_mask(mtnode_t *x, uint64_t mask)
+{
+  // the mask of a parent always includes that of its children
+  for (; x && (x->group_mask & mask) != mask; x = x->parent) {
+    x->group_mask |= mask;
+  }
+}
+
+/// Widen the pair end bound of node "x" to include "end", given relative to
+/// the node.
+static void cover_end(mtnode_t *x, mtpos_t end)
+{
+  if (NO_PAIRS(x) || !pos_leq(end, x->max_end)) {
+    x->max_end = end;
+  }
+}
+
+/// Store node "x" and its parents in "path" and the absolute positions their
+/// keys are relative to in "bases", "x" first.
+///
+/// @return the number of nodes
+static int node_path(mtnode_t *x, mtnode_t **path, mtpos_t *bases)
+{
+  int depth = 0;
+  for (; x; x = x->parent) {
+    path[depth++] = x;
+  }
+  bases[depth-1] = (mtpos_t){ 0, 0 };
+  for (int d = depth-2; d >= 0; d--) {
+    mtnode_t *p = path[d+1];
+    int i = 0;
+    while (p->ptr[i] != path[d]) {
+      i++;
+    }
+    bases[d] = bases[d+1];
+    if (i > 0) {
+      compose(&bases[d], p->key[i-1].pos);
+    }
+  }
+  return depth;
+}
+
+/// Widen the pair end bounds of the node with the start of pair "id" and its
+/// parents to include the end of the pair, if both marks are in the tree.
+static void cover_pair(MarkTree *b, uint64_t id)
+{
+  id &= ~END_FLAG;
+  mtnode_t *x = pmap_get(uint64_t)(b->id2node, id);
+  mtpos_t end = marktree_lookup(b, id|END_FLAG, NULL);
+  if (x == NULL || end.row < 0) {
+    return;
+  }
+  mtpos_t start = marktree_lookup(b, id, NULL);
+  if (!pos_leq(start, end)) {
+    // a text change can move a left gravity end before a right gravity start
+    end = start;
+  }
+  mtnode_t *path[MT_MAX_DEPTH];
+  mtpos_t bases[MT_MAX_DEPTH];
+  int depth = node_path(x, path, bases);
+  for (int d = 0; d < depth; d++) {
+    mtpos_t rel = end;
+    relative(bases[d], &rel);
+    cover_end(path[d], rel);
+  }
+}
+
+/// Take a zeroed node from the pool of "b", allocating a new block if no
+/// freed node is left. Inner nodes have room for the child pointers.
+static mtnode_t *node_alloc(MarkTree *b, bool inner)
+{
+  mtpool_t *pool = &b->pool;
+  mtnode_t **free = inner ? &pool->free_inner : &pool->free_leaf;
+  size_t size = inner ? ILEN : sizeof(mtnode_t);
+  if (*free == NULL) {
+    // blocks grow with the tree, a buffer with a few marks stays small
+    size_t count = POOL_MAX_BLOCK;
+    if (kv_size(pool->blocks) < 5) {
+      count = (size_t)POOL_MIN_BLOCK << kv_size(pool->blocks);
+    }
+    char *block = xmalloc(count * size);
+    kv_push(pool->blocks, block);
+    for (size_t i = count; i > 0; i--) {
+      mtnode_t *x = (mtnode_t *)(block + (i-1) * size);
+      x->parent = *free;
+      *free = x;
+    }
+  }
+  mtnode_t *x = *free;
+  *free = x->parent;
+  memset(x, 0, size);
+  return x;
+}
+
+/// Give node "x" back to the pool. Inner nodes are recognized by the level,
+/// a leaf root allocated as an inner node simply goes to the leaf list.
+static void node_free(MarkTree *b, mtnode_t *x)
+{
+  mtnode_t **free = x->level ? &b->pool.free_inner : &b->pool.free_leaf;
+  x->parent = *free;
+  *free = x;
+}
+
 // put functions
 
 // x must be an internal node, which is not full
@@ -160,9 +294,16 @@ static inline void split_node(MarkTree *b, mtnode_t *x, const int i)
 {
   mtnode_t *y = x->ptr[i];
   mtnode_t *z;
-  z = (mtnode_t *)xcalloc(1, y->level ? ILEN : sizeof(mtnode_t));
+  z = node_alloc(b, y->level);
   b->n_nodes++;
   z->level = y->level;
+  // the middle key becomes the base of z
+  z->max_end = y->max_end;
+  if (!NO_PAIRS(y) && pos_leq(y->key[T-1].pos, y->max_end)) {
+    relative(y->key[T-1].pos, &z->max_end);
+  } else {
+    z->max_end.row = -1;
+  }
   z->n = T - 1;
   memcpy(z->key, &y->key[T], sizeof(mtkey_t) * (T - 1));
   for (int j = 0; j < T-1; j++) {
@@ -192,12 +333,15 @@ static inline void split_node(MarkTree *b, mtnode_t *x, const int i)
   if (i > 0) {
     unrelative(x->key[i-1].pos, &x->key[i].pos);
   }
+  update_mask(y);
+  update_mask(z);
 }
 
 // x must not be a full node (even if there might be internal space)
 static inline void marktree_putp_aux(MarkTree *b, mtnode_t *x, mtkey_t k)
 {
   int i = x->n - 1;
+  x->group_mask |= GROUP_BIT(k.id);
   if (x->level == 0) {
     i = marktree_getp_aux(x, k, 0);
     if (i != x->n - 1) {
@@ -222,9 +366,14 @@ static inline void marktree_putp_aux(MarkTree *b, mtnode_t *x, mtkey_t k)
   }
 }
 
-uint64_t marktree_put(MarkTree *b, int row, int col, bool right_gravity)
+/// Add a mark at (row, col)
+///
+/// @param group  the group of the mark, see MT_GROUP_SLOTS
+/// @return the id of the new mark
+uint64_t marktree_put(MarkTree *b, int row, int col, bool right_gravity,
+                      uint64_t group)
 {
-  uint64_t id = (b->next_id+=ID_INCR);
+  uint64_t id = (b->next_id+=ID_INCR) | marktree_group_id(group);
   uint64_t keyid = id;
   if (right_gravity) {
     // order all right gravity keys after the left ones, for effortless
@@ -237,9 +386,10 @@ uint64_t marktree_put(MarkTree *b, int row, int col, bool right_gravity)
 
 uint64_t marktree_put_pair(MarkTree *b,
                            int start_row, int start_col, bool start_right,
-                           int end_row, int end_col, bool end_right)
+                           int end_row, int end_col, bool end_right,
+                           uint64_t group)
 {
-  uint64_t id = (b->next_id+=ID_INCR)|PAIRED;
+  uint64_t id = (b->next_id+=ID_INCR)|PAIRED|marktree_group_id(group);
   uint64_t start_id = id|(start_right?RIGHT_GRAVITY:0);
   uint64_t end_id = id|END_FLAG|(end_right?RIGHT_GRAVITY:0);
   marktree_put_key(b, start_row, start_col, start_id);
@@ -247,12 +397,32 @@ uint64_t marktree_put_pair(MarkTree *b,
   return id;
 }
 
+/// The group slot bits that are part of the id of a mark in "group".
+static uint64_t marktree_group_id(uint64_t group)
+{
+  return (group % MT_GROUP_SLOTS) << MARKTREE_GROUP_SHIFT;
+}
+
+/// Mask for marktree_itr_next_filter() to find marks in "group".
+uint64_t marktree_group_mask(uint64_t group)
+{
+  return GROUP_BIT(marktree_group_id(group));
+}
+
+/// Check if mark "id" is in a group of "mask", see marktree_group_mask().
+/// Different groups can share a slot, so also other marks may match.
+bool marktree_id_in_mask(uint64_t id, uint64_t mask)
+{
+  return (GROUP_BIT(id) & mask) != 0;
+}
+
 void marktree_put_key(MarkTree *b, int row, int col, uint64_t id)
 {
   mtkey_t k = { .pos = { .row = row, .col = col }, .id = id };
 
   if (!b->root) {
-    b->root = (mtnode_t *)xcalloc(1, ILEN);
+    b->root = node_alloc(b, true);
+    b->root->max_end.row = -1;
     b->id2node = pmap_new(uint64_t)();
     b->n_nodes++;
   }
@@ -261,14 +431,166 @@ void marktree_put_key(MarkTree *b, int row, int col, uint64_t id)
   r = b->root;
   if (r->n == 2 * T - 1) {
     b->n_nodes++;
-    s = (mtnode_t *)xcalloc(1, ILEN);
+    s = node_alloc(b, true);
     b->root = s; s->level = r->level+1; s->n = 0;
+    s->max_end = r->max_end;
     s->ptr[0] = r;
     r->parent = s;
     split_node(b, s, 0);
+    update_mask(s);
     r = s;
   }
   marktree_putp_aux(b, r, k);
+  if (id & PAIRED) {
+    cover_pair(b, ANTIGRAVITY(id));
+  }
+}
+
+/// Add many marks at once, see mtbatch_t.
+///
+/// When the new marks are at least as many as the marks already in the tree,
+/// the tree is rebuilt bottom-up from the sorted marks, which is linear in the
+/// total number of marks. Otherwise the marks are inserted one by one, in
+/// order, so that consecutive inserts touch the same nodes.
+///
+/// @param[in,out] items  marks to add, "id" is set to the id of each new mark
+/// @param group  the group of all the marks, see MT_GROUP_SLOTS
+void marktree_put_batch(MarkTree *b, mtbatch_t *items, size_t n,
+                        uint64_t group)
+{
+  kvec_t(mtkey_t) keys = KV_INITIAL_VALUE;
+  for (size_t i = 0; i < n; i++) {
+    mtbatch_t *item = &items[i];
+    bool paired = item->end_row >= 0;
+    uint64_t id = ((b->next_id += ID_INCR) | (paired ? PAIRED : 0)
+                   | marktree_group_id(group));
+    kv_push(keys, ((mtkey_t){
+      .pos = { item->start_row, item->start_col },
+      .id = id | (item->start_right ? RIGHT_GRAVITY : 0) }));
+    if (paired) {
+      kv_push(keys, ((mtkey_t){
+        .pos = { item->end_row, item->end_col },
+        .id = id | END_FLAG | (item->end_right ? RIGHT_GRAVITY : 0) }));
+    }
+    item->id = id;
+  }
+  if (kv_size(keys) == 0) {
+    return;
+  }
+  qsort(keys.items, kv_size(keys), sizeof(mtkey_t), key_qsort_cmp);
+
+  if (kv_size(keys) < b->n_keys) {
+    for (size_t i = 0; i < kv_size(keys); i++) {
+      mtkey_t k = kv_A(keys, i);
+      marktree_put_key(b, k.pos.row, k.pos.col, k.id);
+    }
+    kv_destroy(keys);
+    return;
+  }
+
+  // merge with the marks already in the tree, which are in order
+  size_t n_keys = b->n_keys + kv_size(keys);
+  mtkey_t *all = xmalloc(n_keys * sizeof(mtkey_t));
+  size_t j = 0, k = 0;
+  MarkTreeIter itr[1];
+  // the root is kept when the last mark was deleted, check for that
+  bool more = marktree_itr_first(b, itr);
+  while (more) {
+    mtkey_t old = { .pos = marktree_itr_pos(itr), .id = rawkey(itr).id };
+    while (k < kv_size(keys) && key_cmp(kv_A(keys, k), old) < 0) {
+      all[j++] = kv_A(keys, k++);
+    }
+    all[j++] = old;
+    more = marktree_itr_next(b, itr);
+  }
+  while (k < kv_size(keys)) {
+    all[j++] = kv_A(keys, k++);
+  }
+  assert(j == n_keys);
+  kv_destroy(keys);
+
+  if (b->root) {
+    marktree_free_node(b, b->root);
+  } else {
+    b->id2node = pmap_new(uint64_t)();
+  }
+  b->n_nodes = 0;
+  b->n_keys = n_keys;
+
+  // the lowest tree that can hold all the keys
+  int height = 0;
+  size_t max_keys = 2 * T - 1;
+  while (max_keys < n_keys) {
+    max_keys = (max_keys + 1) * 2 * T - 1;
+    height++;
+  }
+  b->root = build_node(b, all, n_keys, height, max_keys, (mtpos_t){ 0, 0 });
+  b->root->parent = NULL;
+  for (size_t i = 0; i < n_keys; i++) {
+    if ((all[i].id & PAIRED) && !(all[i].id & END_FLAG)) {
+      cover_pair(b, ANTIGRAVITY(all[i].id));
+    }
+  }
+  xfree(all);
+}
+
+/// qsort() callback for mtkey_t
+static int key_qsort_cmp(const void *a, const void *b)
+{
+  return key_cmp(*(const mtkey_t *)a, *(const mtkey_t *)b);
+}
+
+/// Build a subtree of height "level" from the "n" sorted keys "keys", given
+/// with absolute positions. "max_keys" is the most keys such a subtree can
+/// hold and "base" the position the keys of the new node are relative to.
+///
+/// Every node except the root gets between T-1 and 2*T-1 keys: the keys are
+/// spread evenly over the fewest children that can hold them, but always at
+/// least T children for an inner node (and at least two for the root).
+static mtnode_t *build_node(MarkTree *b, mtkey_t *keys, size_t n, int level,
+                            size_t max_keys, mtpos_t base)
+{
+  mtnode_t *x = node_alloc(b, level || !b->n_nodes);
+  b->n_nodes++;
+  x->level = level;
+  x->max_end.row = -1;
+  if (level == 0) {
+    assert(n <= 2 * T - 1);
+    x->n = (int32_t)n;
+    memcpy(x->key, keys, n * sizeof(mtkey_t));
+  } else {
+    size_t max_child = (max_keys + 1) / (2 * T) - 1;
+    size_t c = (n + 1 + max_child) / (max_child + 1);
+    // the root node was allocated first
+    size_t min_c = b->n_nodes == 1 ? 2 : T;
+    if (c < min_c) {
+      c = min_c;
+    }
+    assert(c <= 2 * T);
+    size_t per_child = (n + 1 - c) / c;
+    size_t extra = (n + 1 - c) % c;
+    size_t i = 0;
+    mtpos_t child_base = base;
+    for (size_t j = 0; j < c; j++) {
+      size_t count = per_child + (j < extra ? 1 : 0);
+      x->ptr[j] = build_node(b, keys + i, count, level - 1, max_child,
+                             child_base);
+      x->ptr[j]->parent = x;
+      i += count;
+      if (j < c - 1) {
+        child_base = keys[i].pos;
+        x->key[j] = keys[i++];
+      }
+    }
+    assert(i == n);
+    x->n = (int32_t)(c - 1);
+  }
+  for (int i = 0; i < x->n; i++) {
+    relative(base, &x->key[i].pos);
+    refkey(b, x, i);
+  }
+  update_mask(x);
+  return x;
 }
 
 /// INITIATING DELETION PROTOCOL:
@@ -356,6 +678,9 @@ void marktree_del_itr(MarkTree *b, MarkTreeIter *itr, bool rev)
           for (int k = 0; k < y->n; k++) {
             unrelative(deleted.pos, &y->key[k].pos);
           }
+          if (!NO_PAIRS(y)) {
+            unrelative(deleted.pos, &y->max_end);
+          }
           y = y->level ? y->ptr[0] : NULL;
         }
       }
@@ -366,6 +691,8 @@ void marktree_del_itr(MarkTree *b, MarkTreeIter *itr, bool rev)
   pmap_del(uint64_t)(b->id2node, ANTIGRAVITY(id));
 
   // 5.
+  // leaf node that lost a key, to update the group slots from
+  mtnode_t *leaf = x;
   bool itr_dirty = false;
   int rlvl = itr->lvl-1;
   int *lasti = &itr->i;
@@ -393,7 +720,11 @@ void marktree_del_itr(MarkTree *b, MarkTreeIter *itr, bool rev)
       assert(p->ptr[pi-1]->n == T-1);
       // merge with left neighbour
       *lasti += T;
-      x = merge_node(b, p, pi-1);
+      mtnode_t *merged = merge_node(b, p, pi-1);
+      if (x == leaf) {
+        leaf = merged;
+      }
+      x = merged;
       if (lasti == &itr->i) {
         // TRICKY: we merged the node the iterator was on
         itr->node = x;
@@ -411,6 +742,10 @@ void marktree_del_itr(MarkTree *b, MarkTreeIter *itr, bool rev)
     x = p;
   }
 
+  for (mtnode_t *y = leaf; y; y = y->parent) {
+    update_mask(y);
+  }
+
   // 6.
   if (b->root->n == 0) {
     if (itr->lvl > 0) {
@@ -421,7 +756,7 @@ void marktree_del_itr(MarkTree *b, MarkTreeIter *itr, bool rev)
       mtnode_t *oldroot = b->root;
       b->root = b->root->ptr[0];
       b->root->parent = NULL;
-      xfree(oldroot);
+      node_free(b, oldroot);
     } else {
       // no items, nothing for iterator to point to
       // not strictly needed, should handle delete right-most mark anyway
@@ -456,7 +791,9 @@ void marktree_del_itr(MarkTree *b, MarkTreeIter *itr, bool rev)
 static mtnode_t *merge_node(MarkTree *b, mtnode_t *p, int i)
 {
   mtnode_t *x = p->ptr[i], *y = p->ptr[i+1];
+  uint64_t sep_id = p->key[i].id;
 
+  x->group_mask |= y->group_mask | GROUP_BIT(p->key[i].id);
   x->key[x->n] = p->key[i];
   refkey(b, x, x->n);
   if (i > 0) {
@@ -468,6 +805,11 @@ static mtnode_t *merge_node(MarkTree *b, mtnode_t *p, int i)
     refkey(b, x, x->n+1+k);
     unrelative(x->key[x->n].pos, &x->key[x->n+1+k].pos);
   }
+  if (!NO_PAIRS(y)) {
+    mtpos_t end = y->max_end;
+    unrelative(x->key[x->n].pos, &end);
+    cover_end(x, end);
+  }
   if (x->level) {
     memmove(&x->ptr[x->n+1], y->ptr, (size_t)(y->n + 1) * sizeof(mtnode_t *));
     for (int k = 0; k < y->n+1; k++) {
@@ -479,8 +821,11 @@ static mtnode_t *merge_node(MarkTree *b, mtnode_t *p, int i)
   memmove(&p->ptr[i + 1], &p->ptr[i + 2],
           (size_t)(p->n - i - 1) * sizeof(mtkey_t *));
   p->n--;
-  xfree(y);
+  node_free(b, y);
   b->n_nodes--;
+  if ((sep_id & (PAIRED|END_FLAG)) == PAIRED) {
+    cover_pair(b, ANTIGRAVITY(sep_id));
+  }
   return x;
 }
 
@@ -510,6 +855,17 @@ static void pivot_right(MarkTree *b, mtnode_t *p, int i)
   for (int k = 1; k < y->n; k++) {
     unrelative(y->key[0].pos, &y->key[k].pos);
   }
+  if (!NO_PAIRS(y)) {
+    unrelative(y->key[0].pos, &y->max_end);
+  }
+  if (y->level && !NO_PAIRS(y->ptr[0])) {
+    cover_end(y, y->ptr[0]->max_end);
+  }
+  update_mask(x);
+  update_mask(y);
+  if ((y->key[0].id & (PAIRED|END_FLAG)) == PAIRED) {
+    cover_pair(b, ANTIGRAVITY(y->key[0].id));
+  }
 }
 
 static void pivot_left(MarkTree *b, mtnode_t *p, int i)
@@ -521,6 +877,14 @@ static void pivot_left(MarkTree *b, mtnode_t *p, int i)
   for (int k = 1; k < y->n; k++) {
     relative(y->key[0].pos, &y->key[k].pos);
   }
+  if (!NO_PAIRS(y)) {
+    if (pos_leq(y->key[0].pos, y->max_end)) {
+      relative(y->key[0].pos, &y->max_end);
+    } else {
+      // all the pairs started before the new base
+      y->max_end.row = -1;
+    }
+  }
   unrelative(p->key[i].pos, &y->key[0].pos);
   if (i > 0) {
     relative(p->key[i-1].pos, &p->key[i].pos);
@@ -540,15 +904,29 @@ static void pivot_left(MarkTree *b, mtnode_t *p, int i)
   }
   x->n++;
   y->n--;
+  if (x->level && !NO_PAIRS(x->ptr[x->n])) {
+    mtpos_t end = x->ptr[x->n]->max_end;
+    unrelative(x->key[x->n-1].pos, &end);
+    cover_end(x, end);
+  }
+  update_mask(x);
+  update_mask(y);
+  if ((x->key[x->n-1].id & (PAIRED|END_FLAG)) == PAIRED) {
+    cover_pair(b, ANTIGRAVITY(x->key[x->n-1].id));
+  }
 }
 
 /// frees all mem, resets tree to valid empty state
 void marktree_clear(MarkTree *b)
 {
-  if (b->root) {
-    marktree_free_node(b->root);
-    b->root = NULL;
-  }
+  // all the nodes live in the blocks of the pool
+  b->root = NULL;
+  for (size_t i = 0; i < kv_size(b->pool.blocks); i++) {
+    xfree(kv_A(b->pool.blocks, i));
+  }
+  kv_destroy(b->pool.blocks);
+  b->pool.free_leaf = NULL;
+  b->pool.free_inner = NULL;
   if (b->id2node) {
     pmap_free(uint64_t)(b->id2node);
     b->id2node = NULL;
@@ -557,14 +935,14 @@ void marktree_clear(MarkTree *b)
   b->n_nodes = 0;
 }
 
-void marktree_free_node(mtnode_t *x)
+void marktree_free_node(MarkTree *b, mtnode_t *x)
 {
   if (x->level) {
     for (int i = 0; i < x->n+1; i++) {
-      marktree_free_node(x->ptr[i]);
+      marktree_free_node(b, x->ptr[i]);
     }
   }
-  xfree(x);
+  node_free(b, x);
 }
 
 /// NB: caller must check not pair!
@@ -572,7 +950,7 @@ uint64_t marktree_revise(MarkTree *b, MarkTreeIter *itr)
 {
   uint64_t old_id = rawkey(itr).id;
   pmap_del(uint64_t)(b->id2node, ANTIGRAVITY(old_id));
-  uint64_t new_id = (b->next_id += ID_INCR);
+  uint64_t new_id = (b->next_id += ID_INCR) | (old_id & MARKTREE_GROUP_MASK);
   rawkey(itr).id = new_id + (RIGHT_GRAVITY&old_id);
   refkey(b, itr->node, itr->i);
   return new_id;
@@ -791,6 +1169,158 @@ bool marktree_itr_prev(MarkTree *b, MarkTreeIter *itr)
   return true;
 }
 
+/// Move to the next mark that is in a group of "mask".
+///
+/// Subtrees without such marks are skipped, so this is O(log n) per mark
+/// that is found instead of visiting the marks of all other groups.
+///
+/// @param mask  group slots, see marktree_group_mask()
+bool marktree_itr_next_filter(MarkTree *b, MarkTreeIter *itr, uint64_t mask)
+{
+  if (!itr->node) {
+    return false;
+  }
+  while (true) {
+    itr->i++;
+    // after an internal key: go down to the first key of the subtree after
+    // it, or skip the subtree entirely
+    while (itr->node->level > 0
+           && (itr->node->ptr[itr->i]->group_mask & mask)) {
+      if (itr->i > 0) {
+        itr->s[itr->lvl].oldcol = itr->pos.col;
+        compose(&itr->pos, itr->node->key[itr->i-1].pos);
+      }
+      itr->s[itr->lvl].i = itr->i;
+      assert(itr->node->ptr[itr->i]->parent == itr->node);
+      itr->node = itr->node->ptr[itr->i];
+      itr->i = 0;
+      itr->lvl++;
+    }
+    // ran out of keys in this node. Go up until we find a key
+    while (itr->i >= itr->node->n) {
+      itr->node = itr->node->parent;
+      if (itr->node == NULL) {
+        return false;
+      }
+      itr->lvl--;
+      itr->i = itr->s[itr->lvl].i;
+      if (itr->i > 0) {
+        itr->pos.row -= itr->node->key[itr->i-1].pos.row;
+        itr->pos.col = itr->s[itr->lvl].oldcol;
+      }
+    }
+    if (GROUP_BIT(rawkey(itr).id) & mask) {
+      return true;
+    }
+  }
+}
+
+/// Move to the previous mark that is in a group of "mask".
+///
+/// @see marktree_itr_next_filter
+bool marktree_itr_prev_filter(MarkTree *b, MarkTreeIter *itr, uint64_t mask)
+{
+  if (!itr->node) {
+    return false;
+  }
+  while (true) {
+    // before an internal key: go down to the last key of the subtree
+    // before it, or skip the subtree entirely
+    while (itr->node->level > 0
+           && (itr->node->ptr[itr->i]->group_mask & mask)) {
+      if (itr->i > 0) {
+        itr->s[itr->lvl].oldcol = itr->pos.col;
+        compose(&itr->pos, itr->node->key[itr->i-1].pos);
+      }
+      itr->s[itr->lvl].i = itr->i;
+      assert(itr->node->ptr[itr->i]->parent == itr->node);
+      itr->node = itr->node->ptr[itr->i];
+      itr->i = itr->node->n;
+      itr->lvl++;
+    }
+    itr->i--;
+    // ran out of keys in this node. Go up until we find a key
+    while (itr->i < 0) {
+      itr->node = itr->node->parent;
+      if (itr->node == NULL) {
+        return false;
+      }
+      itr->lvl--;
+      itr->i = itr->s[itr->lvl].i-1;
+      if (itr->i >= 0) {
+        itr->pos.row -= itr->node->key[itr->i].pos.row;
+        itr->pos.col = itr->s[itr->lvl].oldcol;
+      }
+    }
+    if (GROUP_BIT(rawkey(itr).id) & mask) {
+      return true;
+    }
+  }
+}
+
+/// Like marktree_itr_get_ext(), but only find marks in a group of "mask".
+bool marktree_itr_get_filter(MarkTree *b, mtpos_t p, MarkTreeIter *itr,
+                             bool last, uint64_t mask)
+{
+  if (!marktree_itr_get_ext(b, p, itr, last, false, NULL)) {
+    return false;
+  }
+  if (GROUP_BIT(rawkey(itr).id) & mask) {
+    return true;
+  }
+  return last ? marktree_itr_prev_filter(b, itr, mask)
+              : marktree_itr_next_filter(b, itr, mask);
+}
+
+/// Add the pairs which start before (row, col) and end at or after it to
+/// "pairs", in the order of their starts.
+///
+/// Only visits the subtrees whose pair end bound reaches (row, col), so the
+/// cost does not grow with the marks before the position.
+void marktree_get_overlap(MarkTree *b, int row, int col, mtpairs_t *pairs)
+{
+  if (b->n_keys == 0) {
+    return;
+  }
+  get_overlap_node(b, b->root, (mtpos_t){ 0, 0 }, (mtpos_t){ row, col },
+                   pairs);
+}
+
+static void get_overlap_node(MarkTree *b, mtnode_t *x, mtpos_t base,
+                             mtpos_t pos, mtpairs_t *pairs)
+{
+  if (NO_PAIRS(x)) {
+    return;
+  }
+  mtpos_t max_end = x->max_end;
+  unrelative(base, &max_end);
+  if (!pos_leq(pos, max_end)) {
+    return;
+  }
+  mtpos_t child_base = base;
+  for (int i = 0; i < x->n+1; i++) {
+    if (x->level) {
+      get_overlap_node(b, x->ptr[i], child_base, pos, pairs);
+    }
+    if (i == x->n) {
+      break;
+    }
+    mtkey_t k = x->key[i];
+    unrelative(base, &k.pos);
+    if (pos_leq(pos, k.pos)) {
+      break;
+    }
+    if ((k.id & (PAIRED|END_FLAG)) == PAIRED) {
+      uint64_t id = ANTIGRAVITY(k.id);
+      mtpos_t end = marktree_lookup(b, id|END_FLAG, NULL);
+      if (end.row >= 0 && pos_leq(pos, end)) {
+        kv_push(*pairs, ((mtpair_t){ k.pos, end, id }));
+      }
+    }
+    child_base = k.pos;
+  }
+}
+
 void marktree_itr_rewind(MarkTree *b, MarkTreeIter *itr)
 {
   if (!itr->node) {
@@ -861,6 +1391,13 @@ bool marktree_splice(MarkTree *b,
   mtpos_t delta = { new_extent.row - old_extent.row,
                     new_extent.col-old_extent.col };
 
+  // pair end bounds after the change, they are updated last. Pair starts
+  // which change places with other marks are covered again after that.
+  mtbounds_t bounds = KV_INITIAL_VALUE;
+  kvec_t(uint64_t) moved_starts = KV_INITIAL_VALUE;
+  splice_bounds(b->root, (mtpos_t){ 0, 0 }, start, old_extent, new_extent,
+                &bounds);
+
   if (may_delete) {
     mtpos_t ipos = marktree_itr_pos(itr);
     if (!pos_leq(old_extent, ipos)
@@ -904,6 +1441,14 @@ continue_same_node:
           swap_id(&rawkey(itr).id, &rawkey(enditr).id);
           refkey(b, itr->node, itr->i);
           refkey(b, enditr->node, enditr->i);
+          add_mask(itr->node, GROUP_BIT(rawkey(itr).id));
+          add_mask(enditr->node, GROUP_BIT(rawkey(enditr).id));
+          uint64_t swapped[2] = { rawkey(itr).id, rawkey(enditr).id };
+          for (int k = 0; k < 2; k++) {
+            if ((swapped[k] & (PAIRED|END_FLAG)) == PAIRED) {
+              kv_push(moved_starts, ANTIGRAVITY(swapped[k]));
+            }
+          }
         } else {
           past_right = true;
           break;
@@ -992,9 +1537,70 @@ past_continue_same_node:
     }
     marktree_itr_next_skip(b, itr, true, NULL);
   }
+
+  for (size_t i = 0; i < kv_size(bounds); i++) {
+    mtbound_t bound = kv_A(bounds, i);
+    mtnode_t *path[MT_MAX_DEPTH];
+    mtpos_t bases[MT_MAX_DEPTH];
+    node_path(bound.node, path, bases);
+    if (!pos_leq(bases[0], bound.end)) {
+      bound.end = bases[0];
+    }
+    relative(bases[0], &bound.end);
+    bound.node->max_end = bound.end;
+  }
+  for (size_t i = 0; i < kv_size(moved_starts); i++) {
+    cover_pair(b, kv_A(moved_starts, i));
+  }
+  kv_destroy(bounds);
+  kv_destroy(moved_starts);
   return moved;
 }
 
+/// Collect the nodes whose pair end bound can be moved by the change of the
+/// text from "start" to "old_end" into text ending at "new_end", with the
+/// bound after the change. "base" is the absolute position of node "x".
+static void splice_bounds(mtnode_t *x, mtpos_t base, mtpos_t start,
+                          mtpos_t old_end, mtpos_t new_end,
+                          mtbounds_t *bounds)
+{
+  if (NO_PAIRS(x)) {
+    return;
+  }
+  mtpos_t end = x->max_end;
+  unrelative(base, &end);
+  if (!pos_leq(start, end)) {
+    // the bounds of the children are not greater
+    return;
+  }
+  if (pos_leq(end, old_end)) {
+    // the mark might have had right gravity
+    end = new_end;
+  } else {
+    if (end.row == old_end.row) {
+      end.col += new_end.col - old_end.col;
+    }
+    end.row += new_end.row - old_end.row;
+  }
+  kv_push(*bounds, ((mtbound_t){ x, end }));
+
+  if (x->level == 0) {
+    return;
+  }
+  for (int i = 0; i < x->n+1; i++) {
+    mtpos_t child_base = base;
+    if (i > 0) {
+      child_base = x->key[i-1].pos;
+      unrelative(base, &child_base);
+      if (!pos_leq(child_base, old_end)) {
+        // the positions in the following children are just shifted
+        break;
+      }
+    }
+    splice_bounds(x->ptr[i], child_base, start, old_end, new_end, bounds);
+  }
+}
+
 void marktree_move_region(MarkTree *b,
                           int start_row, colnr_T start_col,
                           int extent_row, colnr_T extent_col,
@@ -1030,6 +1636,113 @@ void marktree_move_region(MarkTree *b,
   kv_destroy(saved);
 }
 
+/// Apply the text changes "items" in one go, with the same result as calling
+/// marktree_splice() for each of them in order. Each change must start at or
+/// after the end of the new text of the change before it.
+///
+/// The marks from the start of the first change to the old end of the last
+/// one are taken out and put back at their final positions, around a single
+/// splice of the whole range. This only pays off when there are few such
+/// marks, so nothing is done when they are more than the changes.
+///
+/// @param[out] total  the whole range as a single change
+/// @param[out] moved  the marks that were taken out, with their positions
+///                    before and after the changes
+/// @return false if nothing was done, then the changes must be applied one
+///         by one.
+bool marktree_splice_batch(MarkTree *b, mtsplice_t *items, size_t n,
+                           mtsplice_t *total, mtmoves_t *moved)
+{
+  if (n == 0) {
+    return false;
+  }
+
+  // the old end of each change, in the positions before all the changes.
+  // Nothing changes between the new end of a change and the next start, so
+  // that stretch only is shifted like the end.
+  mtpos_t *old_end = xmalloc(n * sizeof(*old_end));
+  for (size_t j = 0; j < n; j++) {
+    mtpos_t start = items[j].start;
+    if (j > 0) {
+      mtpos_t prev_end = items[j-1].start;
+      compose(&prev_end, items[j-1].new_extent);
+      relative(prev_end, &start);
+      unrelative(old_end[j-1], &start);
+    }
+    old_end[j] = start;
+    compose(&old_end[j], items[j].old_extent);
+  }
+
+  mtpos_t first = items[0].start, last = old_end[n-1];
+  MarkTreeIter itr[1];
+  marktree_itr_get_ext(b, first, itr, false, true, NULL);
+  for (size_t count = 0; itr->node && pos_leq(marktree_itr_pos(itr), last);
+       count++) {
+    if (count == n) {
+      xfree(old_end);
+      return false;
+    }
+    marktree_itr_next(b, itr);
+  }
+
+  kvec_t(mtkey_t) saved = KV_INITIAL_VALUE;
+  size_t j = 0;
+  marktree_itr_get_ext(b, first, itr, false, true, NULL);
+  while (itr->node) {
+    mtpos_t pos = marktree_itr_pos(itr);
+    if (!pos_leq(pos, last)) {
+      break;
+    }
+    uint64_t id = rawkey(itr).id;
+    while (!pos_leq(pos, old_end[j])) {
+      j++;
+    }
+    mtpos_t new = pos;
+    if (j > 0) {
+      mtpos_t prev_end = items[j-1].start;
+      compose(&prev_end, items[j-1].new_extent);
+      relative(old_end[j-1], &new);
+      unrelative(prev_end, &new);
+    }
+    // a mark left at the edge of a change can be inside the next one
+    for (size_t k = j; k < n && pos_leq(items[k].start, new); k++) {
+      new = items[k].start;
+      if (id & RIGHT_GRAVITY) {
+        compose(&new, items[k].new_extent);
+      }
+    }
+    kv_push(saved, ((mtkey_t){ .pos = new, .id = id }));
+    kv_push(*moved, ((mtmove_t){ .id = ANTIGRAVITY(id),
+                                 .right_gravity = id & RIGHT_GRAVITY,
+                                 .old = pos, .new = new }));
+    marktree_itr_next(b, itr);
+  }
+
+  for (size_t i = 0; i < kv_size(saved); i++) {
+    marktree_lookup(b, ANTIGRAVITY(kv_A(saved, i).id), itr);
+    marktree_del_itr(b, itr, false);
+  }
+
+  mtpos_t new_end = items[n-1].start;
+  compose(&new_end, items[n-1].new_extent);
+  total->start = first;
+  total->old_extent = last;
+  relative(first, &total->old_extent);
+  total->new_extent = new_end;
+  relative(first, &total->new_extent);
+  marktree_splice(b, first.row, first.col,
+                  total->old_extent.row, total->old_extent.col,
+                  total->new_extent.row, total->new_extent.col);
+
+  for (size_t i = 0; i < kv_size(saved); i++) {
+    mtkey_t item = kv_A(saved, i);
+    marktree_put_key(b, item.pos.row, item.pos.col, item.id);
+  }
+  kv_destroy(saved);
+  xfree(old_end);
+  return true;
+}
+
 /// @param itr OPTIONAL. set itr to pos.
 mtpos_t marktree_lookup(MarkTree *b, uint64_t id, MarkTreeIter *itr)
 {
@@ -1108,6 +1821,7 @@ void marktree_check(MarkTree *b)
   size_t nkeys = check_node(b, b->root, &dummy, &last_right);
   assert(b->n_keys == nkeys);
   assert(b->n_keys == map_size(b->id2node));
+  check_bounds(b, b->root, (mtpos_t){ 0, 0 });
 #else
   // Do nothing, as assertions are required
   (void)b;
@@ -1140,6 +1854,7 @@ static size_t check_node(MarkTree *b, mtnode_t *x,
     }
     *last_right = IS_RIGHT(x->key[i].id);
     assert(x->key[i].pos.col >= 0);
+    assert(x->group_mask & GROUP_BIT(x->key[i].id));
     assert(pmap_get(uint64_t)(b->id2node, ANTIGRAVITY(x->key[i].id)) == x);
   }
 
@@ -1150,6 +1865,8 @@ static size_t check_node(MarkTree *b, mtnode_t *x,
     for (int i = 0; i < x->n+1; i++) {
       assert(x->ptr[i]->parent == x);
       assert(x->ptr[i]->level == x->level-1);
+      assert((x->group_mask & x->ptr[i]->group_mask)
+             == x->ptr[i]->group_mask);
       // PARANOIA: check no double node ref
       for (int j = 0; j < i; j++) {
         assert(x->ptr[i] != x->ptr[j]);
@@ -1160,6 +1877,38 @@ static size_t check_node(MarkTree *b, mtnode_t *x,
   }
   return n_keys;
 }
+
+/// Check that the pair end bound of "x" covers the pairs starting in it and
+/// the bounds of its children.
+static void check_bounds(MarkTree *b, mtnode_t *x, mtpos_t base)
+{
+  mtpos_t max_end = x->max_end;
+  unrelative(base, &max_end);
+  mtpos_t child_base = base;
+  for (int i = 0; i < x->n+1; i++) {
+    if (x->level) {
+      mtnode_t *c = x->ptr[i];
+      if (!NO_PAIRS(c)) {
+        mtpos_t end = c->max_end;
+        unrelative(child_base, &end);
+        assert(!NO_PAIRS(x) && pos_leq(end, max_end));
+      }
+      check_bounds(b, c, child_base);
+    }
+    if (i == x->n) {
+      break;
+    }
+    mtkey_t k = x->key[i];
+    unrelative(base, &k.pos);
+    if ((k.id & (PAIRED|END_FLAG)) == PAIRED) {
+      mtpos_t end = marktree_lookup(b, ANTIGRAVITY(k.id)|END_FLAG, NULL);
+      if (end.row >= 0) {
+        assert(!NO_PAIRS(x) && pos_leq(end, max_end));
+      }
+    }
+    child_base = k.pos;
+  }
+}
 #endif
 
 char *mt_inspect_rec(MarkTree *b)
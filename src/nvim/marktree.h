@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include "nvim/map.h"
 #include "nvim/garray.h"
+#include "nvim/lib/kvec.h"
 
 #define MT_MAX_DEPTH 20
 #define MT_BRANCH_FACTOR 10
@@ -20,6 +21,44 @@ typedef struct {
   bool right_gravity;
 } mtmark_t;
 
+// A mark for marktree_put_batch(), a pair of marks if end_row >= 0
+typedef struct {
+  int32_t start_row;
+  int32_t start_col;
+  int32_t end_row;
+  int32_t end_col;
+  bool start_right;
+  bool end_right;
+  uint64_t id;
+} mtbatch_t;
+
+// A pair of marks found by marktree_get_overlap()
+typedef struct {
+  mtpos_t start;
+  mtpos_t end;
+  uint64_t id;
+} mtpair_t;
+
+typedef kvec_t(mtpair_t) mtpairs_t;
+
+// A text change for marktree_splice_batch(), the extents are relative to the
+// start like the arguments of marktree_splice()
+typedef struct {
+  mtpos_t start;
+  mtpos_t old_extent;
+  mtpos_t new_extent;
+} mtsplice_t;
+
+// A mark moved by marktree_splice_batch()
+typedef struct {
+  uint64_t id;
+  bool right_gravity;
+  mtpos_t old;
+  mtpos_t new;
+} mtmove_t;
+
+typedef kvec_t(mtmove_t) mtmoves_t;
+
 typedef struct mtnode_s mtnode_t;
 typedef struct {
   int oldcol;
@@ -44,16 +83,33 @@ typedef struct {
   uint64_t id;
 } mtkey_t;
 
+// The keys come right after the count, so a search in the node reads one
+// contiguous stretch of memory. Leaf nodes are allocated without "ptr".
 struct mtnode_s {
   int32_t n;
   int32_t level;
+  mtkey_t key[2 * MT_BRANCH_FACTOR - 1];
+  // group slots of all the keys in this subtree, see MT_GROUP_SLOTS
+  uint64_t group_mask;
+  // bound for the ends of the pairs which start in this subtree, relative to
+  // the node like the keys. row is -1 if no pair starts in the subtree.
+  mtpos_t max_end;
   // TODO(bfredl): we could consider having a only-sometimes-valid
   // index into parent for faster "chached" lookup.
+  // Links the free nodes of the pool.
   mtnode_t *parent;
-  mtkey_t key[2 * MT_BRANCH_FACTOR - 1];
   mtnode_t *ptr[];
 };
 
+// Nodes are carved out of larger blocks, which are only freed with the whole
+// tree. Freed nodes are kept for reuse, leaf and inner nodes separately as
+// they differ in size.
+typedef struct {
+  mtnode_t *free_leaf;
+  mtnode_t *free_inner;
+  kvec_t(char *) blocks;
+} mtpool_t;
+
 // TODO(bfredl): the iterator is pretty much everpresent, make it part of the
 // tree struct itself?
 typedef struct {
@@ -63,6 +119,7 @@ typedef struct {
   // TODO(bfredl): the pointer to node could be part of the larger
   // Map(uint64_t, ExtmarkItem) essentially;
   PMap(uint64_t) *id2node;
+  mtpool_t pool;
 } MarkTree;
 
 
@@ -73,4 +130,13 @@ typedef struct {
 #define MARKTREE_PAIRED_FLAG (((uint64_t)1) << 1)
 #define MARKTREE_END_FLAG (((uint64_t)1) << 0)
 
+// Every mark belongs to a group (the namespace of an extmark), hashed into
+// one of MT_GROUP_SLOTS slots stored in the id.  Nodes keep the slots used
+// in their subtree, so iterating over the marks of one group can skip
+// subtrees without them.
+#define MT_GROUP_SLOTS 64
+#define MARKTREE_GROUP_SHIFT 2
+#define MARKTREE_GROUP_MASK (((uint64_t)MT_GROUP_SLOTS - 1) \
+                             << MARKTREE_GROUP_SHIFT)
+
 #endif  // NVIM_MARKTREE_H
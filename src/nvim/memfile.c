@@ -34,6 +34,7 @@
 /// mf_put()          unlock a block, may be marked for writing
 /// mf_free()         remove a block
 /// mf_sync()         sync changed parts of memfile to disk
+/// mf_wait()         wait for a background sync to finish
 /// mf_release_all()  release as much memory as possible
 /// mf_trans_del()    may translate negative to positive block number
 /// mf_fullname()     make file name full path (use before first :cd)
@@ -55,11 +56,44 @@
 #include "nvim/os_unix.h"
 #include "nvim/path.h"
 #include "nvim/assert.h"
+#include "nvim/main.h"
+#include "nvim/lib/kvec.h"
 #include "nvim/os/os.h"
 #include "nvim/os/input.h"
 
 #define MEMFILE_PAGE_SIZE 4096       /// default page size
 
+/// Number of pages in the first and the largest chunk of a memfile's arena.
+/// A new buffer uses three pages: block 0, the pointer block and a data block.
+#define MF_ARENA_MIN_PAGES 4
+#define MF_ARENA_MAX_PAGES 64
+
+/// Stored after the pages of a chunk of the arena, links to the previous chunk.
+typedef struct {
+  char *prev;                        /// previous chunk or NULL
+  unsigned prev_size;                /// number of pages in "prev"
+} mf_arena_link_T;
+
+/// A copy of a block to be written by a worker thread.
+typedef struct {
+  off_T offset;                      /// position in the file
+  size_t size;                       /// number of bytes
+  char *data;                        /// copy of the block
+} mf_write_T;
+
+/// Writes done by a libuv worker thread for mf_sync() with MFS_ASYNC.  There
+/// is at most one for a memfile, so that writes happen in order.
+struct mf_write_job {
+  uv_work_t req;
+  memfile_T *mfp;                    /// memfile, NULL when it stopped waiting
+  int fd;                            /// file descriptor of the swap file
+  bool flush;                        /// fsync() after writing
+  kvec_t(mf_write_T) writes;         /// blocks to write
+  uv_mutex_t mutex;                  /// protects "done" and "failed"
+  uv_cond_t cond;                    /// signaled when "done" is set
+  bool done;                         /// the worker has finished
+  bool failed;                       /// a write failed
+};
 
 #ifdef INCLUDE_GENERATED_DECLARATIONS
 # include "memfile.c.generated.h"
@@ -97,6 +131,11 @@ memfile_T *mf_open(char_u *fname, int flags)
   mfp->mf_used_first = NULL;         // used list is empty
   mfp->mf_used_last = NULL;
   mfp->mf_dirty = false;
+  mfp->mf_job = NULL;
+  mfp->mf_arena = NULL;
+  mfp->mf_arena_free = NULL;
+  mfp->mf_arena_used = 0;
+  mfp->mf_arena_size = 0;
   mf_hash_init(&mfp->mf_hash);
   mf_hash_init(&mfp->mf_trans);
   mfp->mf_page_size = MEMFILE_PAGE_SIZE;
@@ -167,6 +206,7 @@ void mf_close(memfile_T *mfp, bool del_file)
   if (mfp == NULL) {                    // safety check
     return;
   }
+  mf_wait(mfp);
   if (mfp->mf_fd >= 0 && close(mfp->mf_fd) < 0) {
       EMSG(_(e_swapclose));
   }
@@ -174,14 +214,18 @@ void mf_close(memfile_T *mfp, bool del_file)
     os_remove((char *)mfp->mf_fname);
   }
 
-  // free entries in used list
+  // free entries in used list, the pages in the arena are freed below
   for (bhdr_T *hp = mfp->mf_used_first, *nextp; hp != NULL; hp = nextp) {
     nextp = hp->bh_next;
-    mf_free_bhdr(hp);
+    if (!(hp->bh_flags & BH_ARENA)) {
+      xfree(hp->bh_data);
+    }
+    xfree(hp);
   }
   while (mfp->mf_free_first != NULL) {  // free entries in free list
     xfree(mf_rem_free(mfp));
   }
+  mf_free_arena(mfp);
   mf_hash_free(&mfp->mf_hash);
   mf_hash_free_all(&mfp->mf_trans);     // free hashtable and its items
   mf_free_fnames(mfp);
@@ -204,6 +248,7 @@ void mf_close_file(buf_T *buf, bool getlines)
       (void)ml_get_buf(buf, lnum, false);
     }
   }
+  mf_wait(mfp);
 
   if (close(mfp->mf_fd) < 0) {           // close the file
     EMSG(_(e_swapclose));
@@ -247,9 +292,8 @@ bhdr_T *mf_new(memfile_T *mfp, bool negative, unsigned page_count)
     } else {    // need to allocate memory for this block
       // If the number of pages matches use the bhdr_T from the free list and
       // allocate the data.
-      void *p = xmalloc(mfp->mf_page_size * page_count);
       hp = mf_rem_free(mfp);
-      hp->bh_data = p;
+      mf_alloc_data(mfp, hp, page_count);
     }
   } else {                      // get a new number
     hp = mf_alloc_bhdr(mfp, page_count);
@@ -261,7 +305,8 @@ bhdr_T *mf_new(memfile_T *mfp, bool negative, unsigned page_count)
       mfp->mf_blocknr_max += page_count;
     }
   }
-  hp->bh_flags = BH_LOCKED | BH_DIRTY;    // new block is always dirty
+  // new block is always dirty
+  hp->bh_flags = (hp->bh_flags & BH_ARENA) | BH_LOCKED | BH_DIRTY;
   mfp->mf_dirty = true;
   hp->bh_page_count = page_count;
   mf_ins_used(mfp, hp);
@@ -296,10 +341,10 @@ bhdr_T *mf_get(memfile_T *mfp, blocknr_T nr, unsigned page_count)
     hp = mf_alloc_bhdr(mfp, page_count);
 
     hp->bh_bnum = nr;
-    hp->bh_flags = 0;
+    hp->bh_flags &= BH_ARENA;
     hp->bh_page_count = page_count;
     if (mf_read(mfp, hp) == FAIL) {             // cannot read the block
-      mf_free_bhdr(hp);
+      mf_free_bhdr(mfp, hp);
       return NULL;
     }
   } else {
@@ -338,7 +383,7 @@ void mf_put(memfile_T *mfp, bhdr_T *hp, bool dirty, bool infile)
 /// Signal block as no longer used (may put it in the free list).
 void mf_free(memfile_T *mfp, bhdr_T *hp)
 {
-  xfree(hp->bh_data);           // free data
+  mf_free_data(mfp, hp);        // free data
   mf_rem_hash(mfp, hp);         // get *hp out of the hash list
   mf_rem_used(mfp, hp);         // get *hp out of the used list
   if (hp->bh_bnum < 0) {
@@ -358,6 +403,9 @@ void mf_free(memfile_T *mfp, bhdr_T *hp)
 ///               MFS_FLUSH  Make sure buffers are flushed to disk, so they will
 ///                          survive a system crash.
 ///               MFS_ZERO   Only write block 0.
+///               MFS_ASYNC  Copy the dirty blocks and write them in a worker
+///                          thread, a write error is reported later.  Does
+///                          nothing while a previous write is still busy.
 ///
 /// @return FAIL  If failure. Possible causes:
 ///               - No file (nothing to do).
@@ -366,12 +414,21 @@ void mf_free(memfile_T *mfp, bhdr_T *hp)
 int mf_sync(memfile_T *mfp, int flags)
 {
   int got_int_save = got_int;
+  struct mf_write_job *job = NULL;
 
   if (mfp->mf_fd < 0) {         // there is no file, nothing to do
     mfp->mf_dirty = false;
     return FAIL;
   }
 
+  if ((flags & MFS_ASYNC) && mfp->mf_job != NULL && !mf_job_done(mfp->mf_job)) {
+    return OK;                  // try again later
+  }
+  mf_wait(mfp);
+  if (flags & MFS_ASYNC) {
+    job = mf_job_new(mfp, flags & MFS_FLUSH);
+  }
+
   // Only a CTRL-C while writing will break us here, not one typed previously.
   got_int = false;
 
@@ -388,11 +445,14 @@ int mf_sync(memfile_T *mfp, int flags)
                              && hp->bh_bnum < mfp->mf_infile_count))) {
       if ((flags & MFS_ZERO) && hp->bh_bnum != 0)
         continue;
-      if (mf_write(mfp, hp) == FAIL) {
+      if (mf_write(mfp, hp, job) == FAIL) {
         if (status == FAIL)     // double error: quit syncing
           break;
         status = FAIL;
       }
+      if (job != NULL) {        // only copying, no need to check for input
+        continue;
+      }
       if (flags & MFS_STOP) {   // Stop when char available now.
         if (os_char_avail())
           break;
@@ -408,7 +468,9 @@ int mf_sync(memfile_T *mfp, int flags)
   if (hp == NULL || status == FAIL)
     mfp->mf_dirty = false;
 
-  if (flags & MFS_FLUSH) {
+  if (job != NULL) {
+    mf_job_start(mfp, job);
+  } else if (flags & MFS_FLUSH) {
     if (os_fsync(mfp->mf_fd)) {
       status = FAIL;
     }
@@ -431,6 +493,136 @@ void mf_set_dirty(memfile_T *mfp)
   mfp->mf_dirty = true;
 }
 
+/// Wait for the background write started by mf_sync() to finish, if there is
+/// one.  Must be done before using the swap file in another way.
+void mf_wait(memfile_T *mfp)
+{
+  struct mf_write_job *job = mfp->mf_job;
+  if (job == NULL) {
+    return;
+  }
+  uv_mutex_lock(&job->mutex);
+  while (!job->done) {
+    uv_cond_wait(&job->cond, &job->mutex);
+  }
+  uv_mutex_unlock(&job->mutex);
+  mf_job_finish(mfp);
+}
+
+static struct mf_write_job *mf_job_new(memfile_T *mfp, bool flush)
+{
+  struct mf_write_job *job = xcalloc(1, sizeof(*job));
+  job->req.data = job;
+  job->mfp = mfp;
+  job->fd = mfp->mf_fd;
+  job->flush = flush;
+  kv_init(job->writes);
+  uv_mutex_init(&job->mutex);
+  uv_cond_init(&job->cond);
+  return job;
+}
+
+static void mf_job_free(struct mf_write_job *job)
+{
+  for (size_t i = 0; i < kv_size(job->writes); i++) {
+    xfree(kv_A(job->writes, i).data);
+  }
+  kv_destroy(job->writes);
+  uv_cond_destroy(&job->cond);
+  uv_mutex_destroy(&job->mutex);
+  xfree(job);
+}
+
+static bool mf_job_done(struct mf_write_job *job)
+{
+  uv_mutex_lock(&job->mutex);
+  bool done = job->done;
+  uv_mutex_unlock(&job->mutex);
+  return done;
+}
+
+/// Hand "job" to a worker thread.
+static void mf_job_start(memfile_T *mfp, struct mf_write_job *job)
+{
+  if (kv_size(job->writes) == 0 && !job->flush) {
+    mf_job_free(job);
+    return;
+  }
+  mfp->mf_job = job;
+  if (uv_queue_work(&main_loop.uv, &job->req, mf_job_work,
+                    mf_job_after) != 0) {
+    // No worker available, do the work now.
+    mf_job_work(&job->req);
+    mf_job_finish(mfp);
+    mf_job_free(job);
+  }
+}
+
+/// Write the blocks of a job, called in a worker thread.  Must not use any
+/// editor state.
+static void mf_job_work(uv_work_t *req)
+{
+  struct mf_write_job *job = req->data;
+  bool failed = false;
+
+  for (size_t i = 0; i < kv_size(job->writes) && !failed; i++) {
+    mf_write_T *w = &kv_A(job->writes, i);
+    uv_buf_t buf = uv_buf_init(w->data, (unsigned)w->size);
+    uv_fs_t fs_req;
+    int r = uv_fs_write(NULL, &fs_req, job->fd, &buf, 1, (int64_t)w->offset,
+                        NULL);
+    uv_fs_req_cleanup(&fs_req);
+    failed = r < 0 || (size_t)r != w->size;
+  }
+  if (!failed && job->flush) {
+    uv_fs_t fs_req;
+    failed = uv_fs_fsync(NULL, &fs_req, job->fd, NULL) < 0;
+    uv_fs_req_cleanup(&fs_req);
+  }
+
+  uv_mutex_lock(&job->mutex);
+  job->failed = failed;
+  job->done = true;
+  uv_cond_signal(&job->cond);
+  uv_mutex_unlock(&job->mutex);
+}
+
+/// Called in the main loop when a job is done.
+static void mf_job_after(uv_work_t *req, int status)
+{
+  struct mf_write_job *job = req->data;
+  if (job->mfp != NULL) {
+    mf_job_finish(job->mfp);
+  }
+  mf_job_free(job);
+}
+
+/// Handle the result of the finished job of "mfp".  The job itself is freed
+/// by mf_job_after().
+static void mf_job_finish(memfile_T *mfp)
+{
+  struct mf_write_job *job = mfp->mf_job;
+  mfp->mf_job = NULL;
+  job->mfp = NULL;
+  if (job->failed) {
+    // Same as in mf_write(), but the copied blocks were already marked clean.
+    // They are still in memory, as mf_release_all() waits for the job: write
+    // all blocks again next time, including block 0.
+    if (!did_swapwrite_msg) {
+      EMSG(_("E297: Write error in swap file"));
+    }
+    did_swapwrite_msg = true;
+    for (bhdr_T *hp = mfp->mf_used_last; hp != NULL; hp = hp->bh_prev) {
+      if (hp->bh_bnum >= 0) {
+        hp->bh_flags |= BH_DIRTY;
+      }
+    }
+    mfp->mf_dirty = true;
+  } else {
+    did_swapwrite_msg = false;
+  }
+}
+
 /// Insert block in front of memfile's hash list.
 static void mf_ins_hash(memfile_T *mfp, bhdr_T *hp)
 {
@@ -494,13 +686,16 @@ bool mf_release_all(void)
 
       // Flush as many blocks as possible, only if there is a swapfile.
       if (mfp->mf_fd >= 0) {
+        // Blocks copied for a background write look clean, but must not be
+        // freed before the write succeeded.
+        mf_wait(mfp);
         for (bhdr_T *hp = mfp->mf_used_last; hp != NULL; ) {
           if (!(hp->bh_flags & BH_LOCKED)
               && (!(hp->bh_flags & BH_DIRTY)
-                  || mf_write(mfp, hp) != FAIL)) {
+                  || mf_write(mfp, hp, NULL) != FAIL)) {
             mf_rem_used(mfp, hp);
             mf_rem_hash(mfp, hp);
-            mf_free_bhdr(hp);
+            mf_free_bhdr(mfp, hp);
             hp = mfp->mf_used_last;    // restart, list was changed
             retval = true;
           } else {
@@ -517,15 +712,83 @@ bool mf_release_all(void)
 static bhdr_T *mf_alloc_bhdr(memfile_T *mfp, unsigned page_count)
 {
   bhdr_T *hp = xmalloc(sizeof(bhdr_T));
-  hp->bh_data = xmalloc(mfp->mf_page_size * page_count);
+  mf_alloc_data(mfp, hp, page_count);
   hp->bh_page_count = page_count;
   return hp;
 }
 
+/// Allocate the data for block "hp" of "page_count" pages.
+///
+/// One page blocks come from the memfile's arena while there is no swap file,
+/// or when freed pages are left in it.  The arena is allocated in chunks of
+/// pages and only freed by mf_close(), a buffer that is created and wiped
+/// then only calls the allocator once for its blocks.
+static void mf_alloc_data(memfile_T *mfp, bhdr_T *hp, unsigned page_count)
+{
+  hp->bh_flags = 0;
+  if (page_count != 1
+      || (mfp->mf_arena_free == NULL
+          && (mfp->mf_fd >= 0 || mfp->mf_page_size != MEMFILE_PAGE_SIZE))) {
+    hp->bh_data = xmalloc(mfp->mf_page_size * page_count);
+    return;
+  }
+  hp->bh_flags = BH_ARENA;
+  if (mfp->mf_arena_free != NULL) {
+    hp->bh_data = mfp->mf_arena_free;
+    mfp->mf_arena_free = *(void **)hp->bh_data;
+    return;
+  }
+  if (mfp->mf_arena_used == mfp->mf_arena_size) {
+    // New chunk, twice as large as the previous one.
+    unsigned size = mfp->mf_arena_size == 0
+                    ? MF_ARENA_MIN_PAGES
+                    : MIN(mfp->mf_arena_size * 2, MF_ARENA_MAX_PAGES);
+    char *chunk = xmalloc(MEMFILE_PAGE_SIZE * size + sizeof(mf_arena_link_T));
+    *(mf_arena_link_T *)(chunk + MEMFILE_PAGE_SIZE * size) = (mf_arena_link_T) {
+      .prev = mfp->mf_arena,
+      .prev_size = mfp->mf_arena_size,
+    };
+    mfp->mf_arena = chunk;
+    mfp->mf_arena_size = size;
+    mfp->mf_arena_used = 0;
+  }
+  hp->bh_data = (char *)mfp->mf_arena
+                + MEMFILE_PAGE_SIZE * mfp->mf_arena_used++;
+}
+
+/// Free the data of block "hp", a page of the arena is kept for reuse.
+static void mf_free_data(memfile_T *mfp, bhdr_T *hp)
+{
+  if (hp->bh_flags & BH_ARENA) {
+    *(void **)hp->bh_data = mfp->mf_arena_free;
+    mfp->mf_arena_free = hp->bh_data;
+  } else {
+    xfree(hp->bh_data);
+  }
+}
+
+/// Free all chunks of the arena of memfile "mfp".
+static void mf_free_arena(memfile_T *mfp)
+{
+  char *chunk = mfp->mf_arena;
+  unsigned size = mfp->mf_arena_size;
+  while (chunk != NULL) {
+    mf_arena_link_T link = *(mf_arena_link_T *)(chunk
+                                                + MEMFILE_PAGE_SIZE * size);
+    xfree(chunk);
+    chunk = link.prev;
+    size = link.prev_size;
+  }
+  mfp->mf_arena = NULL;
+  mfp->mf_arena_free = NULL;
+  mfp->mf_arena_used = 0;
+  mfp->mf_arena_size = 0;
+}
+
 /// Free a block header and its block memory.
-static void mf_free_bhdr(bhdr_T *hp)
+static void mf_free_bhdr(memfile_T *mfp, bhdr_T *hp)
 {
-  xfree(hp->bh_data);
+  mf_free_data(mfp, hp);
   xfree(hp);
 }
 
@@ -556,6 +819,7 @@ static int mf_read(memfile_T *mfp, bhdr_T *hp)
 {
   if (mfp->mf_fd < 0)       // there is no file, can't read
     return FAIL;
+  mf_wait(mfp);
 
   unsigned page_size = mfp->mf_page_size;
   // TODO(elmart): Check (page_size * hp->bh_bnum) within off_T bounds.
@@ -577,13 +841,15 @@ static int mf_read(memfile_T *mfp, bhdr_T *hp)
 
 /// Write a block to disk.
 ///
+/// @param job  When not NULL, only add a copy of the block to this job.
+///
 /// @return  OK    On success.
 ///          FAIL  On failure. Could be:
 ///                - No file.
 ///                - Could not translate negative block number to positive.
 ///                - Seek error in swap file.
 ///                - Write error in swap file.
-static int mf_write(memfile_T *mfp, bhdr_T *hp)
+static int mf_write(memfile_T *mfp, bhdr_T *hp, struct mf_write_job *job)
 {
   off_T offset;             // offset in the file
   blocknr_T nr;             // block nr which is being written
@@ -594,6 +860,9 @@ static int mf_write(memfile_T *mfp, bhdr_T *hp)
 
   if (mfp->mf_fd < 0)       // there is no file, can't write
     return FAIL;
+  if (job == NULL) {
+    mf_wait(mfp);
+  }
 
   if (hp->bh_bnum < 0)      // must assign file block number
     if (mf_trans_add(mfp, hp) == FAIL)
@@ -616,17 +885,22 @@ static int mf_write(memfile_T *mfp, bhdr_T *hp)
 
     // TODO(elmart): Check (page_size * nr) within off_T bounds.
     offset = (off_T)(page_size * nr);
-    if (vim_lseek(mfp->mf_fd, offset, SEEK_SET) != offset) {
-      PERROR(_("E296: Seek error in swap file write"));
-      return FAIL;
-    }
     if (hp2 == NULL)                // freed block, fill with dummy data
       page_count = 1;
     else
       page_count = hp2->bh_page_count;
     size = page_size * page_count;
     void *data = (hp2 == NULL) ? hp->bh_data : hp2->bh_data;
-    if ((unsigned)write_eintr(mfp->mf_fd, data, size) != size) {
+    if (job != NULL) {
+      kv_push(job->writes, ((mf_write_T) {
+        .offset = offset,
+        .size = size,
+        .data = xmemdup(data, size),
+      }));
+    } else if (vim_lseek(mfp->mf_fd, offset, SEEK_SET) != offset) {
+      PERROR(_("E296: Seek error in swap file write"));
+      return FAIL;
+    } else if ((unsigned)write_eintr(mfp->mf_fd, data, size) != size) {
       /// Avoid repeating the error message, this mostly happens when the
       /// disk is full. We give the message again only after a successful
       /// write or when hitting a key. We keep on trying, in case some
@@ -636,7 +910,9 @@ static int mf_write(memfile_T *mfp, bhdr_T *hp)
       did_swapwrite_msg = true;
       return FAIL;
     }
-    did_swapwrite_msg = false;
+    if (job == NULL) {
+      did_swapwrite_msg = false;
+    }
     if (hp2 != NULL)                               // written a non-dummy block
       hp2->bh_flags &= ~BH_DIRTY;
     if (nr + (blocknr_T)page_count > mfp->mf_infile_count)  // appended to file
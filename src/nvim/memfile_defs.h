@@ -71,7 +71,8 @@ typedef struct bhdr {
 
 #define BH_DIRTY    1U
 #define BH_LOCKED   2U
-  unsigned bh_flags;                 // BH_DIRTY or BH_LOCKED
+#define BH_ARENA    4U                // bh_data is a page in mf_arena
+  unsigned bh_flags;                 // BH_DIRTY, BH_LOCKED or BH_ARENA
 } bhdr_T;
 
 /// A block number translation list item.
@@ -102,6 +103,11 @@ typedef struct memfile {
   blocknr_T mf_infile_count;         /// number of pages in the file
   unsigned mf_page_size;             /// number of bytes in a page
   bool mf_dirty;                      /// TRUE if there are dirty blocks
+  struct mf_write_job *mf_job;       /// background write, see mf_sync()
+  void *mf_arena;                    /// newest chunk of one page blocks
+  void *mf_arena_free;               /// freed pages in the chunks
+  unsigned mf_arena_used;            /// pages handed out from mf_arena
+  unsigned mf_arena_size;            /// number of pages in mf_arena
 } memfile_T;
 
 #endif  // NVIM_MEMFILE_DEFS_H
@@ -72,6 +72,7 @@
 #include "nvim/undo.h"
 #include "nvim/window.h"
 #include "nvim/os/os.h"
+#include "nvim/os/fileio.h"
 #include "nvim/os/process.h"
 #include "nvim/os/input.h"
 
@@ -236,6 +237,7 @@ static linenr_T lowest_marked = 0;
 typedef enum {
   UB_FNAME = 0          /* update timestamp and filename */
   , UB_SAME_DIR         /* update the B0_SAME_DIR flag */
+  , UB_OWNER            // set user, host and process id
 } upd_block0_T;
 
 #ifdef INCLUDE_GENERATED_DECLARATIONS
@@ -263,6 +265,13 @@ int ml_open(buf_T *buf)
   buf->b_ml.ml_locked = NULL;   /* no cached block */
   buf->b_ml.ml_line_lnum = 0;   /* no cached line */
   buf->b_ml.ml_chunksize = NULL;
+  buf->b_ml.ml_chunktree = NULL;
+  buf->b_ml.ml_chunktree_len = 0;
+  buf->b_ml.ml_leaf_count = 0;
+  buf->b_ml.ml_snapshot = NULL;
+  buf->b_ml.ml_hashpoints = NULL;
+  buf->b_ml.ml_hashpoint_count = 0;
+  buf->b_ml.ml_hashpoint_size = 0;
 
   if (cmdmod.noswapfile) {
     buf->b_p_swf = false;
@@ -308,15 +317,12 @@ int ml_open(buf_T *buf)
   xstrlcpy(xstpcpy((char *) b0p->b0_version, "VIM "), Version, 6);
   long_to_char((long)mfp->mf_page_size, b0p->b0_page_size);
 
+  // The user, host and process id are filled in by ml_open_file(), most
+  // buffers never get a swap file and looking up the names can be slow.
   if (!buf->b_spell) {
     b0p->b0_dirty = buf->b_changed ? B0_DIRTY : 0;
     b0p->b0_flags = get_fileformat(buf) + 1;
     set_b0_fname(b0p, buf);
-    (void)os_get_user_name((char *)b0p->b0_uname, B0_UNAME_SIZE);
-    b0p->b0_uname[B0_UNAME_SIZE - 1] = NUL;
-    os_get_hostname((char *)b0p->b0_hname, B0_HNAME_SIZE);
-    b0p->b0_hname[B0_HNAME_SIZE - 1] = NUL;
-    long_to_char(os_get_pid(), b0p->b0_pid);
   }
 
   /*
@@ -422,6 +428,7 @@ void ml_setname(buf_T *buf)
     }
     /* need to close the swap file before renaming */
     if (mfp->mf_fd >= 0) {
+      mf_wait(mfp);
       close(mfp->mf_fd);
       mfp->mf_fd = -1;
     }
@@ -508,6 +515,7 @@ void ml_open_file(buf_T *buf)
     if (fname == NULL)
       continue;
     if (mf_open_file(mfp, fname) == OK) {       /* consumes fname! */
+      ml_upd_block0(buf, UB_OWNER);
       ml_upd_block0(buf, UB_SAME_DIR);
 
       /* Flush block zero, so others can read it */
@@ -565,6 +573,12 @@ void ml_close(buf_T *buf, int del_file)
     xfree(buf->b_ml.ml_line_ptr);
   xfree(buf->b_ml.ml_stack);
   XFREE_CLEAR(buf->b_ml.ml_chunksize);
+  XFREE_CLEAR(buf->b_ml.ml_chunktree);
+  buf->b_ml.ml_chunktree_len = 0;
+  buf->b_ml.ml_leaf_count = 0;
+  ml_text_changed(buf, 1);
+  XFREE_CLEAR(buf->b_ml.ml_hashpoints);
+  buf->b_ml.ml_hashpoint_size = 0;
   buf->b_ml.ml_mfp = NULL;
 
   /* Reset the "recovered" flag, give the ATTENTION prompt the next time
@@ -644,6 +658,8 @@ static void ml_upd_block0(buf_T *buf, upd_block0_T what)
   } else {
     if (what == UB_FNAME) {
       set_b0_fname(b0p, buf);
+    } else if (what == UB_OWNER) {
+      set_b0_owner(b0p);
     } else {    // what == UB_SAME_DIR
       set_b0_dir_flag(b0p, buf);
     }
@@ -704,6 +720,16 @@ static void set_b0_fname(ZERO_BL *b0p, buf_T *buf)
   add_b0_fenc(b0p, curbuf);
 }
 
+/// Set the user name, host name and process id in block 0.
+static void set_b0_owner(ZERO_BL *b0p)
+{
+  (void)os_get_user_name((char *)b0p->b0_uname, B0_UNAME_SIZE);
+  b0p->b0_uname[B0_UNAME_SIZE - 1] = NUL;
+  os_get_hostname((char *)b0p->b0_hname, B0_HNAME_SIZE);
+  b0p->b0_hname[B0_HNAME_SIZE - 1] = NUL;
+  long_to_char(os_get_pid(), b0p->b0_pid);
+}
+
 /*
  * Update the B0_SAME_DIR flag of the swap file.  It's set if the file and the
  * swapfile for "buf" are in the same directory.
@@ -1668,8 +1694,9 @@ static int recov_file_names(char_u **names, char_u *path, int prepend_dot)
  * sync all memlines
  *
  * If 'check_file' is TRUE, check if original file exists and was not changed.
- * If 'check_char' is TRUE, stop syncing when character becomes available, but
- * always sync at least one block.
+ * If 'check_char' is TRUE, the blocks are written by a worker thread and
+ * syncing stops when a character becomes available.  Swap files that still
+ * have a write in progress are synced next time.
  */
 void ml_sync_all(int check_file, int check_char, bool do_fsync)
 {
@@ -1696,7 +1723,9 @@ void ml_sync_all(int check_file, int check_char, bool do_fsync)
       }
     }
     if (buf->b_ml.ml_mfp->mf_dirty) {
-      (void)mf_sync(buf->b_ml.ml_mfp, (check_char ? MFS_STOP : 0)
+      // When waiting for a character write in the background, so that a slow
+      // disk does not delay typing.
+      (void)mf_sync(buf->b_ml.ml_mfp, (check_char ? MFS_ASYNC : 0)
                     | (do_fsync && bufIsChanged(buf) ? MFS_FLUSH : 0));
       if (check_char && os_char_avail()) {      // character available now
         break;
@@ -1739,6 +1768,9 @@ void ml_preserve(buf_T *buf, int message, bool do_fsync)
 
   /* stack is invalid after mf_sync(.., MFS_ALL) */
   buf->b_ml.ml_stack_top = 0;
+  // The data blocks must be found through the pointer blocks, so that
+  // those are updated.
+  buf->b_ml.ml_leaf_count = 0;
 
   /*
    * Some of the data blocks may have been changed from negative to
@@ -1876,8 +1908,10 @@ errorret:
     buf->b_ml.ml_line_lnum = lnum;
     buf->b_ml.ml_flags &= ~ML_LINE_DIRTY;
   }
-  if (will_change)
+  if (will_change) {
     buf->b_ml.ml_flags |= (ML_LOCKED_DIRTY | ML_LOCKED_POS);
+    ml_text_changed(buf, lnum);
+  }
 
   return buf->b_ml.ml_line_ptr;
 }
@@ -1895,6 +1929,8 @@ int ml_line_alloced(void)
  * Append a line after lnum (may be 0 to insert a line in front of the file).
  * "line" does not need to be allocated, but can't be another line in a
  * buffer, unlocking may make it invalid.
+ * When "len" is given the byte at line[len - 1] is not used, it does not need
+ * to be a NUL.
  *
  *   newfile: TRUE when starting to edit a new file, meaning that pe_old_lnum
  *		will be set for recovery
@@ -1967,6 +2003,8 @@ static int ml_append_int(
   if (lnum > buf->b_ml.ml_line_count || buf->b_ml.ml_mfp == NULL)
     return FAIL;
 
+  ml_text_changed(buf, lnum + 1);
+
   if (lowest_marked && lowest_marked > lnum)
     lowest_marked = lnum + 1;
 
@@ -2059,7 +2097,8 @@ static int ml_append_int(
     /*
      * copy the text into the block
      */
-    memmove((char *)dp + dp->db_index[db_idx + 1], line, (size_t)len);
+    memmove((char *)dp + dp->db_index[db_idx + 1], line, (size_t)len - 1);
+    *((char *)dp + dp->db_index[db_idx + 1] + len - 1) = NUL;
     if (mark)
       dp->db_index[db_idx + 1] |= DB_MARKED;
 
@@ -2158,7 +2197,8 @@ static int ml_append_int(
         dp_right->db_index[0] |= DB_MARKED;
 
       memmove((char *)dp_right + dp_right->db_txt_start,
-          line, (size_t)len);
+          line, (size_t)len - 1);
+      *((char *)dp_right + dp_right->db_txt_start + len - 1) = NUL;
       ++line_count_right;
     }
     /*
@@ -2196,7 +2236,8 @@ static int ml_append_int(
       if (mark)
         dp_left->db_index[line_count_left] |= DB_MARKED;
       memmove((char *)dp_left + dp_left->db_txt_start,
-          line, (size_t)len);
+          line, (size_t)len - 1);
+      *((char *)dp_left + dp_left->db_txt_start + len - 1) = NUL;
       ++line_count_left;
     }
 
@@ -2388,6 +2429,152 @@ static int ml_append_int(
   return OK;
 }
 
+/// Append "count" lines after "lnum" (may be 0) in the current buffer, like
+/// calling ml_append() for each of them, but much faster for many lines.
+/// Lines that fit in the data block where they go are copied in at once, and
+/// the pointer blocks and the byte offset chunks are updated once for them.
+///
+/// @param lines  text of the new lines, can't be lines in a buffer
+/// @param lens  length of each line, including NUL, or NULL to use STRLEN();
+///              the byte at lines[i][lens[i] - 1] is not used
+/// @param newfile  see ml_append()
+///
+/// @return FAIL for failure, OK otherwise
+int ml_append_lines(linenr_T lnum, char_u **lines, const colnr_T *lens,
+                    long count, bool newfile)
+{
+  // When starting up, we might still need to create the memfile
+  if (curbuf->b_ml.ml_mfp == NULL && open_buffer(false, NULL, 0) == FAIL) {
+    return FAIL;
+  }
+
+  if (curbuf->b_ml.ml_line_lnum != 0) {
+    ml_flush_line(curbuf);
+  }
+  return ml_append_lines_int(curbuf, lnum, lines, lens, count, newfile);
+}
+
+static int ml_append_lines_int(buf_T *buf, linenr_T lnum, char_u **lines,
+                               const colnr_T *lens, long count, bool newfile)
+{
+  colnr_T *lens_alloc = NULL;
+  int ret = OK;
+
+  if (count <= 0) {
+    return OK;
+  }
+  if (lens == NULL) {
+    lens_alloc = xmalloc(sizeof(colnr_T) * (size_t)count);
+    for (long i = 0; i < count; i++) {
+      lens_alloc[i] = (colnr_T)STRLEN(lines[i]) + 1;
+    }
+    lens = lens_alloc;
+  }
+
+  for (long done = 0; done < count && ret == OK; ) {
+    long added = ml_append_run(buf, lnum + (linenr_T)done, lines + done,
+                               lens + done, count - done, newfile);
+    if (added == 0) {
+      // The data block is full, let ml_append_int() split it.  Following
+      // lines then go into the new block.
+      ret = ml_append_int(buf, lnum + (linenr_T)done, lines[done], lens[done],
+                          newfile, false);
+      added = 1;
+    } else if (added < 0) {
+      ret = FAIL;
+    }
+    done += added;
+  }
+
+  xfree(lens_alloc);
+  return ret;
+}
+
+/// Append as many of "count" lines after "lnum" as fit in the free space of
+/// the data block where the first one goes.  The text of the lines that
+/// follow is moved only once.
+///
+/// @return the number of lines appended, zero when not even the first line
+///         fits, -1 for failure.
+static long ml_append_run(buf_T *buf, linenr_T lnum, char_u **lines,
+                          const colnr_T *lens, long count, bool newfile)
+{
+  bhdr_T *hp;
+  DATA_BL *dp;
+  int db_idx;                   // index for lnum in data block
+  int line_count;               // number of indexes in current block
+  int offset;
+  int n = 0;                    // number of lines that fit
+  int total = 0;                // text size of those lines
+
+  if (lnum > buf->b_ml.ml_line_count || buf->b_ml.ml_mfp == NULL) {
+    return -1;
+  }
+  ml_text_changed(buf, lnum + 1);
+
+  // find the data block containing the previous line, this counts one new
+  // line in it
+  if ((hp = ml_find_line(buf, lnum == 0 ? (linenr_T)1 : lnum,
+                         ML_INSERT)) == NULL) {
+    return -1;
+  }
+  db_idx = lnum == 0 ? -1 : lnum - buf->b_ml.ml_locked_low;
+  line_count = buf->b_ml.ml_locked_high - buf->b_ml.ml_locked_low;
+  dp = hp->bh_data;
+
+  while (n < count
+         && total + lens[n] + (n + 1) * (int)INDEX_SIZE <= (int)dp->db_free) {
+    total += lens[n];
+    n++;
+  }
+
+  // Correct the line count made by ml_find_line(), the pointer blocks are
+  // updated when the block is released.
+  buf->b_ml.ml_locked_lineadd += n - 1;
+  buf->b_ml.ml_locked_high += n - 1;
+  if (n == 0) {
+    return 0;
+  }
+
+  if (lowest_marked && lowest_marked > lnum) {
+    lowest_marked = lnum + 1;
+  }
+  buf->b_ml.ml_flags &= ~ML_EMPTY;
+  buf->b_ml.ml_line_count += n;
+
+  // Offset is the start of the previous line, the new lines go just before it.
+  offset = db_idx < 0 ? (int)dp->db_txt_end
+                      : (int)(dp->db_index[db_idx] & DB_INDEX_MASK);
+  if (line_count > db_idx + 1) {
+    // move the text of the lines that follow to the front and adjust their
+    // indexes
+    memmove((char *)dp + dp->db_txt_start - total,
+            (char *)dp + dp->db_txt_start,
+            (size_t)(offset - (int)dp->db_txt_start));
+    for (int i = line_count - 1; i > db_idx; i--) {
+      dp->db_index[i + n] = dp->db_index[i] - (unsigned)total;
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    offset -= lens[i];
+    dp->db_index[db_idx + 1 + i] = (unsigned)offset;
+    memmove((char *)dp + offset, lines[i], (size_t)lens[i] - 1);
+    *((char *)dp + offset + lens[i] - 1) = NUL;
+  }
+  dp->db_txt_start -= (unsigned)total;
+  dp->db_free -= (unsigned)(total + n * (int)INDEX_SIZE);
+  dp->db_line_count += (linenr_T)n;
+
+  buf->b_ml.ml_flags |= ML_LOCKED_DIRTY;
+  if (!newfile) {
+    buf->b_ml.ml_flags |= ML_LOCKED_POS;
+  }
+
+  // The lines were inserted below 'lnum'
+  ml_updatechunk_lines(buf, lnum + 1, n, total);
+  return n;
+}
+
 void ml_add_deleted_len(char_u *ptr, ssize_t len)
 {
   if (inhibit_delete_count) {
@@ -2427,6 +2614,8 @@ int ml_replace(linenr_T lnum, char_u *line, bool copy)
 
   bool readlen = true;
 
+  ml_text_changed(curbuf, lnum);
+
   if (copy) {
     line = vim_strsave(line);
   }
@@ -2481,6 +2670,8 @@ static int ml_delete_int(buf_T *buf, linenr_T lnum, bool message)
   if (lnum < 1 || lnum > buf->b_ml.ml_line_count)
     return FAIL;
 
+  ml_text_changed(buf, lnum);
+
   if (lowest_marked && lowest_marked > lnum)
     lowest_marked--;
 
@@ -2819,6 +3010,269 @@ static void ml_flush_line(buf_T *buf)
   buf->b_ml.ml_line_lnum = 0;
 }
 
+/// Get a read-only snapshot of the text of "buf".
+///
+/// Taking a snapshot copies the text once, one data block at a time.  Until
+/// the buffer text changes the same snapshot is returned again, so that
+/// getting it repeatedly is cheap.  Must be called on the main thread, the
+/// returned snapshot can then be passed to other threads.
+///
+/// @return snapshot with a reference for the caller, release it with
+///         ml_snapshot_unref(), or NULL when the buffer is not loaded.
+mlsnapshot_T *ml_snapshot(buf_T *buf)
+{
+  memline_T *ml = &buf->b_ml;
+
+  if (ml->ml_mfp == NULL) {
+    return NULL;
+  }
+  if (ml->ml_snapshot != NULL) {
+    return ml_snapshot_ref(ml->ml_snapshot);
+  }
+
+  ml_flush_line(buf);
+
+  mlsnapshot_T *snap = xcalloc(1, sizeof(mlsnapshot_T));
+  uv_mutex_init(&snap->ms_mutex);
+  snap->ms_refcount = 1;
+  snap->ms_line_count = ml->ml_line_count;
+  snap->ms_lines = xmalloc(sizeof(mlsnapline_T)
+                           * (size_t)(ml->ml_line_count + 1));
+
+  size_t cap = 0;
+  linenr_T lnum = 1;
+  while (lnum <= ml->ml_line_count) {
+    bhdr_T *hp = ml_find_line(buf, lnum, ML_FIND);
+    if (hp == NULL) {
+      break;
+    }
+    DATA_BL *dp = hp->bh_data;
+    int first = lnum - ml->ml_locked_low;
+    int last = ml->ml_locked_high - ml->ml_locked_low;
+    // Lines are stored backwards in a data block, so the text of lines
+    // "first" to "last" is one area that can be copied at once.
+    unsigned start = dp->db_index[last] & DB_INDEX_MASK;
+    unsigned end = first == 0
+                   ? dp->db_txt_end
+                   : (dp->db_index[first - 1] & DB_INDEX_MASK);
+    size_t size = end - start;
+
+    if (snap->ms_size + size > cap) {
+      cap = MAX(cap * 2, snap->ms_size + size);
+      snap->ms_text = xrealloc(snap->ms_text, cap);
+    }
+    memmove(snap->ms_text + snap->ms_size, (char *)dp + start, size);
+    for (int i = first; i <= last; i++, lnum++) {
+      unsigned line_start = dp->db_index[i] & DB_INDEX_MASK;
+      unsigned line_end = i == 0
+                          ? dp->db_txt_end
+                          : (dp->db_index[i - 1] & DB_INDEX_MASK);
+      snap->ms_lines[lnum].msl_offset = snap->ms_size + (line_start - start);
+      snap->ms_lines[lnum].msl_len = (colnr_T)(line_end - line_start - 1);
+    }
+    snap->ms_size += size;
+  }
+  snap->ms_text = xrealloc(snap->ms_text, snap->ms_size + 1);
+  snap->ms_text[snap->ms_size] = NUL;
+  // Entry zero is an empty line, also used for lines that could not be read.
+  snap->ms_lines[0].msl_offset = snap->ms_size;
+  snap->ms_lines[0].msl_len = 0;
+  for (; lnum <= ml->ml_line_count; lnum++) {
+    snap->ms_lines[lnum] = snap->ms_lines[0];
+  }
+
+  ml->ml_snapshot = ml_snapshot_ref(snap);
+  return snap;
+}
+
+/// Add a reference to snapshot "snap".  Can be used from any thread.
+///
+/// @return "snap"
+mlsnapshot_T *ml_snapshot_ref(mlsnapshot_T *snap)
+{
+  uv_mutex_lock(&snap->ms_mutex);
+  snap->ms_refcount++;
+  uv_mutex_unlock(&snap->ms_mutex);
+  return snap;
+}
+
+/// Release a reference to snapshot "snap", freeing it when it was the last
+/// one.  Can be used from any thread.
+void ml_snapshot_unref(mlsnapshot_T *snap)
+{
+  if (snap == NULL) {
+    return;
+  }
+  uv_mutex_lock(&snap->ms_mutex);
+  bool last = --snap->ms_refcount == 0;
+  uv_mutex_unlock(&snap->ms_mutex);
+  if (last) {
+    uv_mutex_destroy(&snap->ms_mutex);
+    xfree(snap->ms_lines);
+    xfree(snap->ms_text);
+    xfree(snap);
+  }
+}
+
+/// Get line "lnum" from snapshot "snap".  Can be used from any thread.
+///
+/// @param[out] len  if not NULL set to the length of the line
+/// @return the NUL terminated text, owned by the snapshot.
+const char *ml_snapshot_line(const mlsnapshot_T *snap, linenr_T lnum,
+                             colnr_T *len)
+{
+  const mlsnapline_T *line = &snap->ms_lines[0];
+  if (lnum >= 1 && lnum <= snap->ms_line_count) {
+    line = &snap->ms_lines[lnum];
+  }
+  if (len != NULL) {
+    *len = line->msl_len;
+  }
+  return snap->ms_text + line->msl_offset;
+}
+
+/// Write snapshot "snap" to the new file "fname", for clients that map it
+/// instead of fetching the lines.  Can be used from any thread.
+///
+/// Each line is written with a NL after it, and NULs in the text as NUL.  The
+/// text is followed by a table of ms_line_count + 1 native uint64_t: the
+/// offset of each line and then the size of the text.  The table starts at
+/// the first multiple of 8 after the text.
+///
+/// @param[out] table_off  Offset of the line table in the file.
+///
+/// @return 0 on success, or an error code, see os_strerror().
+int ml_snapshot_write(const mlsnapshot_T *snap, const char *fname,
+                      uint64_t *table_off)
+  FUNC_ATTR_NONNULL_ALL FUNC_ATTR_WARN_UNUSED_RESULT
+{
+  FileDescriptor fp;
+  int error = file_open(&fp, fname, kFileCreateOnly | kFileNoSymlink, 0600);
+  if (error != 0) {
+    return error;
+  }
+
+  size_t count = (size_t)snap->ms_line_count;
+  uint64_t *offsets = xmalloc((count + 1) * sizeof(*offsets));
+  uint64_t off = 0;
+  ptrdiff_t written = 0;
+  for (size_t i = 0; i < count && written >= 0; i++) {
+    colnr_T len;
+    const char *line = ml_snapshot_line(snap, (linenr_T)i + 1, &len);
+    offsets[i] = off;
+    if (memchr(line, NL, (size_t)len) != NULL) {
+      // NULs are stored as NLs in the memline
+      char *text = xmemdupz(line, (size_t)len);
+      memchrsub(text, NL, NUL, (size_t)len);
+      written = file_write(&fp, text, (size_t)len);
+      xfree(text);
+    } else {
+      written = file_write(&fp, line, (size_t)len);
+    }
+    if (written >= 0) {
+      written = file_write(&fp, "\n", 1);
+    }
+    off += (uint64_t)len + 1;
+  }
+  offsets[count] = off;
+
+  static const char pad[sizeof(*offsets)] = { 0 };
+  size_t padlen = (sizeof(*offsets) - off % sizeof(*offsets))
+                  % sizeof(*offsets);
+  if (written >= 0) {
+    written = file_write(&fp, pad, padlen);
+  }
+  if (written >= 0) {
+    written = file_write(&fp, (char *)offsets, (count + 1) * sizeof(*offsets));
+  }
+  xfree(offsets);
+  *table_off = off + padlen;
+
+  error = file_close(&fp, false);
+  if (written < 0) {
+    error = (int)written;
+  }
+  if (error != 0) {
+    os_remove(fname);
+  }
+  return error;
+}
+
+/// Text of "buf" is about to change in line "lnum" or below: forget the
+/// snapshot and the hash states that include the changed lines.
+/// Readers that have a reference to the snapshot keep using the old text.
+static void ml_text_changed(buf_T *buf, linenr_T lnum)
+{
+  memline_T *ml = &buf->b_ml;
+
+  if (ml->ml_snapshot != NULL) {
+    ml_snapshot_unref(ml->ml_snapshot);
+    ml->ml_snapshot = NULL;
+  }
+  while (ml->ml_hashpoint_count > 0
+         && ml->ml_hashpoints[ml->ml_hashpoint_count - 1].mlh_lnum >= lnum) {
+    ml->ml_hashpoint_count--;
+  }
+}
+
+/// Compute the SHA-256 of the text of "buf", each line followed by a NUL.
+///
+/// The hash state at the end of each data block is remembered, a change only
+/// discards the states after the changed line.  Hashing again only needs to
+/// go over the text from the first changed line to the end of the buffer.
+///
+/// @param[out] hash  the digest
+void ml_hash(buf_T *buf, char_u hash[SHA256_SUM_SIZE])
+{
+  memline_T *ml = &buf->b_ml;
+  context_sha256_T ctx;
+  linenr_T lnum = 1;
+
+  if (ml->ml_hashpoint_count > 0) {
+    const mlhashpoint_T *point = &ml->ml_hashpoints[ml->ml_hashpoint_count - 1];
+    ctx = point->mlh_ctx;
+    lnum = point->mlh_lnum + 1;
+  } else {
+    sha256_start(&ctx);
+  }
+
+  if (ml->ml_mfp != NULL) {
+    ml_flush_line(buf);
+  }
+  while (ml->ml_mfp != NULL && lnum <= ml->ml_line_count) {
+    bhdr_T *hp = ml_find_line(buf, lnum, ML_FIND);
+    if (hp == NULL) {
+      break;
+    }
+    DATA_BL *dp = hp->bh_data;
+    int last = ml->ml_locked_high - ml->ml_locked_low;
+    for (int i = lnum - ml->ml_locked_low; i <= last; i++, lnum++) {
+      unsigned line_start = dp->db_index[i] & DB_INDEX_MASK;
+      unsigned line_end = i == 0
+                          ? dp->db_txt_end
+                          : (dp->db_index[i - 1] & DB_INDEX_MASK);
+      // The text in the block includes the NUL.
+      sha256_update(&ctx, (char_u *)dp + line_start, line_end - line_start);
+    }
+
+    if (ml->ml_hashpoint_count == ml->ml_hashpoint_size) {
+      ml->ml_hashpoint_size = MAX(ml->ml_hashpoint_size * 2, 16);
+      ml->ml_hashpoints = xrealloc(ml->ml_hashpoints,
+                                   sizeof(mlhashpoint_T)
+                                   * (size_t)ml->ml_hashpoint_size);
+    }
+    mlhashpoint_T *point = &ml->ml_hashpoints[ml->ml_hashpoint_count++];
+    point->mlh_lnum = lnum - 1;
+    point->mlh_ctx = ctx;
+  }
+  // Lines that could not be found are hashed the way ml_get() returns them.
+  for (; lnum <= ml->ml_line_count; lnum++) {
+    char_u *p = ml_get_buf(buf, lnum, false);
+    sha256_update(&ctx, p, STRLEN(p) + 1);
+  }
+  sha256_finish(&ctx, hash);
+}
+
 /*
  * create a new, empty, data block
  */
@@ -2881,15 +3335,25 @@ static bhdr_T *ml_find_line(buf_T *buf, linenr_T lnum, int action)
 
   mfp = buf->b_ml.ml_mfp;
 
+  // Inserting or deleting a line changes the line numbers of the following
+  // data blocks, and may free a data block.
+  if (action == ML_INSERT || action == ML_DELETE) {
+    buf->b_ml.ml_leaf_count = 0;
+  }
+
   /*
    * If there is a locked block check if the wanted line is in it.
    * If not, flush and release the locked block.
    * Don't do this for ML_INSERT_SAME, because the stack need to be updated.
    * Don't do this for ML_FLUSH, because we want to flush the locked block.
    * Don't do this when 'swapfile' is reset, we want to load all the blocks.
+   * Don't insert or delete in a block from the leaf cache, the stack is
+   * needed to update the pointer blocks.
    */
   if (buf->b_ml.ml_locked) {
     if (ML_SIMPLE(action)
+        && (action == ML_FIND
+            || !(buf->b_ml.ml_flags & ML_LOCKED_NOSTACK))
         && buf->b_ml.ml_locked_low <= lnum
         && buf->b_ml.ml_locked_high >= lnum) {
       // remember to update pointer blocks and stack later
@@ -2918,6 +3382,10 @@ static bhdr_T *ml_find_line(buf_T *buf, linenr_T lnum, int action)
   if (action == ML_FLUSH)           /* nothing else to do */
     return NULL;
 
+  if (action == ML_FIND && (hp = ml_leaf_find(buf, lnum)) != NULL) {
+    return hp;
+  }
+
   bnum = 1;                         /* start at the root of the tree */
   page_count = 1;
   low = 1;
@@ -2960,7 +3428,11 @@ static bhdr_T *ml_find_line(buf_T *buf, linenr_T lnum, int action)
       buf->b_ml.ml_locked_low = low;
       buf->b_ml.ml_locked_high = high;
       buf->b_ml.ml_locked_lineadd = 0;
-      buf->b_ml.ml_flags &= ~(ML_LOCKED_DIRTY | ML_LOCKED_POS);
+      buf->b_ml.ml_flags &= ~(ML_LOCKED_DIRTY | ML_LOCKED_POS
+                              | ML_LOCKED_NOSTACK);
+      if (action == ML_FIND) {
+        ml_leaf_add(&buf->b_ml, bnum, (unsigned)page_count, low, high);
+      }
       return hp;
     }
 
@@ -3039,6 +3511,62 @@ error_noblock:
   return NULL;
 }
 
+/// Lock the data block with line "lnum" if it is in the leaf cache.
+///
+/// @return the block or NULL when it is not in the cache.
+static bhdr_T *ml_leaf_find(buf_T *buf, linenr_T lnum)
+{
+  memline_T *ml = &buf->b_ml;
+
+  for (int i = 0; i < ml->ml_leaf_count; i++) {
+    const leafcache_T lc = ml->ml_leaf[i];
+    if (lc.lc_low > lnum || lc.lc_high < lnum) {
+      continue;
+    }
+    bhdr_T *hp = mf_get(ml->ml_mfp, lc.lc_bnum, lc.lc_page_count);
+    if (hp == NULL || ((DATA_BL *)hp->bh_data)->db_id != DATA_ID) {
+      // A negative block number was translated by mf_sync(), forget it.
+      if (hp != NULL) {
+        mf_put(ml->ml_mfp, hp, false, false);
+      }
+      ml->ml_leaf_count--;
+      memmove(ml->ml_leaf + i, ml->ml_leaf + i + 1,
+              (size_t)(ml->ml_leaf_count - i) * sizeof(leafcache_T));
+      break;
+    }
+    memmove(ml->ml_leaf + 1, ml->ml_leaf, (size_t)i * sizeof(leafcache_T));
+    ml->ml_leaf[0] = lc;
+
+    ml->ml_locked = hp;
+    ml->ml_locked_low = lc.lc_low;
+    ml->ml_locked_high = lc.lc_high;
+    ml->ml_locked_lineadd = 0;
+    ml->ml_flags &= ~(ML_LOCKED_DIRTY | ML_LOCKED_POS);
+    ml->ml_flags |= ML_LOCKED_NOSTACK;
+    ml->ml_leaf_hits++;
+    return hp;
+  }
+  ml->ml_leaf_misses++;
+  return NULL;
+}
+
+/// Remember a data block that was found by searching the tree, dropping the
+/// least recently used one when the leaf cache is full.
+static void ml_leaf_add(memline_T *ml, blocknr_T bnum, unsigned page_count,
+                        linenr_T low, linenr_T high)
+{
+  const int count = MIN(ml->ml_leaf_count, ML_LEAF_CACHE_SIZE - 1);
+
+  memmove(ml->ml_leaf + 1, ml->ml_leaf, (size_t)count * sizeof(leafcache_T));
+  ml->ml_leaf[0] = (leafcache_T) {
+    .lc_bnum = bnum,
+    .lc_page_count = page_count,
+    .lc_low = low,
+    .lc_high = high,
+  };
+  ml->ml_leaf_count = count + 1;
+}
+
 /*
  * add an entry to the info pointer stack
  *
@@ -3770,6 +4298,156 @@ void ml_setflags(buf_T *buf)
 #define MLCS_MAXL 800   /* max no of lines in chunk */
 #define MLCS_MINL 400   /* should be half of MLCS_MAXL */
 
+/// Rebuild the Fenwick tree over the chunks of "buf" when it is outdated.
+static void ml_chunktree_update(buf_T *buf)
+{
+  memline_T *ml = &buf->b_ml;
+  const int n = ml->ml_usedchunks;
+
+  if (ml->ml_chunktree_len != 0 || n <= 0) {
+    return;
+  }
+  ml->ml_chunktree = xrealloc(ml->ml_chunktree,
+                              sizeof(chunksize_T) * (size_t)(n + 1));
+  chunksize_T *const tree = ml->ml_chunktree;
+  memcpy(tree + 1, ml->ml_chunksize, sizeof(chunksize_T) * (size_t)n);
+  for (int i = 1; i <= n; i++) {
+    const int parent = i + (i & -i);
+    if (parent <= n) {
+      tree[parent].mlcs_numlines += tree[i].mlcs_numlines;
+      tree[parent].mlcs_totalsize += tree[i].mlcs_totalsize;
+    }
+  }
+  ml->ml_chunktree_len = n;
+}
+
+/// Add "lines" and "size" to chunk "ix" in the Fenwick tree.  Does nothing
+/// when the tree is outdated, it is rebuilt when needed.
+static void ml_chunktree_add(memline_T *ml, int ix, int lines, long size)
+{
+  for (int i = ix + 1; i <= ml->ml_chunktree_len; i += i & -i) {
+    ml->ml_chunktree[i].mlcs_numlines += lines;
+    ml->ml_chunktree[i].mlcs_totalsize += size;
+  }
+}
+
+/// Find the largest number of leading chunks, at most "limit", for which
+/// "lines_w" * lines + "size_w" * bytes is not more than "target".
+///
+/// @param[out] linesp  number of lines in those chunks
+/// @param[out] sizep  number of bytes in those chunks
+///
+/// @return the number of chunks, which is the index of the next chunk
+static int ml_chunktree_find(memline_T *ml, int lines_w, int size_w,
+                             long target, int limit,
+                             linenr_T *linesp, long *sizep)
+{
+  int pos = 0;
+  linenr_T lines = 0;
+  long size = 0;
+  int step = 1;
+
+  limit = MIN(limit, ml->ml_chunktree_len);
+  while (step * 2 <= limit) {
+    step *= 2;
+  }
+  for (; step > 0 && limit > 0; step /= 2) {
+    const int next = pos + step;
+    if (next <= limit) {
+      const chunksize_T *const node = &ml->ml_chunktree[next];
+      if (lines_w * (long)(lines + node->mlcs_numlines)
+          + size_w * (size + node->mlcs_totalsize) <= target) {
+        pos = next;
+        lines += node->mlcs_numlines;
+        size += node->mlcs_totalsize;
+      }
+    }
+  }
+  *linesp = lines;
+  *sizep = size;
+  return pos;
+}
+
+/// Buffer for which ml_updatechunk() remembers the chunk of the last added
+/// line.  Reset it when chunks are changed elsewhere.
+static buf_T *ml_upd_lastbuf = NULL;
+
+/// Start the chunk list of "buf", it has one empty line.
+static void ml_chunks_init(buf_T *buf)
+{
+  buf->b_ml.ml_chunksize = xmalloc(sizeof(chunksize_T) * 100);
+  buf->b_ml.ml_numchunks = 100;
+  buf->b_ml.ml_usedchunks = 1;
+  buf->b_ml.ml_chunksize[0].mlcs_numlines = 1;
+  buf->b_ml.ml_chunksize[0].mlcs_totalsize = 1;
+  buf->b_ml.ml_chunktree_len = 0;
+}
+
+/// Make room for one more chunk in the chunk list of "buf".
+static void ml_chunks_grow(buf_T *buf)
+{
+  if (buf->b_ml.ml_usedchunks + 1 >= buf->b_ml.ml_numchunks) {
+    buf->b_ml.ml_numchunks = buf->b_ml.ml_numchunks * 3 / 2;
+    buf->b_ml.ml_chunksize = xrealloc(
+        buf->b_ml.ml_chunksize, sizeof(chunksize_T) * buf->b_ml.ml_numchunks);
+  }
+}
+
+/// Split chunk "curix", which starts at line "curline", after its first
+/// MLCS_MINL lines.  There must be room for one more chunk.
+///
+/// @return false when a line could not be found, the chunks are not used
+///         anymore then.
+static bool ml_chunk_split(buf_T *buf, int curix, linenr_T curline)
+{
+  int count;                    // number of entries in block
+  int idx;
+  int text_end;
+  int linecnt = 0;
+  int rest;
+  long size = 0;
+  bhdr_T *hp;
+  DATA_BL *dp;
+
+  memmove(buf->b_ml.ml_chunksize + curix + 1,
+          buf->b_ml.ml_chunksize + curix,
+          (buf->b_ml.ml_usedchunks - curix) * sizeof(chunksize_T));
+  buf->b_ml.ml_chunktree_len = 0;
+  // Compute length of first half of lines in the split chunk
+  while (curline < buf->b_ml.ml_line_count && linecnt < MLCS_MINL) {
+    if ((hp = ml_find_line(buf, curline, ML_FIND)) == NULL) {
+      buf->b_ml.ml_usedchunks = -1;
+      return false;
+    }
+    dp = hp->bh_data;
+    count = (long)(buf->b_ml.ml_locked_high) -
+            (long)(buf->b_ml.ml_locked_low) + 1;
+    idx = curline - buf->b_ml.ml_locked_low;
+    curline = buf->b_ml.ml_locked_high + 1;
+    if (idx == 0) {  // first line in block, text at the end
+      text_end = dp->db_txt_end;
+    } else {
+      text_end = ((dp->db_index[idx - 1]) & DB_INDEX_MASK);
+    }
+    // Compute index of last line to use in this MEMLINE
+    rest = count - idx;
+    if (linecnt + rest > MLCS_MINL) {
+      idx += MLCS_MINL - linecnt - 1;
+      linecnt = MLCS_MINL;
+    } else {
+      idx = count - 1;
+      linecnt += rest;
+    }
+    size += text_end - ((dp->db_index[idx]) & DB_INDEX_MASK);
+  }
+  buf->b_ml.ml_chunksize[curix].mlcs_numlines = linecnt;
+  buf->b_ml.ml_chunksize[curix + 1].mlcs_numlines -= linecnt;
+  buf->b_ml.ml_chunksize[curix].mlcs_totalsize = size;
+  buf->b_ml.ml_chunksize[curix + 1].mlcs_totalsize -= size;
+  buf->b_ml.ml_usedchunks++;
+  return true;
+}
+
 /*
  * Keep information for finding byte offset of a line, updtype may be one of:
  * ML_CHNK_ADDLINE: Add len to parent chunk, possibly splitting it
@@ -3779,7 +4457,6 @@ void ml_setflags(buf_T *buf)
  */
 static void ml_updatechunk(buf_T *buf, linenr_T line, long len, int updtype)
 {
-  static buf_T        *ml_upd_lastbuf = NULL;
   static linenr_T ml_upd_lastline;
   static linenr_T ml_upd_lastcurline;
   static int ml_upd_lastcurix;
@@ -3795,17 +4472,14 @@ static void ml_updatechunk(buf_T *buf, linenr_T line, long len, int updtype)
   if (buf->b_ml.ml_usedchunks == -1 || len == 0)
     return;
   if (buf->b_ml.ml_chunksize == NULL) {
-    buf->b_ml.ml_chunksize = xmalloc(sizeof(chunksize_T) * 100);
-    buf->b_ml.ml_numchunks = 100;
-    buf->b_ml.ml_usedchunks = 1;
-    buf->b_ml.ml_chunksize[0].mlcs_numlines = 1;
-    buf->b_ml.ml_chunksize[0].mlcs_totalsize = 1;
+    ml_chunks_init(buf);
   }
 
   if (updtype == ML_CHNK_UPDLINE && buf->b_ml.ml_line_count == 1) {
     /*
      * First line in empty buffer from ml_flush_line() -- reset
      */
+    buf->b_ml.ml_chunktree_len = 0;
     buf->b_ml.ml_usedchunks = 1;
     buf->b_ml.ml_chunksize[0].mlcs_numlines = 1;
     buf->b_ml.ml_chunksize[0].mlcs_totalsize =
@@ -3819,13 +4493,10 @@ static void ml_updatechunk(buf_T *buf, linenr_T line, long len, int updtype)
    */
   if (buf != ml_upd_lastbuf || line != ml_upd_lastline + 1
       || updtype != ML_CHNK_ADDLINE) {
-    for (curline = 1, curix = 0;
-         curix < buf->b_ml.ml_usedchunks - 1
-                 && line >= curline +
-                             buf->b_ml.ml_chunksize[curix].mlcs_numlines;
-         curix++) {
-      curline += buf->b_ml.ml_chunksize[curix].mlcs_numlines;
-    }
+    ml_chunktree_update(buf);
+    curix = ml_chunktree_find(&buf->b_ml, 1, 0, (long)line - 1,
+                              buf->b_ml.ml_usedchunks - 1, &curline, &size);
+    curline++;
   } else if (curix < buf->b_ml.ml_usedchunks - 1
              && line >= curline + buf->b_ml.ml_chunksize[curix].mlcs_numlines) {
     // Adjust cached curix & curline
@@ -3837,62 +4508,18 @@ static void ml_updatechunk(buf_T *buf, linenr_T line, long len, int updtype)
   if (updtype == ML_CHNK_DELLINE)
     len = -len;
   curchnk->mlcs_totalsize += len;
+  ml_chunktree_add(&buf->b_ml, curix, 0, len);
   if (updtype == ML_CHNK_ADDLINE) {
     curchnk->mlcs_numlines++;
+    ml_chunktree_add(&buf->b_ml, curix, 1, 0);
 
-    /* May resize here so we don't have to do it in both cases below */
-    if (buf->b_ml.ml_usedchunks + 1 >= buf->b_ml.ml_numchunks) {
-      buf->b_ml.ml_numchunks = buf->b_ml.ml_numchunks * 3 / 2;
-      buf->b_ml.ml_chunksize = (chunksize_T *)
-                               xrealloc(buf->b_ml.ml_chunksize,
-          sizeof(chunksize_T) * buf->b_ml.ml_numchunks);
-    }
+    // May resize here so we don't have to do it in both cases below
+    ml_chunks_grow(buf);
 
     if (buf->b_ml.ml_chunksize[curix].mlcs_numlines >= MLCS_MAXL) {
-      int count;                    /* number of entries in block */
-      int idx;
-      int text_end;
-      int linecnt;
-
-      memmove(buf->b_ml.ml_chunksize + curix + 1,
-          buf->b_ml.ml_chunksize + curix,
-          (buf->b_ml.ml_usedchunks - curix) *
-          sizeof(chunksize_T));
-      /* Compute length of first half of lines in the split chunk */
-      size = 0;
-      linecnt = 0;
-      while (curline < buf->b_ml.ml_line_count
-             && linecnt < MLCS_MINL) {
-        if ((hp = ml_find_line(buf, curline, ML_FIND)) == NULL) {
-          buf->b_ml.ml_usedchunks = -1;
-          return;
-        }
-        dp = hp->bh_data;
-        count = (long)(buf->b_ml.ml_locked_high) -
-                (long)(buf->b_ml.ml_locked_low) + 1;
-        idx = curline - buf->b_ml.ml_locked_low;
-        curline = buf->b_ml.ml_locked_high + 1;
-        if (idx == 0)        /* first line in block, text at the end */
-          text_end = dp->db_txt_end;
-        else
-          text_end = ((dp->db_index[idx - 1]) & DB_INDEX_MASK);
-        /* Compute index of last line to use in this MEMLINE */
-        rest = count - idx;
-        if (linecnt + rest > MLCS_MINL) {
-          idx += MLCS_MINL - linecnt - 1;
-          linecnt = MLCS_MINL;
-        } else {
-          idx = count - 1;
-          linecnt += rest;
-        }
-        size += text_end - ((dp->db_index[idx]) & DB_INDEX_MASK);
+      if (ml_chunk_split(buf, curix, curline)) {
+        ml_upd_lastbuf = NULL;      // Force recalc of curix & curline
       }
-      buf->b_ml.ml_chunksize[curix].mlcs_numlines = linecnt;
-      buf->b_ml.ml_chunksize[curix + 1].mlcs_numlines -= linecnt;
-      buf->b_ml.ml_chunksize[curix].mlcs_totalsize = size;
-      buf->b_ml.ml_chunksize[curix + 1].mlcs_totalsize -= size;
-      buf->b_ml.ml_usedchunks++;
-      ml_upd_lastbuf = NULL;         /* Force recalc of curix & curline */
       return;
     } else if (buf->b_ml.ml_chunksize[curix].mlcs_numlines >= MLCS_MINL
                && curix == buf->b_ml.ml_usedchunks - 1
@@ -3903,6 +4530,7 @@ static void ml_updatechunk(buf_T *buf, linenr_T line, long len, int updtype)
        */
       curchnk = buf->b_ml.ml_chunksize + curix + 1;
       buf->b_ml.ml_usedchunks++;
+      buf->b_ml.ml_chunktree_len = 0;
       if (line == buf->b_ml.ml_line_count) {
         curchnk->mlcs_numlines = 0;
         curchnk->mlcs_totalsize = 0;
@@ -3931,6 +4559,7 @@ static void ml_updatechunk(buf_T *buf, linenr_T line, long len, int updtype)
     }
   } else if (updtype == ML_CHNK_DELLINE) {
     curchnk->mlcs_numlines--;
+    ml_chunktree_add(&buf->b_ml, curix, -1, 0);
     ml_upd_lastbuf = NULL;       /* Force recalc of curix & curline */
     if (curix < (buf->b_ml.ml_usedchunks - 1)
         && (curchnk->mlcs_numlines + curchnk[1].mlcs_numlines)
@@ -3938,6 +4567,7 @@ static void ml_updatechunk(buf_T *buf, linenr_T line, long len, int updtype)
       curix++;
       curchnk = buf->b_ml.ml_chunksize + curix;
     } else if (curix == 0 && curchnk->mlcs_numlines <= 0) {
+      buf->b_ml.ml_chunktree_len = 0;
       buf->b_ml.ml_usedchunks--;
       memmove(buf->b_ml.ml_chunksize, buf->b_ml.ml_chunksize + 1,
           buf->b_ml.ml_usedchunks * sizeof(chunksize_T));
@@ -3950,6 +4580,7 @@ static void ml_updatechunk(buf_T *buf, linenr_T line, long len, int updtype)
     }
 
     /* Collapse chunks */
+    buf->b_ml.ml_chunktree_len = 0;
     curchnk[-1].mlcs_numlines += curchnk->mlcs_numlines;
     curchnk[-1].mlcs_totalsize += curchnk->mlcs_totalsize;
     buf->b_ml.ml_usedchunks--;
@@ -3967,6 +4598,47 @@ static void ml_updatechunk(buf_T *buf, linenr_T line, long len, int updtype)
   ml_upd_lastcurix = curix;
 }
 
+/// Like ml_updatechunk() with ML_CHNK_ADDLINE for "count" lines with "len"
+/// bytes in total, that were inserted as line "line" and following.
+/// Careful: this may cause ml_find_line() to be called.
+static void ml_updatechunk_lines(buf_T *buf, linenr_T line, long count,
+                                 long len)
+{
+  linenr_T curline;
+  long size;
+  int curix;
+
+  if (count == 1) {
+    ml_updatechunk(buf, line, len, ML_CHNK_ADDLINE);
+    return;
+  }
+  if (buf->b_ml.ml_usedchunks == -1 || count == 0) {
+    return;
+  }
+  if (buf->b_ml.ml_chunksize == NULL) {
+    ml_chunks_init(buf);
+  }
+
+  ml_chunktree_update(buf);
+  curix = ml_chunktree_find(&buf->b_ml, 1, 0, (long)line - 1,
+                            buf->b_ml.ml_usedchunks - 1, &curline, &size);
+  curline++;
+  buf->b_ml.ml_chunksize[curix].mlcs_numlines += count;
+  buf->b_ml.ml_chunksize[curix].mlcs_totalsize += len;
+  ml_chunktree_add(&buf->b_ml, curix, (int)count, len);
+  ml_upd_lastbuf = NULL;
+
+  // Split the chunk until each part is small enough.
+  while (buf->b_ml.ml_chunksize[curix].mlcs_numlines >= MLCS_MAXL) {
+    ml_chunks_grow(buf);
+    if (!ml_chunk_split(buf, curix, curline)) {
+      return;
+    }
+    curline += buf->b_ml.ml_chunksize[curix].mlcs_numlines;
+    curix++;
+  }
+}
+
 /// Find offset for line or line with offset.
 ///
 /// @param buf buffer to use
@@ -4011,21 +4683,29 @@ long ml_find_line_or_offset(buf_T *buf, linenr_T lnum, long *offp, bool no_ff)
    * Find the last chunk before the one containing our line. Last chunk is
    * special because it will never qualify
    */
-  curline = 1;
+  ml_chunktree_update(buf);
+  curline = 0;
   curix = size = 0;
-  while (curix < buf->b_ml.ml_usedchunks - 1
-         && ((lnum != 0
-              && lnum >= curline + buf->b_ml.ml_chunksize[curix].mlcs_numlines)
-             || (offset != 0
-                 && offset > size +
-                 buf->b_ml.ml_chunksize[curix].mlcs_totalsize
-                 + ffdos * buf->b_ml.ml_chunksize[curix].mlcs_numlines))) {
-    curline += buf->b_ml.ml_chunksize[curix].mlcs_numlines;
-    size += buf->b_ml.ml_chunksize[curix].mlcs_totalsize;
-    if (offset && ffdos)
-      size += buf->b_ml.ml_chunksize[curix].mlcs_numlines;
-    curix++;
+  if (lnum != 0) {
+    curix = ml_chunktree_find(&buf->b_ml, 1, 0, (long)lnum - 1,
+                              buf->b_ml.ml_usedchunks - 1, &curline, &size);
+  }
+  if (offset != 0) {
+    linenr_T off_line;
+    long off_size;
+    int off_ix = ml_chunktree_find(&buf->b_ml, ffdos, 1, offset - 1,
+                                   buf->b_ml.ml_usedchunks - 1,
+                                   &off_line, &off_size);
+    if (off_ix > curix) {
+      curix = off_ix;
+      curline = off_line;
+      size = off_size;
+    }
+    if (ffdos) {
+      size += curline;
+    }
   }
+  curline++;
 
   while ((lnum != 0 && curline < lnum) || (offset != 0 && size < offset)) {
     if (curline > buf->b_ml.ml_line_count
@@ -1,7 +1,10 @@
 #ifndef NVIM_MEMLINE_DEFS_H
 #define NVIM_MEMLINE_DEFS_H
 
+#include <uv.h>
+
 #include "nvim/memfile_defs.h"
+#include "nvim/sha256.h"
 
 ///
 /// When searching for a specific line, we remember what blocks in the tree
@@ -15,11 +18,47 @@ typedef struct info_pointer {
   int ip_index;                 // index for block with current lnum
 } infoptr_T;    // block/index pair
 
+/// A recently used data block, so that ml_find_line() can get it without
+/// searching the tree.
+typedef struct leaf_cache {
+  blocknr_T lc_bnum;            // block number of the data block
+  unsigned lc_page_count;       // number of pages in the data block
+  linenr_T lc_low;              // lowest lnum in the data block
+  linenr_T lc_high;             // highest lnum in the data block
+} leafcache_T;
+
+#define ML_LEAF_CACHE_SIZE 8    // number of entries in ml_leaf[]
+
 typedef struct ml_chunksize {
   int mlcs_numlines;
   long mlcs_totalsize;
 } chunksize_T;
 
+/// A line in a buffer snapshot.
+typedef struct {
+  size_t msl_offset;            // offset of the text in ms_text
+  colnr_T msl_len;              // length of the text, excluding the NUL
+} mlsnapline_T;
+
+/// Read-only copy of the text of a buffer, see ml_snapshot().
+/// Only ms_refcount changes after the snapshot was created, so other threads
+/// can read the text while they hold a reference.
+typedef struct {
+  uv_mutex_t ms_mutex;          // protects ms_refcount
+  int ms_refcount;
+  linenr_T ms_line_count;       // number of lines
+  mlsnapline_T *ms_lines;       // ms_line_count entries, line 1 first
+  char *ms_text;                // NUL terminated lines, in no particular order
+  size_t ms_size;               // used bytes in ms_text
+} mlsnapshot_T;
+
+/// SHA-256 state after hashing lines 1 to "mlh_lnum" of a buffer, see
+/// ml_hash().
+typedef struct {
+  linenr_T mlh_lnum;
+  context_sha256_T mlh_ctx;
+} mlhashpoint_T;
+
 // Flags when calling ml_updatechunk()
 #define ML_CHNK_ADDLINE 1
 #define ML_CHNK_DELLINE 2
@@ -34,6 +73,8 @@ typedef struct ml_chunksize {
 ///
 /// Memline also has "chunks" of 800 lines that are separate from the 128-tree
 /// structure, primarily used to speed up line2byte() and byte2line().
+/// A Fenwick tree over the chunks finds the chunk for a line or byte offset
+/// in O(log n).
 ///
 /// Motivation: If you have a file that is 10000 lines long, and you insert
 ///             a line at linenr 1000, you don't want to move 9000 lines in
@@ -49,6 +90,7 @@ typedef struct memline {
 #define ML_LINE_DIRTY   2       // cached line was changed and allocated
 #define ML_LOCKED_DIRTY 4       // ml_locked was changed
 #define ML_LOCKED_POS   8       // ml_locked needs positive block number
+#define ML_LOCKED_NOSTACK 16    // ml_stack does not lead to ml_locked
   int ml_flags;
 
   infoptr_T   *ml_stack;        // stack of pointer blocks (array of IPTRs)
@@ -62,9 +104,23 @@ typedef struct memline {
   linenr_T ml_locked_low;       // first line in ml_locked
   linenr_T ml_locked_high;      // last line in ml_locked
   int ml_locked_lineadd;        // number of lines inserted in ml_locked
+
+  leafcache_T ml_leaf[ML_LEAF_CACHE_SIZE];  // most recently used first
+  int ml_leaf_count;            // used entries in ml_leaf[]
+  uint64_t ml_leaf_hits;        // ml_find_line() found block in ml_leaf[]
+  uint64_t ml_leaf_misses;      // ml_find_line() had to search the tree
+
   chunksize_T *ml_chunksize;
   int ml_numchunks;
   int ml_usedchunks;
+  chunksize_T *ml_chunktree;    // Fenwick tree over ml_chunksize[]
+  int ml_chunktree_len;         // chunks in ml_chunktree, 0 when outdated
+
+  mlsnapshot_T *ml_snapshot;    // snapshot of the current text or NULL
+
+  mlhashpoint_T *ml_hashpoints; // hash states at data block ends, by lnum
+  int ml_hashpoint_count;       // valid entries in ml_hashpoints[]
+  int ml_hashpoint_size;        // allocated entries in ml_hashpoints[]
 } memline_T;
 
 #endif // NVIM_MEMLINE_DEFS_H
@@ -509,6 +509,85 @@ void do_outofmem_msg(size_t size)
   }
 }
 
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_ALIGN MAX(sizeof(void *), sizeof(double))
+
+/// Allocates "size" bytes from "arena", or from the heap when "arena" is
+/// NULL. Memory from an arena is only released by arena_mem_free().
+///
+/// @param align  align the memory for any object, else it is for bytes only
+void *arena_alloc(Arena *arena, size_t size, bool align)
+  FUNC_ATTR_NONNULL_RET FUNC_ATTR_WARN_UNUSED_RESULT
+{
+  if (arena == NULL) {
+    return xmalloc(size);
+  }
+  if (align) {
+    arena->pos = (arena->pos + (ARENA_ALIGN - 1)) & ~(ARENA_ALIGN - 1);
+  }
+  if (arena->cur_blk == NULL || arena->pos + size > arena->size) {
+    if (size > (ARENA_BLOCK_SIZE - ARENA_ALIGN) / 2) {
+      // A big allocation gets a block of its own, linked in behind the
+      // current block so that the rest of that can still be used.
+      char *blk = xmalloc(ARENA_ALIGN + size);
+      if (arena->cur_blk == NULL) {
+        *(char **)blk = NULL;
+        arena->cur_blk = blk;
+        arena->pos = arena->size = ARENA_ALIGN + size;
+      } else {
+        *(char **)blk = *(char **)arena->cur_blk;
+        *(char **)arena->cur_blk = blk;
+      }
+      return blk + ARENA_ALIGN;
+    }
+    char *blk = xmalloc(ARENA_BLOCK_SIZE);
+    *(char **)blk = arena->cur_blk;
+    arena->cur_blk = blk;
+    arena->pos = ARENA_ALIGN;
+    arena->size = ARENA_BLOCK_SIZE;
+  }
+  char *mem = arena->cur_blk + arena->pos;
+  arena->pos += size;
+  return mem;
+}
+
+/// Like xcalloc(), but allocates from "arena" (which may be NULL).
+void *arena_calloc(Arena *arena, size_t count, size_t size)
+  FUNC_ATTR_NONNULL_RET FUNC_ATTR_WARN_UNUSED_RESULT
+{
+  if (arena == NULL) {
+    return xcalloc(count, size);
+  }
+  void *mem = arena_alloc(arena, count * size, true);
+  memset(mem, 0, count * size);
+  return mem;
+}
+
+/// Like xmemdupz(), but allocates from "arena" (which may be NULL).
+char *arena_memdupz(Arena *arena, const char *buf, size_t size)
+  FUNC_ATTR_NONNULL_RET FUNC_ATTR_WARN_UNUSED_RESULT
+{
+  char *mem = arena_alloc(arena, size + 1, false);
+  if (size > 0) {
+    memcpy(mem, buf, size);
+  }
+  mem[size] = '\0';
+  return mem;
+}
+
+/// Frees all memory allocated from "arena" and makes it empty again.
+void arena_mem_free(Arena *arena)
+  FUNC_ATTR_NONNULL_ALL
+{
+  char *blk = arena->cur_blk;
+  while (blk != NULL) {
+    char *prev = *(char **)blk;
+    xfree(blk);
+    blk = prev;
+  }
+  *arena = (Arena)ARENA_EMPTY;
+}
+
 /// Writes time_t to "buf[8]".
 void time_to_bytes(time_t time_, uint8_t buf[8])
 {
@@ -37,6 +37,16 @@ extern MemRealloc mem_realloc;
 extern bool entered_free_all_mem;
 #endif
 
+/// Allocator for many small objects that are freed in one step, see
+/// arena_alloc() and arena_mem_free().
+typedef struct {
+  char *cur_blk;  ///< current block, starts with a link to the previous one
+  size_t pos;     ///< bytes used in cur_blk
+  size_t size;    ///< size of cur_blk
+} Arena;
+
+#define ARENA_EMPTY { .cur_blk = NULL, .pos = 0, .size = 0 }
+
 #ifdef INCLUDE_GENERATED_DECLARATIONS
 # include "memory.h.generated.h"
 #endif
@@ -41,6 +41,17 @@
 static PMap(cstr_t) *event_strings = NULL;
 static msgpack_sbuffer out_buffer;
 
+/// Messages to a single channel are passed to it in chunks of this size while
+/// they are packed, so that a big result is never held in one buffer.
+#define MESSAGE_CHUNK_SIZE (64 * 1024)
+
+/// State of a message being packed into out_buffer for one channel.
+typedef struct {
+  Channel *channel;
+  bool chunked;  ///< a part of the message was already written
+  bool failed;   ///< writing to the channel failed
+} ChunkWriter;
+
 #ifdef INCLUDE_GENERATED_DECLARATIONS
 # include "msgpack_rpc/channel.c.generated.h"
 #endif
@@ -300,13 +311,7 @@ static void handle_request(Channel *channel, msgpack_object *request)
 
   if (ERROR_SET(&error)) {
     // Validation failed, send response with error
-    if (channel_write(channel,
-                      serialize_response(channel->id,
-                                         type,
-                                         request_id,
-                                         &error,
-                                         NIL,
-                                         &out_buffer))) {
+    if (send_response(channel, type, request_id, &error, NIL)) {
       char buf[256];
       snprintf(buf, sizeof(buf),
                "ch %" PRIu64 " sent an invalid message, closed.",
@@ -320,21 +325,27 @@ static void handle_request(Channel *channel, msgpack_object *request)
 
   MsgpackRpcRequestHandler handler;
   msgpack_object *method = msgpack_rpc_method(request);
-  handler = msgpack_rpc_get_handler_for(method->via.bin.ptr,
-                                        method->via.bin.size,
-                                        &error);
+  if (method->type == MSGPACK_OBJECT_POSITIVE_INTEGER) {
+    handler = msgpack_rpc_get_handler_for_id(method->via.u64, &error);
+  } else {
+    handler = msgpack_rpc_get_handler_for(method->via.bin.ptr,
+                                          method->via.bin.size,
+                                          &error);
+  }
 
-  // check method arguments
+  // check method arguments. They are only used for the duration of the
+  // request, so they are allocated together and freed in one step.
   Array args = ARRAY_DICT_INIT;
+  Arena arena = ARENA_EMPTY;
   if (!ERROR_SET(&error)
-      && !msgpack_rpc_to_array(msgpack_rpc_args(request), &args)) {
+      && !msgpack_rpc_to_array(msgpack_rpc_args(request), &args, &arena)) {
     api_set_error(&error, kErrorTypeException, "Invalid method arguments");
   }
 
   if (ERROR_SET(&error)) {
     send_error(channel, type, request_id, error.msg);
     api_clear_error(&error);
-    api_free_array(args);
+    arena_mem_free(&arena);
     return;
   }
 
@@ -343,6 +354,7 @@ static void handle_request(Channel *channel, msgpack_object *request)
   evdata->channel = channel;
   evdata->handler = handler;
   evdata->args = args;
+  evdata->arena = arena;
   evdata->request_id = request_id;
   channel_incref(channel);
   if (handler.fast) {
@@ -364,7 +376,7 @@ static void handle_request(Channel *channel, msgpack_object *request)
       multiqueue_put_event(resize_events, ev);
     } else {
       multiqueue_put(channel->events, request_event, 1, evdata);
-      DLOG("RPC: scheduled %.*s", method->via.bin.size, method->via.bin.ptr);
+      DLOG("RPC: scheduled %s", handler.name);
     }
   }
 }
@@ -382,18 +394,11 @@ static void request_event(void **argv)
   Object result = handler.fn(channel->id, e->args, &error);
   if (e->type == kMessageTypeRequest || ERROR_SET(&error)) {
     // Send the response.
-    msgpack_packer response;
-    msgpack_packer_init(&response, &out_buffer, msgpack_sbuffer_write);
-    channel_write(channel, serialize_response(channel->id,
-                                              e->type,
-                                              e->request_id,
-                                              &error,
-                                              result,
-                                              &out_buffer));
+    send_response(channel, e->type, e->request_id, &error, result);
   } else {
     api_free_object(result);
   }
-  api_free_array(e->args);
+  arena_mem_free(&e->arena);
   channel_decref(channel);
   xfree(e);
   api_clear_error(&error);
@@ -452,12 +457,7 @@ static void send_error(Channel *chan, MessageType type, uint32_t id, char *err)
 {
   Error e = ERROR_INIT;
   api_set_error(&e, kErrorTypeException, "%s", err);
-  channel_write(chan, serialize_response(chan->id,
-                                         type,
-                                         id,
-                                         &e,
-                                         NIL,
-                                         &out_buffer));
+  send_response(chan, type, id, &e, NIL);
   api_clear_error(&e);
 }
 
@@ -467,12 +467,11 @@ static void send_request(Channel *channel,
                          Array args)
 {
   const String method = cstr_as_string((char *)name);
-  channel_write(channel, serialize_request(channel->id,
-                                           id,
-                                           method,
-                                           args,
-                                           &out_buffer,
-                                           1));
+  ChunkWriter w;
+  msgpack_packer pac = chunk_writer_init(&w, channel);
+  msgpack_rpc_serialize_request(id, method, args, &pac);
+  chunk_writer_finish(&w);
+  api_free_array(args);
 }
 
 static void send_event(Channel *channel,
@@ -480,12 +479,11 @@ static void send_event(Channel *channel,
                        Array args)
 {
   const String method = cstr_as_string((char *)name);
-  channel_write(channel, serialize_request(channel->id,
-                                           0,
-                                           method,
-                                           args,
-                                           &out_buffer,
-                                           1));
+  ChunkWriter w;
+  msgpack_packer pac = chunk_writer_init(&w, channel);
+  msgpack_rpc_serialize_request(0, method, args, &pac);
+  chunk_writer_finish(&w);
+  api_free_array(args);
 }
 
 static void broadcast_event(const char *name, Array args)
@@ -652,15 +650,14 @@ static WBuffer *serialize_request(uint64_t channel_id,
   return rv;
 }
 
-static WBuffer *serialize_response(uint64_t channel_id,
-                                   MessageType type,
-                                   uint32_t response_id,
-                                   Error *err,
-                                   Object arg,
-                                   msgpack_sbuffer *sbuffer)
+/// Sends a response, or an nvim_error_event for a failed notification.
+///
+/// @return false if writing to the channel failed.
+static bool send_response(Channel *channel, MessageType type,
+                          uint32_t response_id, Error *err, Object arg)
 {
-  msgpack_packer pac;
-  msgpack_packer_init(&pac, sbuffer, msgpack_sbuffer_write);
+  ChunkWriter w;
+  msgpack_packer pac = chunk_writer_init(&w, channel);
   if (ERROR_SET(err) && type == kMessageTypeNotification) {
     Array args = ARRAY_DICT_INIT;
     ADD(args, INTEGER_OBJ(err->type));
@@ -671,14 +668,58 @@ static WBuffer *serialize_response(uint64_t channel_id,
   } else {
     msgpack_rpc_serialize_response(response_id, err, arg, &pac);
   }
-  log_server_msg(channel_id, sbuffer);
-  WBuffer *rv = wstream_new_buffer(xmemdup(sbuffer->data, sbuffer->size),
-                                   sbuffer->size,
-                                   1,  // responses only go though 1 channel
-                                   xfree);
-  msgpack_sbuffer_clear(sbuffer);
   api_free_object(arg);
-  return rv;
+  return chunk_writer_finish(&w);
+}
+
+/// Starts packing a message for "channel" into out_buffer.
+static msgpack_packer chunk_writer_init(ChunkWriter *w, Channel *channel)
+{
+  *w = (ChunkWriter){ .channel = channel, .chunked = false, .failed = false };
+  msgpack_packer pac;
+  msgpack_packer_init(&pac, w, chunk_writer_write);
+  return pac;
+}
+
+static int chunk_writer_write(void *data, const char *buf, size_t len)
+{
+  ChunkWriter *w = data;
+  msgpack_sbuffer_write(&out_buffer, buf, len);
+  if (out_buffer.size >= MESSAGE_CHUNK_SIZE) {
+    // Hand the buffer itself over to the stream instead of copying it.
+    size_t size = out_buffer.size;
+    char *chunk = msgpack_sbuffer_release(&out_buffer);
+    if (w->failed) {
+      xfree(chunk);
+    } else {
+      w->failed = !channel_write(w->channel,
+                                 wstream_new_buffer(chunk, size, 1, xfree));
+    }
+    w->chunked = true;
+  }
+  return 0;
+}
+
+/// Writes the rest of a message started with chunk_writer_init().
+///
+/// @return false if writing to the channel failed.
+static bool chunk_writer_finish(ChunkWriter *w)
+{
+  if (w->chunked) {
+    DLOG("RPC ->ch %" PRIu64 ": message was written in chunks",
+         w->channel->id);
+  } else {
+    log_server_msg(w->channel->id, &out_buffer);
+  }
+  if (!w->failed && out_buffer.size > 0) {
+    WBuffer *rv = wstream_new_buffer(xmemdup(out_buffer.data, out_buffer.size),
+                                     out_buffer.size,
+                                     1,
+                                     xfree);
+    w->failed = !channel_write(w->channel, rv);
+  }
+  msgpack_sbuffer_clear(&out_buffer);
+  return !w->failed;
 }
 
 void rpc_set_client_info(uint64_t id, Dictionary info)
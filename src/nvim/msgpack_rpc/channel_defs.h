@@ -8,6 +8,7 @@
 #include "nvim/api/private/defs.h"
 #include "nvim/event/socket.h"
 #include "nvim/event/process.h"
+#include "nvim/memory.h"
 #include "nvim/vim.h"
 
 typedef struct Channel Channel;
@@ -23,6 +24,7 @@ typedef struct {
   Channel *channel;
   MsgpackRpcRequestHandler handler;
   Array args;
+  Arena arena;  ///< memory of args
   uint32_t request_id;
 } RequestEvent;
 
@@ -84,6 +84,17 @@ typedef struct {
 /// @return true in case of success, false otherwise.
 bool msgpack_rpc_to_object(const msgpack_object *const obj, Object *const arg)
   FUNC_ATTR_NONNULL_ALL
+{
+  return msgpack_rpc_to_object_arena(obj, arg, NULL);
+}
+
+/// Like msgpack_rpc_to_object(), but allocates the result from "arena", to be
+/// freed with arena_mem_free() instead of api_free_object().
+///
+/// @param  arena  Arena to allocate from, or NULL for the heap.
+static bool msgpack_rpc_to_object_arena(const msgpack_object *const obj,
+                                        Object *const arg, Arena *arena)
+  FUNC_ATTR_NONNULL_ARG(1, 2)
 {
   bool ret = true;
   kvec_t(MPToAPIObjectStackItem) stack = KV_INITIAL_VALUE;
@@ -138,9 +149,9 @@ bool msgpack_rpc_to_object(const msgpack_object *const obj, Object *const arg)
       case type: { \
         dest = conv(((String) { \
           .size = obj->via.attr.size, \
-          .data = (obj->via.attr.ptr == NULL || obj->via.attr.size == 0 \
-                   ? xmemdupz("", 0) \
-                   : xmemdupz(obj->via.attr.ptr, obj->via.attr.size)), \
+          .data = arena_memdupz(arena, obj->via.attr.ptr, \
+                                obj->via.attr.ptr == NULL \
+                                ? 0 : obj->via.attr.size), \
         })); \
         break; \
       }
@@ -166,7 +177,8 @@ bool msgpack_rpc_to_object(const msgpack_object *const obj, Object *const arg)
             .size = size,
             .capacity = size,
             .items = (size > 0
-                      ? xcalloc(size, sizeof(*cur.aobj->data.array.items))
+                      ? arena_calloc(arena, size,
+                                     sizeof(*cur.aobj->data.array.items))
                       : NULL),
           }));
           cur.container = true;
@@ -221,7 +233,8 @@ bool msgpack_rpc_to_object(const msgpack_object *const obj, Object *const arg)
             .size = size,
             .capacity = size,
             .items = (size > 0
-                      ? xcalloc(size, sizeof(*cur.aobj->data.dictionary.items))
+                      ? arena_calloc(arena, size,
+                                     sizeof(*cur.aobj->data.dictionary.items))
                       : NULL),
           }));
           cur.container = true;
@@ -283,18 +296,25 @@ static bool msgpack_rpc_to_string(const msgpack_object *const obj,
   return false;
 }
 
-bool msgpack_rpc_to_array(const msgpack_object *const obj, Array *const arg)
-  FUNC_ATTR_NONNULL_ALL
+/// Convert a msgpack array to an API Array.
+///
+/// @param  arena  Arena to allocate the result from, to be freed with
+///                arena_mem_free(). NULL to allocate it on the heap, to be
+///                freed with api_free_array().
+bool msgpack_rpc_to_array(const msgpack_object *const obj, Array *const arg,
+                          Arena *arena)
+  FUNC_ATTR_NONNULL_ARG(1, 2)
 {
   if (obj->type != MSGPACK_OBJECT_ARRAY) {
     return false;
   }
 
   arg->size = obj->via.array.size;
-  arg->items = xcalloc(obj->via.array.size, sizeof(Object));
+  arg->items = arena_calloc(arena, obj->via.array.size, sizeof(Object));
 
   for (uint32_t i = 0; i < obj->via.array.size; i++) {
-    if (!msgpack_rpc_to_object(obj->via.array.ptr + i, &arg->items[i])) {
+    if (!msgpack_rpc_to_object_arena(obj->via.array.ptr + i, &arg->items[i],
+                                     arena)) {
       return false;
     }
   }
@@ -545,8 +565,8 @@ msgpack_object *msgpack_rpc_method(msgpack_object *req)
 {
   msgpack_object *obj = req->via.array.ptr
     + (msgpack_rpc_is_notification(req) ? 1 : 2);
-  return obj->type == MSGPACK_OBJECT_STR || obj->type == MSGPACK_OBJECT_BIN ?
-    obj : NULL;
+  return (obj->type == MSGPACK_OBJECT_STR || obj->type == MSGPACK_OBJECT_BIN
+          || obj->type == MSGPACK_OBJECT_POSITIVE_INTEGER) ? obj : NULL;
 }
 
 msgpack_object *msgpack_rpc_args(msgpack_object *req)
@@ -608,7 +628,8 @@ MessageType msgpack_rpc_validate(uint32_t *response_id, msgpack_object *req,
   }
 
   if (!msgpack_rpc_method(req)) {
-    api_set_error(err, kErrorTypeValidation, "Method must be a string");
+    api_set_error(err, kErrorTypeValidation,
+                  "Method must be a string or a method id");
     return type;
   }
 
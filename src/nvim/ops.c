@@ -207,6 +207,7 @@ void op_shift(oparg_T *oap, int curs_top, int amount)
     block_col = curwin->w_cursor.col;
   }
 
+  extmark_splice_batch_start();
   for (i = oap->line_count - 1; i >= 0; i--) {
     first_char = *get_cursor_line_ptr();
     if (first_char == NUL) {  // empty line
@@ -220,6 +221,7 @@ void op_shift(oparg_T *oap, int curs_top, int amount)
     }
     ++curwin->w_cursor.lnum;
   }
+  extmark_splice_batch_end();
 
   changed_lines(oap->start.lnum, 0, oap->end.lnum + 1, 0L, true);
 
@@ -3301,6 +3303,18 @@ void do_put(int regname, yankreg_T *reg, int dir, long count, int flags)
           i = 1;
         }
 
+        if (!(flags & PUT_FIXINDENT)) {
+          // Without reindenting all lines can be appended at once.  The
+          // last line of a charwise register was inserted above.
+          long to_append = (long)(y_size - i) - (y_type == kMTCharWise);
+          if (ml_append_lines(lnum, y_array + i, NULL, to_append, false)
+              == FAIL) {
+            goto error;
+          }
+          lnum += (linenr_T)(y_size - i);
+          nr_lines += (long)(y_size - i);
+          i = y_size;
+        }
         for (; i < y_size; i++) {
           if ((y_type != kMTCharWise || i < y_size - 1)
               && ml_append(lnum, y_array[i], (colnr_T)0, false)
@@ -3729,6 +3743,7 @@ int do_join(size_t count,
                           curwin->w_cursor.lnum + (linenr_T)count) == FAIL) {
     return FAIL;
   }
+  extmark_splice_batch_start();
   // Allocate an array to store the number of spaces inserted before each
   // line.  We will use it to pre-compute the length of the new line and the
   // proper placement of each original line in the new one.
@@ -3892,6 +3907,7 @@ int do_join(size_t count,
   curwin->w_set_curswant = TRUE;
 
 theend:
+  extmark_splice_batch_end();
   xfree(spaces);
   if (remove_comments)
     xfree(comments);
@@ -4252,6 +4252,10 @@ static char *set_num_option(int opt_idx, char_u *varp, long value,
     if (value < 0) {
       errmsg = e_positive;
     }
+  } else if (pp == &p_mmu) {
+    if (value < 0) {
+      errmsg = e_positive;
+    }
   } else if (pp == &p_ch) {
     int minval = ui_has(kUIMessages) ? 0 : 1;
     if (value < minval) {
@@ -1520,6 +1520,13 @@ return {
       varname='p_mmp',
       defaults={if_true={vi=1000}}
     },
+    {
+      full_name='maxmemundo', abbreviation='mmu',
+      type='number', scope={'global'},
+      vi_def=true,
+      varname='p_mmu',
+      defaults={if_true={vi=0}}
+    },
     {
       full_name='menuitems', abbreviation='mis',
       type='number', scope={'global'},
@@ -1536,6 +1543,13 @@ return {
       varname='p_msm',
       defaults={if_true={vi="460000,2000,500"}}
     },
+    {
+      full_name='mmapsize', abbreviation='mms',
+      type='number', scope={'global'},
+      vi_def=true,
+      varname='p_mms',
+      defaults={if_true={vi=0}}
+    },
     {
       full_name='modeline', abbreviation='ml',
       type='bool', scope={'buffer'},
@@ -15,6 +15,11 @@
 # include <sys/uio.h>
 #endif
 
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
+
 #include <uv.h>
 
 #include "nvim/os/os.h"
@@ -662,6 +667,64 @@ ptrdiff_t os_readv(const int fd, bool *const ret_eof, struct iovec *iov,
 }
 #endif  // HAVE_READV
 
+#ifdef HAVE_SYS_MMAN_H
+/// Map the start of a file into memory for sequential reading
+///
+/// The mapping is private: its bytes may be modified, the changes are never
+/// written back to the file.
+///
+/// @param[in]  fd  File descriptor open for reading.
+/// @param[in]  len  Number of bytes to map, must not be zero.
+///
+/// @return Start of the mapping or NULL if the file cannot be mapped.
+char *os_mmap_read(const int fd, const size_t len)
+  FUNC_ATTR_WARN_UNUSED_RESULT
+{
+  assert(len > 0);
+  void *const addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                          fd, 0);
+  if (addr == MAP_FAILED) {
+    errno = 0;
+    return NULL;
+  }
+# ifdef MADV_SEQUENTIAL
+  (void)madvise(addr, len, MADV_SEQUENTIAL);
+# endif
+  return addr;
+}
+
+/// Release the pages of a mapping that will not be used again
+///
+/// Only pages that are entirely inside the given range are released.  When
+/// they are accessed later they are read from the file again.
+///
+/// @param[in]  addr  Start of the range, inside a mapping from os_mmap_read().
+/// @param[in]  len  Length of the range.
+///
+/// @return Number of bytes from `addr` up to the end of the last released
+///         page, zero when nothing was released.
+size_t os_mmap_discard(char *const addr, const size_t len)
+  FUNC_ATTR_NONNULL_ALL
+{
+# ifdef MADV_DONTNEED
+  const uintptr_t pagesize = (uintptr_t)sysconf(_SC_PAGESIZE);
+  const uintptr_t start = ((uintptr_t)addr + pagesize - 1) & ~(pagesize - 1);
+  const uintptr_t end = ((uintptr_t)addr + len) & ~(pagesize - 1);
+  if (start < end && madvise((void *)start, end - start, MADV_DONTNEED) == 0) {
+    return (size_t)(end - (uintptr_t)addr);
+  }
+# endif
+  return 0;
+}
+
+/// Unmap a mapping from os_mmap_read()
+void os_munmap(char *const addr, const size_t len)
+  FUNC_ATTR_NONNULL_ALL
+{
+  (void)munmap(addr, len);
+}
+#endif  // HAVE_SYS_MMAN_H
+
 /// Write to a file
 ///
 /// @param[in]  fd  File descriptor to write to.
@@ -704,6 +767,55 @@ ptrdiff_t os_write(const int fd, const char *const buf, const size_t size,
   return (ptrdiff_t)written_bytes;
 }
 
+#ifdef HAVE_READV
+/// Write multiple buffers to a file at once
+///
+/// Wrapper for writev().  Restarts the syscall until everything is written.
+///
+/// @param[in]  fd  File descriptor to write to.
+/// @param[in,out]  iov  Description of buffers to write. Note: this
+///                      description may change, it is incorrect to use data
+///                      it points to after os_writev().
+/// @param[in]  iov_size  Number of buffers in iov.
+///
+/// @return Number of bytes written or libuv error code (< 0).
+ptrdiff_t os_writev(const int fd, struct iovec *iov, size_t iov_size)
+  FUNC_ATTR_WARN_UNUSED_RESULT FUNC_ATTR_NONNULL_ALL
+{
+  size_t written_bytes = 0;
+  while (iov_size && iov->iov_len == 0) {
+    iov_size--;
+    iov++;
+  }
+  while (iov_size) {
+    const ptrdiff_t cur_written_bytes = writev(fd, iov, (int)iov_size);
+    if (cur_written_bytes < 0) {
+      const int error = os_translate_sys_error(errno);
+      errno = 0;
+      if (error == UV_EINTR || error == UV_EAGAIN) {
+        continue;
+      }
+      return error;
+    }
+    if (cur_written_bytes == 0) {
+      return UV_UNKNOWN;
+    }
+    written_bytes += (size_t)cur_written_bytes;
+    size_t skip = (size_t)cur_written_bytes;
+    while (iov_size && skip >= iov->iov_len) {
+      skip -= iov->iov_len;
+      iov_size--;
+      iov++;
+    }
+    if (iov_size) {
+      iov->iov_len -= skip;
+      iov->iov_base = (char *)iov->iov_base + skip;
+    }
+  }
+  return (ptrdiff_t)written_bytes;
+}
+#endif  // HAVE_READV
+
 /// Copies a file from `path` to `new_path`.
 ///
 /// @see http://docs.libuv.org/en/v1.x/fs.html#c.uv_fs_copyfile
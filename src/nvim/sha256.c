@@ -16,12 +16,24 @@
 #include <stddef.h>        // for size_t
 #include <stdio.h>         // for snprintf().
 
+#if defined(__x86_64__) && defined(__GNUC__)
+# define HAVE_SHA256_X86
+# include <cpuid.h>
+# include <immintrin.h>
+// Only for the functions that check the CPU supports these before use.
+# define SHA256_X86_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+#endif
+
 #include "nvim/sha256.h"   // for context_sha256_T
 #include "nvim/vim.h"      // for STRCPY()/STRLEN().
 
 #ifdef INCLUDE_GENERATED_DECLARATIONS
 # include "sha256.c.generated.h"
 #endif
+
+#ifdef UNIT_TESTING
+bool sha256_use_accel = true;
+#endif
 #define GET_UINT32(n, b, i) { \
   (n) = ((uint32_t)(b)[(i)] << 24) \
         | ((uint32_t)(b)[(i) + 1] << 16) \
@@ -180,6 +192,115 @@ static void sha256_process(context_sha256_T *ctx,
   ctx->state[7] += H;
 }
 
+#ifdef HAVE_SHA256_X86
+static const uint32_t sha256_k[64] = {
+  0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5,
+  0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+  0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+  0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+  0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC,
+  0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+  0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7,
+  0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+  0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+  0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+  0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3,
+  0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+  0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5,
+  0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+  0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+  0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+/// Check once whether the CPU has the SHA extensions.
+static bool sha256_have_shani(void)
+{
+  static int have_shani = -1;
+
+#ifdef UNIT_TESTING
+  if (!sha256_use_accel) {
+    return false;
+  }
+#endif
+  if (have_shani < 0) {
+    unsigned eax, ebx, ecx, edx;
+    have_shani = __get_cpuid(1, &eax, &ebx, &ecx, &edx)
+                 && (ecx & bit_SSSE3) && (ecx & bit_SSE4_1)
+                 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)
+                 && (ebx & bit_SHA);
+  }
+  return have_shani;
+}
+
+/// Process "count" blocks using the SHA extensions.
+///
+/// The state is kept as the ABEF and CDGH halves the sha256rnds2
+/// instruction works on, each instruction does two rounds.
+SHA256_X86_TARGET
+static void sha256_process_shani(context_sha256_T *ctx, const char_u *data,
+                                 size_t count)
+{
+  const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                       0x0405060700010203ULL);
+  __m128i tmp = _mm_loadu_si128((const __m128i *)&ctx->state[0]);
+  __m128i state1 = _mm_loadu_si128((const __m128i *)&ctx->state[4]);
+  tmp = _mm_shuffle_epi32(tmp, 0xB1);                 // CDAB
+  state1 = _mm_shuffle_epi32(state1, 0x1B);           // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);   // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);        // CDGH
+
+  for (; count > 0; count--, data += SHA256_BUFFER_SIZE) {
+    const __m128i abef = state0;
+    const __m128i cdgh = state1;
+    __m128i msg[4];
+
+    for (int i = 0; i < 4; i++) {
+      msg[i] = _mm_shuffle_epi8(
+          _mm_loadu_si128((const __m128i *)(data + 16 * i)), bswap);
+    }
+    for (int i = 0; i < 16; i++) {
+      __m128i m = _mm_add_epi32(
+          msg[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+      state0 = _mm_sha256rnds2_epu32(state0, state1,
+                                     _mm_shuffle_epi32(m, 0x0E));
+      if (i < 12) {
+        // Message schedule for four rounds later:
+        // W[t] = s1(W[t - 2]) + W[t - 7] + s0(W[t - 15]) + W[t - 16]
+        m = _mm_sha256msg1_epu32(msg[i & 3], msg[(i + 1) & 3]);
+        m = _mm_add_epi32(m, _mm_alignr_epi8(msg[(i + 3) & 3],
+                                             msg[(i + 2) & 3], 4));
+        msg[i & 3] = _mm_sha256msg2_epu32(m, msg[(i + 3) & 3]);
+      }
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);              // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1);           // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);        // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);           // HGFE
+  _mm_storeu_si128((__m128i *)&ctx->state[0], state0);
+  _mm_storeu_si128((__m128i *)&ctx->state[4], state1);
+}
+#endif
+
+/// Process "count" consecutive blocks of "data".
+static void sha256_process_blocks(context_sha256_T *ctx, const char_u *data,
+                                  size_t count)
+{
+#ifdef HAVE_SHA256_X86
+  if (sha256_have_shani()) {
+    sha256_process_shani(ctx, data, count);
+    return;
+  }
+#endif
+  for (; count > 0; count--, data += SHA256_BUFFER_SIZE) {
+    sha256_process(ctx, data);
+  }
+}
+
 void sha256_update(context_sha256_T *ctx, const char_u *input, size_t length)
 {
   if (length == 0) {
@@ -199,16 +320,17 @@ void sha256_update(context_sha256_T *ctx, const char_u *input, size_t length)
 
   if (left && (length >= fill)) {
     memcpy((void *)(ctx->buffer + left), (void *)input, fill);
-    sha256_process(ctx, ctx->buffer);
+    sha256_process_blocks(ctx, ctx->buffer, 1);
     length -= fill;
     input  += fill;
     left = 0;
   }
 
-  while (length >= SHA256_BUFFER_SIZE) {
-    sha256_process(ctx, input);
-    length -= SHA256_BUFFER_SIZE;
-    input  += SHA256_BUFFER_SIZE;
+  if (length >= SHA256_BUFFER_SIZE) {
+    size_t count = length / SHA256_BUFFER_SIZE;
+    sha256_process_blocks(ctx, input, count);
+    length -= count * SHA256_BUFFER_SIZE;
+    input  += count * SHA256_BUFFER_SIZE;
   }
 
   if (length) {
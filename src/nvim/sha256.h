@@ -2,6 +2,7 @@
 #define NVIM_SHA256_H
 
 #include <stdint.h>      // for uint32_t
+#include <stdbool.h>
 #include <stddef.h>
 
 #include "nvim/types.h"  // for char_u
@@ -15,6 +16,11 @@ typedef struct {
   char_u buffer[SHA256_BUFFER_SIZE];
 } context_sha256_T;
 
+#ifdef UNIT_TESTING
+/// When unit testing: false to always use the portable code
+extern bool sha256_use_accel;
+#endif
+
 #ifdef INCLUDE_GENERATED_DECLARATIONS
 # include "sha256.h.generated.h"
 #endif
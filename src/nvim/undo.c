@@ -75,6 +75,9 @@
 #define UH_MAGIC 0x18dade       /* value for uh_magic when in use */
 #define UE_MAGIC 0xabc123       /* value for ue_magic when in use */
 
+// Saved lines shorter than this are not stored as a difference.
+#define U_DELTA_MINLEN 64
+
 #include <assert.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -93,6 +96,7 @@
 #include "nvim/buffer_updates.h"
 #include "nvim/pos.h"  // MAXLNUM
 #include "nvim/mark.h"
+#include "nvim/map.h"
 #include "nvim/extmark.h"
 #include "nvim/memline.h"
 #include "nvim/message.h"
@@ -102,7 +106,6 @@
 #include "nvim/option.h"
 #include "nvim/os_unix.h"
 #include "nvim/path.h"
-#include "nvim/sha256.h"
 #include "nvim/state.h"
 #include "nvim/strings.h"
 #include "nvim/types.h"
@@ -110,6 +113,42 @@
 #include "nvim/os/time.h"
 #include "nvim/lib/kvec.h"
 
+/// Buffer and undo tree state, as stored in the undo file header and at the
+/// start of appended changes.
+typedef struct {
+  char_u hash[UNDO_HASH_SIZE];
+  linenr_T line_count;
+  char_u *line_ptr;
+  linenr_T line_lnum;
+  colnr_T line_colnr;
+  int old_header_seq;
+  int new_header_seq;
+  int cur_header_seq;
+  int num_head;
+  int seq_last;
+  int seq_cur;
+  time_t seq_time;
+  long last_save_nr;
+} undo_state_T;
+
+/// A line of the buffer text in another state of the undo tree, used to
+/// restore the full lines of delta entries.  Either a line of an undo entry,
+/// or with NULL "text" line "lnum" of the buffer.
+typedef struct {
+  const char_u *text;
+  linenr_T lnum;
+} undo_line_T;
+
+/// Where u_expand_apply() replaced lines of the text, to put them back.
+typedef struct {
+  size_t top;  ///< index of the first replaced line
+  size_t ins;  ///< number of lines put there
+  size_t del;  ///< number of lines replaced, saved in the "saved" stack
+} undo_step_T;
+
+typedef kvec_t(undo_line_T) undo_text_T;
+typedef kvec_t(undo_step_T) undo_steps_T;
+
 #ifdef INCLUDE_GENERATED_DECLARATIONS
 # include "undo.c.generated.h"
 #endif
@@ -395,7 +434,7 @@ int u_savecommon(linenr_T top, linenr_T bot, linenr_T newbot, int reload)
     /*
      * free headers to keep the size right
      */
-    while (curbuf->b_u_numhead > get_undolevel()
+    while ((curbuf->b_u_numhead > get_undolevel() || u_over_budget(curbuf))
            && curbuf->b_u_oldhead != NULL) {
       u_header_T      *uhfree = curbuf->b_u_oldhead;
 
@@ -428,15 +467,20 @@ int u_savecommon(linenr_T top, linenr_T bot, linenr_T newbot, int reload)
     uhp->uh_alt_next.ptr = old_curhead;
     if (old_curhead != NULL) {
       uhp->uh_alt_prev.ptr = old_curhead->uh_alt_prev.ptr;
-      if (uhp->uh_alt_prev.ptr != NULL)
+      if (uhp->uh_alt_prev.ptr != NULL) {
         uhp->uh_alt_prev.ptr->uh_alt_next.ptr = uhp;
+        u_header_changed(uhp->uh_alt_prev.ptr);
+      }
       old_curhead->uh_alt_prev.ptr = uhp;
+      u_header_changed(old_curhead);
       if (curbuf->b_u_oldhead == old_curhead)
         curbuf->b_u_oldhead = uhp;
     } else
       uhp->uh_alt_prev.ptr = NULL;
-    if (curbuf->b_u_newhead != NULL)
+    if (curbuf->b_u_newhead != NULL) {
       curbuf->b_u_newhead->uh_prev.ptr = uhp;
+      u_header_changed(curbuf->b_u_newhead);
+    }
 
     uhp->uh_seq = ++curbuf->b_u_seq_last;
     curbuf->b_u_seq_cur = uhp->uh_seq;
@@ -445,6 +489,7 @@ int u_savecommon(linenr_T top, linenr_T bot, linenr_T newbot, int reload)
     curbuf->b_u_time_cur = uhp->uh_time + 1;
 
     uhp->uh_walk = 0;
+    uhp->uh_dirty = true;
     uhp->uh_entry = NULL;
     uhp->uh_getbot_entry = NULL;
     uhp->uh_cursor = curwin->w_cursor;          /* save cursor pos. for undo */
@@ -470,6 +515,7 @@ int u_savecommon(linenr_T top, linenr_T bot, linenr_T newbot, int reload)
   } else {
     if (get_undolevel() < 0)            /* no undo at all */
       return OK;
+    u_header_changed(curbuf->b_u_newhead);
 
     /*
      * When saving a single line, and it has been saved just before, it
@@ -576,6 +622,7 @@ int u_savecommon(linenr_T top, linenr_T bot, linenr_T newbot, int reload)
     }
   } else
     uep->ue_array = NULL;
+  u_entry_account(curbuf, uep);
   uep->ue_next = curbuf->b_u_newhead->uh_entry;
   curbuf->b_u_newhead->uh_entry = uep;
   curbuf->b_u_synced = false;
@@ -595,6 +642,7 @@ int u_savecommon(linenr_T top, linenr_T bot, linenr_T newbot, int reload)
 # define UF_ENTRY_MAGIC         0xf518  /* magic at start of entry */
 # define UF_ENTRY_END_MAGIC     0x3581  /* magic after last entry */
 # define UF_VERSION             2       /* 2-byte undofile version number */
+# define UF_JOURNAL_MAGIC       0x7c1d  // magic at start of appended changes
 
 /* extra fields for header */
 # define UF_LAST_SAVE_NR        1
@@ -609,16 +657,7 @@ static char_u e_not_open[] = N_("E828: Cannot open undo file for writing: %s");
  */
 void u_compute_hash(char_u *hash)
 {
-  context_sha256_T ctx;
-  linenr_T lnum;
-  char_u              *p;
-
-  sha256_start(&ctx);
-  for (lnum = 1; lnum <= curbuf->b_ml.ml_line_count; ++lnum) {
-    p = ml_get(lnum);
-    sha256_update(&ctx, p, (uint32_t)(STRLEN(p) + 1));
-  }
-  sha256_finish(&ctx, hash);
+  ml_hash(curbuf, hash);
 }
 
 /// Return an allocated string of the full path of the target undofile.
@@ -747,16 +786,27 @@ static void u_free_uhp(u_header_T *uhp)
 static bool serialize_header(bufinfo_T *bi, char_u *hash)
   FUNC_ATTR_NONNULL_ALL
 {
-  buf_T *buf = bi->bi_buf;
-  FILE *fp = bi->bi_fp;
-
   // Start writing, first the magic marker and undo info version.
-  if (fwrite(UF_START_MAGIC, UF_START_MAGIC_LEN, 1, fp) != 1) {
+  if (fwrite(UF_START_MAGIC, UF_START_MAGIC_LEN, 1, bi->bi_fp) != 1) {
     return false;
   }
 
   undo_write_bytes(bi, UF_VERSION, 2);
 
+  return serialize_state(bi, hash);
+}
+
+/// Writes the state of the buffer and its undo tree.
+///
+/// @param bi   The buffer information
+/// @param hash The hash of the buffer contents
+//
+/// @returns false in case of an error.
+static bool serialize_state(bufinfo_T *bi, char_u *hash)
+  FUNC_ATTR_NONNULL_ALL
+{
+  buf_T *buf = bi->bi_buf;
+
   // Write a hash of the buffer text, so that we can verify it is
   // still the same when reading the buffer text.
   if (!undo_write(bi, hash, UNDO_HASH_SIZE)) {
@@ -796,6 +846,68 @@ static bool serialize_header(bufinfo_T *bi, char_u *hash)
   return true;
 }
 
+/// Reads the state written by serialize_state() into "st".
+///
+/// @returns false in case of an error.
+static bool unserialize_state(bufinfo_T *bi, undo_state_T *st,
+                              const char *file_name)
+  FUNC_ATTR_NONNULL_ALL
+{
+  if (!undo_read(bi, st->hash, UNDO_HASH_SIZE)) {
+    corruption_error("hash", file_name);
+    return false;
+  }
+  st->line_count = (linenr_T)undo_read_4c(bi);
+
+  // Read undo data for "U" command.
+  int str_len = undo_read_4c(bi);
+  if (str_len < 0) {
+    return false;
+  }
+  XFREE_CLEAR(st->line_ptr);
+  if (str_len > 0) {
+    st->line_ptr = undo_read_string(bi, (size_t)str_len);
+  }
+  st->line_lnum = (linenr_T)undo_read_4c(bi);
+  st->line_colnr = (colnr_T)undo_read_4c(bi);
+  if (st->line_lnum < 0 || st->line_colnr < 0) {
+    corruption_error("line lnum/col", file_name);
+    return false;
+  }
+
+  // Begin general undo data
+  st->old_header_seq = undo_read_4c(bi);
+  st->new_header_seq = undo_read_4c(bi);
+  st->cur_header_seq = undo_read_4c(bi);
+  st->num_head = undo_read_4c(bi);
+  st->seq_last = undo_read_4c(bi);
+  st->seq_cur = undo_read_4c(bi);
+  st->seq_time = undo_read_time(bi);
+
+  // Optional header fields.
+  st->last_save_nr = 0;
+  for (;; ) {
+    int len = undo_read_byte(bi);
+
+    if (len == 0 || len == EOF) {
+      break;
+    }
+    int what = undo_read_byte(bi);
+    switch (what) {
+      case UF_LAST_SAVE_NR:
+        st->last_save_nr = undo_read_4c(bi);
+        break;
+
+      default:
+        // field not supported, skip
+        while (--len >= 0) {
+          (void)undo_read_byte(bi);
+        }
+    }
+  }
+  return true;
+}
+
 /// Writes an undo header.
 ///
 /// @param bi  The buffer information
@@ -1028,6 +1140,134 @@ static void unserialize_visualinfo(bufinfo_T *bi, visualinfo_T *info)
   info->vi_curswant = undo_read_4c(bi);
 }
 
+/// Serializes the headers of the undo tree of the buffer.
+///
+/// @param bi          The buffer information
+/// @param only_dirty  Only write headers changed since the last write.
+///
+/// @returns false in case of an error.
+static bool serialize_uhps(bufinfo_T *bi, bool only_dirty)
+{
+  buf_T *buf = bi->bi_buf;
+#ifdef U_DEBUG
+  int headers_written = 0;
+#endif
+
+  int mark = ++lastmark;
+  u_header_T *uhp = buf->b_u_oldhead;
+  while (uhp != NULL) {
+    // Serialize current UHP if we haven't seen it
+    if (uhp->uh_walk != mark) {
+      uhp->uh_walk = mark;
+#ifdef U_DEBUG
+      headers_written++;
+#endif
+      if ((uhp->uh_dirty || !only_dirty) && !serialize_uhp(bi, uhp)) {
+        return false;
+      }
+      uhp->uh_dirty = false;
+    }
+
+    // Now walk through the tree - algorithm from undo_time().
+    if (uhp->uh_prev.ptr != NULL && uhp->uh_prev.ptr->uh_walk != mark) {
+      uhp = uhp->uh_prev.ptr;
+    } else if (uhp->uh_alt_next.ptr != NULL
+               && uhp->uh_alt_next.ptr->uh_walk != mark) {
+      uhp = uhp->uh_alt_next.ptr;
+    } else if (uhp->uh_next.ptr != NULL && uhp->uh_alt_prev.ptr == NULL
+               && uhp->uh_next.ptr->uh_walk != mark) {
+      uhp = uhp->uh_next.ptr;
+    } else if (uhp->uh_alt_prev.ptr != NULL) {
+      uhp = uhp->uh_alt_prev.ptr;
+    } else {
+      uhp = uhp->uh_next.ptr;
+    }
+  }
+
+#ifdef U_DEBUG
+  if (headers_written != buf->b_u_numhead) {
+    EMSGN("Written %" PRId64 " headers, ...", headers_written);
+    EMSGN("... but numhead is %" PRId64, buf->b_u_numhead);
+  }
+#endif
+  return true;
+}
+
+/// Appends the changes to the undo tree since it was last written or read to
+/// undo file "file_name".  The headers that changed are written after the
+/// new state, u_read_undo() replaces the older versions with them.
+///
+/// Not done when the file was changed by someone else, or when the appended
+/// changes would make it larger than writing it again.
+///
+/// @returns false if the whole undo file needs to be written.
+static bool u_append_undo(const char *file_name, buf_T *buf, char_u *hash)
+  FUNC_ATTR_NONNULL_ALL
+{
+  if (!buf->b_u_file_id_valid || buf->b_u_numhead == 0
+      || buf->b_u_file_size - buf->b_u_file_base > buf->b_u_file_base) {
+    return false;
+  }
+
+  int fd = os_open(file_name, O_WRONLY|O_APPEND|O_NOFOLLOW, 0);
+  if (fd < 0) {
+    return false;
+  }
+  FileInfo file_info;
+  if (!os_fileinfo_fd(fd, &file_info)
+      || !os_fileid_equal_fileinfo(&buf->b_u_file_id, &file_info)
+      || os_fileinfo_size(&file_info) != buf->b_u_file_size) {
+    close(fd);
+    return false;
+  }
+  FILE *fp = fdopen(fd, "a");
+  if (fp == NULL) {
+    close(fd);
+    return false;
+  }
+  if (p_verbose > 0) {
+    verbose_enter();
+    smsg(_("Appending to undo file: %s"), file_name);
+    verbose_leave();
+  }
+
+  // Undo must be synced.
+  u_sync(true);
+
+  bufinfo_T bi = { .bi_buf = buf, .bi_fp = fp };
+  bool write_ok = undo_write_bytes(&bi, (uintmax_t)UF_JOURNAL_MAGIC, 2)
+                  && serialize_state(&bi, hash)
+                  && serialize_uhps(&bi, true)
+                  && undo_write_bytes(&bi, (uintmax_t)UF_HEADER_END_MAGIC, 2);
+  if (fclose(fp) != 0) {
+    write_ok = false;
+  }
+  if (!write_ok) {
+    // Part of the changes may have been written, write the whole file.
+    buf->b_u_file_id_valid = false;
+    return false;
+  }
+  u_undofile_written(buf, file_name, false);
+  return true;
+}
+
+/// Remembers undo file "file_name" for appending changes to it later.
+///
+/// @param full  The whole undo tree was written, not just the changes.
+static void u_undofile_written(buf_T *buf, const char *file_name, bool full)
+  FUNC_ATTR_NONNULL_ALL
+{
+  FileInfo file_info;
+  buf->b_u_file_id_valid = os_fileinfo(file_name, &file_info);
+  if (buf->b_u_file_id_valid) {
+    os_fileinfo_id(&file_info, &buf->b_u_file_id);
+    buf->b_u_file_size = os_fileinfo_size(&file_info);
+    if (full) {
+      buf->b_u_file_base = buf->b_u_file_size;
+    }
+  }
+}
+
 /// Write the undo tree in an undo file.
 ///
 /// @param[in]  name  Name of the undo file or NULL if this function needs to
@@ -1040,18 +1280,20 @@ void u_write_undo(const char *const name, const bool forceit, buf_T *const buf,
                   char_u *const hash)
   FUNC_ATTR_NONNULL_ARG(3, 4)
 {
-  u_header_T  *uhp;
   char *file_name;
-  int mark;
-#ifdef U_DEBUG
-  int headers_written = 0;
-#endif
   int fd;
   FILE        *fp = NULL;
   int perm;
   bool write_ok = false;
   bufinfo_T bi;
 
+  // The undo file has full lines, restore the entries that only store the
+  // difference to the text they are applied to.
+  if (buf->b_u_delta_count > 0 && !u_expand_tree(buf)) {
+    IEMSG(_("E438: u_undo: line numbers wrong"));
+    return;
+  }
+
   if (name == NULL) {
     file_name = u_get_undo_file_name((char *) buf->b_ffname, false);
     if (file_name == NULL) {
@@ -1066,6 +1308,11 @@ void u_write_undo(const char *const name, const bool forceit, buf_T *const buf,
     file_name = (char *) name;
   }
 
+  // Usually only the changes since the last write need to be appended.
+  if (name == NULL && u_append_undo(file_name, buf, hash)) {
+    goto theend;
+  }
+
   /*
    * Decide about the permission to use for the undo file.  If the buffer
    * has a name use the permission of the original file.  Otherwise only
@@ -1122,6 +1369,7 @@ void u_write_undo(const char *const name, const bool forceit, buf_T *const buf,
   /* If there is no undo information at all, quit here after deleting any
    * existing undo file. */
   if (buf->b_u_numhead == 0 && buf->b_u_line_ptr == NULL) {
+    buf->b_u_file_id_valid = false;
     if (p_verbose > 0) {
       verb_msg(_("Skipping undo file write, nothing to undo"));
     }
@@ -1182,52 +1430,25 @@ void u_write_undo(const char *const name, const bool forceit, buf_T *const buf,
     goto write_error;
   }
 
-  /*
-   * Iteratively serialize UHPs and their UEPs from the top down.
-   */
-  mark = ++lastmark;
-  uhp = buf->b_u_oldhead;
-  while (uhp != NULL) {
-    /* Serialize current UHP if we haven't seen it */
-    if (uhp->uh_walk != mark) {
-      uhp->uh_walk = mark;
-#ifdef U_DEBUG
-      ++headers_written;
-#endif
-      if (!serialize_uhp(&bi, uhp)) {
-        goto write_error;
-      }
-    }
-
-    /* Now walk through the tree - algorithm from undo_time(). */
-    if (uhp->uh_prev.ptr != NULL && uhp->uh_prev.ptr->uh_walk != mark)
-      uhp = uhp->uh_prev.ptr;
-    else if (uhp->uh_alt_next.ptr != NULL
-             && uhp->uh_alt_next.ptr->uh_walk != mark)
-      uhp = uhp->uh_alt_next.ptr;
-    else if (uhp->uh_next.ptr != NULL && uhp->uh_alt_prev.ptr == NULL
-             && uhp->uh_next.ptr->uh_walk != mark)
-      uhp = uhp->uh_next.ptr;
-    else if (uhp->uh_alt_prev.ptr != NULL)
-      uhp = uhp->uh_alt_prev.ptr;
-    else
-      uhp = uhp->uh_next.ptr;
-  }
-
-  if (undo_write_bytes(&bi, (uintmax_t)UF_HEADER_END_MAGIC, 2)) {
+  // Serialize UHPs and their UEPs from the top down.
+  if (serialize_uhps(&bi, false)
+      && undo_write_bytes(&bi, (uintmax_t)UF_HEADER_END_MAGIC, 2)) {
     write_ok = true;
   }
-#ifdef U_DEBUG
-  if (headers_written != buf->b_u_numhead) {
-    EMSGN("Written %" PRId64 " headers, ...", headers_written);
-    EMSGN("... but numhead is %" PRId64, buf->b_u_numhead);
-  }
-#endif
 
 write_error:
-  fclose(fp);
-  if (!write_ok)
+  if (fclose(fp) != 0) {
+    write_ok = false;
+  }
+  if (!write_ok) {
     EMSG2(_("E829: write error in undo file: %s"), file_name);
+    buf->b_u_file_id_valid = false;
+  } else if (name == NULL) {
+    u_undofile_written(buf, file_name, true);
+  } else {
+    // Changes were not appended to the buffer's own undo file.
+    buf->b_u_file_id_valid = false;
+  }
 
 #ifdef HAVE_ACL
   if (buf->b_ffname != NULL) {
@@ -1254,7 +1475,10 @@ void u_read_undo(char *name, char_u *hash, char_u *orig_name)
   FUNC_ATTR_NONNULL_ARG(2)
 {
   u_header_T **uhp_table = NULL;
-  char_u *line_ptr = NULL;
+  long num_read_uhps = 0;
+  undo_state_T st = { .line_ptr = NULL };
+  kvec_t(u_header_T *) uhps = KV_INITIAL_VALUE;
+  Map(uint64_t, ssize_t) *seq_map = map_new(uint64_t, ssize_t)();
 
   char *file_name;
   if (name == NULL) {
@@ -1316,14 +1540,60 @@ void u_read_undo(char *name, char_u *hash, char_u *orig_name)
     goto error;
   }
 
-  char_u read_hash[UNDO_HASH_SIZE];
-  if (!undo_read(&bi, read_hash, UNDO_HASH_SIZE)) {
-    corruption_error("hash", file_name);
+  if (!unserialize_state(&bi, &st, file_name)) {
     goto error;
   }
-  linenr_T line_count = (linenr_T)undo_read_4c(&bi);
-  if (memcmp(hash, read_hash, UNDO_HASH_SIZE) != 0
-      || line_count != curbuf->b_ml.ml_line_count) {
+
+  // The headers follow, until UF_HEADER_END_MAGIC.  Changes appended by
+  // u_append_undo() then repeat this with the new state and the headers that
+  // changed, which replace the ones with the same sequence number.
+  int record = 0;
+  long base_size = -1;
+  for (;; ) {
+    record++;
+    int c;
+    while ((c = undo_read_2c(&bi)) == UF_HEADER_MAGIC) {
+      u_header_T *uhp = unserialize_uhp(&bi, file_name);
+      if (uhp == NULL) {
+        goto error;
+      }
+      uhp->uh_walk = record;
+      ssize_t idx = map_get(uint64_t, ssize_t)(seq_map, (uint64_t)uhp->uh_seq);
+      if (idx < 0) {
+        map_put(uint64_t, ssize_t)(seq_map, (uint64_t)uhp->uh_seq,
+                                   (ssize_t)kv_size(uhps));
+        kv_push(uhps, uhp);
+      } else if (kv_A(uhps, idx)->uh_walk == record) {
+        u_free_uhp(uhp);
+        corruption_error("duplicate uh_seq", file_name);
+        goto error;
+      } else {
+        u_free_uhp(kv_A(uhps, idx));
+        kv_A(uhps, idx) = uhp;
+      }
+    }
+    if (c != UF_HEADER_END_MAGIC) {
+      corruption_error("end marker", file_name);
+      goto error;
+    }
+    if (base_size < 0) {
+      base_size = ftell(fp);
+    }
+    c = undo_read_2c(&bi);
+    if (c == -1) {
+      break;
+    }
+    if (c != UF_JOURNAL_MAGIC) {
+      corruption_error("appended changes", file_name);
+      goto error;
+    }
+    if (!unserialize_state(&bi, &st, file_name)) {
+      goto error;
+    }
+  }
+
+  if (memcmp(hash, st.hash, UNDO_HASH_SIZE) != 0
+      || st.line_count != curbuf->b_ml.ml_line_count) {
     if (p_verbose > 0 || name != NULL) {
       if (name == NULL) {
         verbose_enter();
@@ -1337,87 +1607,56 @@ void u_read_undo(char *name, char_u *hash, char_u *orig_name)
     goto error;
   }
 
-  // Read undo data for "U" command.
-  int str_len = undo_read_4c(&bi);
-  if (str_len < 0) {
-    goto error;
-  }
-
-  if (str_len > 0) {
-    line_ptr = undo_read_string(&bi, (size_t)str_len);
-  }
-  linenr_T line_lnum = (linenr_T)undo_read_4c(&bi);
-  colnr_T line_colnr = (colnr_T)undo_read_4c(&bi);
-  if (line_lnum < 0 || line_colnr < 0) {
-    corruption_error("line lnum/col", file_name);
-    goto error;
-  }
-
-  // Begin general undo data
-  int old_header_seq = undo_read_4c(&bi);
-  int new_header_seq = undo_read_4c(&bi);
-  int cur_header_seq = undo_read_4c(&bi);
-  int num_head = undo_read_4c(&bi);
-  int seq_last = undo_read_4c(&bi);
-  int seq_cur = undo_read_4c(&bi);
-  time_t seq_time = undo_read_time(&bi);
-
-  // Optional header fields.
-  long last_save_nr = 0;
-  for (;; ) {
-    int len = undo_read_byte(&bi);
-
-    if (len == 0 || len == EOF) {
-      break;
-    }
-    int what = undo_read_byte(&bi);
-    switch (what) {
-      case UF_LAST_SAVE_NR:
-        last_save_nr = undo_read_4c(&bi);
-        break;
-
-      default:
-        // field not supported, skip
-        while (--len >= 0) {
-          (void)undo_read_byte(&bi);
-        }
+  // Headers that were freed after being written are no longer linked from
+  // the tree, only keep the ones that can be reached from its ends.
+  kvec_t(u_header_T *) todo = KV_INITIAL_VALUE;
+  kv_push(todo, u_read_find_seq(uhps.items, seq_map, st.old_header_seq));
+  kv_push(todo, u_read_find_seq(uhps.items, seq_map, st.new_header_seq));
+  kv_push(todo, u_read_find_seq(uhps.items, seq_map, st.cur_header_seq));
+  while (kv_size(todo) > 0) {
+    u_header_T *uhp = kv_pop(todo);
+    if (uhp == NULL || uhp->uh_walk < 0) {
+      continue;
     }
+    uhp->uh_walk = -1;
+    kv_push(todo, u_read_find_seq(uhps.items, seq_map, uhp->uh_next.seq));
+    kv_push(todo, u_read_find_seq(uhps.items, seq_map, uhp->uh_prev.seq));
+    kv_push(todo, u_read_find_seq(uhps.items, seq_map, uhp->uh_alt_next.seq));
+    kv_push(todo, u_read_find_seq(uhps.items, seq_map, uhp->uh_alt_prev.seq));
   }
+  kv_destroy(todo);
 
   // uhp_table will store the freshly created undo headers we allocate
-  // until we insert them into curbuf. The table remains sorted by the
-  // sequence numbers of the headers.
+  // until we insert them into curbuf.
   // When there are no headers uhp_table is NULL.
+  int num_head = st.num_head;
   if (num_head > 0) {
     if ((size_t)num_head < SIZE_MAX / sizeof(*uhp_table)) {  // -V547
       uhp_table = xmalloc((size_t)num_head * sizeof(*uhp_table));
     }
   }
-
-  long num_read_uhps = 0;
-
-  int c;
-  while ((c = undo_read_2c(&bi)) == UF_HEADER_MAGIC) {
-    if (num_read_uhps >= num_head) {
+  for (size_t i = 0; i < kv_size(uhps); i++) {
+    u_header_T *uhp = kv_A(uhps, i);
+    kv_A(uhps, i) = NULL;
+    if (uhp->uh_walk >= 0) {
+      u_free_uhp(uhp);
+    } else if (num_read_uhps >= num_head) {
+      u_free_uhp(uhp);
       corruption_error("num_head too small", file_name);
       goto error;
+    } else {
+      uhp->uh_walk = 0;
+      uhp_table[num_read_uhps++] = uhp;
     }
-
-    u_header_T *uhp = unserialize_uhp(&bi, file_name);
-    if (uhp == NULL) {
-      goto error;
-    }
-    uhp_table[num_read_uhps++] = uhp;
   }
 
   if (num_read_uhps != num_head) {
     corruption_error("num_head", file_name);
     goto error;
   }
-  if (c != UF_HEADER_END_MAGIC) {
-    corruption_error("end marker", file_name);
-    goto error;
-  }
+  int old_header_seq = st.old_header_seq;
+  int new_header_seq = st.new_header_seq;
+  int cur_header_seq = st.cur_header_seq;
 
 #ifdef U_DEBUG
   size_t amount = num_head * sizeof(int) + 1;
@@ -1496,22 +1735,41 @@ void u_read_undo(char *name, char_u *hash, char_u *orig_name)
   // Now that we have read the undo info successfully, free the current undo
   // info and use the info from the file.
   u_blockfree(curbuf);
+  for (int i = 0; i < num_head; i++) {
+    if (uhp_table[i] != NULL) {
+      for (u_entry_T *uep = uhp_table[i]->uh_entry; uep != NULL;
+           uep = uep->ue_next) {
+        u_entry_account(curbuf, uep);
+      }
+    }
+  }
   curbuf->b_u_oldhead = old_idx < 0 ? NULL : uhp_table[old_idx];
   curbuf->b_u_newhead = new_idx < 0 ? NULL : uhp_table[new_idx];
   curbuf->b_u_curhead = cur_idx < 0 ? NULL : uhp_table[cur_idx];
-  curbuf->b_u_line_ptr = line_ptr;
-  curbuf->b_u_line_lnum = line_lnum;
-  curbuf->b_u_line_colnr = line_colnr;
+  curbuf->b_u_line_ptr = st.line_ptr;
+  curbuf->b_u_line_lnum = st.line_lnum;
+  curbuf->b_u_line_colnr = st.line_colnr;
   curbuf->b_u_numhead = num_head;
-  curbuf->b_u_seq_last = seq_last;
-  curbuf->b_u_seq_cur = seq_cur;
-  curbuf->b_u_time_cur = seq_time;
-  curbuf->b_u_save_nr_last = last_save_nr;
-  curbuf->b_u_save_nr_cur = last_save_nr;
+  curbuf->b_u_seq_last = st.seq_last;
+  curbuf->b_u_seq_cur = st.seq_cur;
+  curbuf->b_u_time_cur = st.seq_time;
+  curbuf->b_u_save_nr_last = st.last_save_nr;
+  curbuf->b_u_save_nr_cur = st.last_save_nr;
 
   curbuf->b_u_synced = true;
   xfree(uhp_table);
 
+  // Changes can be appended to the buffer's own undo file.
+  if (name == NULL) {
+    FileInfo file_info;
+    curbuf->b_u_file_id_valid = os_fileinfo_fd(fileno(fp), &file_info);
+    if (curbuf->b_u_file_id_valid) {
+      os_fileinfo_id(&file_info, &curbuf->b_u_file_id);
+      curbuf->b_u_file_size = os_fileinfo_size(&file_info);
+      curbuf->b_u_file_base = (uint64_t)base_size;
+    }
+  }
+
 #ifdef U_DEBUG
   for (int i = 0; i < num_head; i++) {
     if (uhp_table_used[i] == 0) {
@@ -1528,7 +1786,12 @@ void u_read_undo(char *name, char_u *hash, char_u *orig_name)
   goto theend;
 
 error:
-  xfree(line_ptr);
+  xfree(st.line_ptr);
+  for (size_t i = 0; i < kv_size(uhps); i++) {
+    if (kv_A(uhps, i) != NULL) {
+      u_free_uhp(kv_A(uhps, i));
+    }
+  }
   if (uhp_table != NULL) {
     for (long i = 0; i < num_read_uhps; i++)
       if (uhp_table[i] != NULL) {
@@ -1538,6 +1801,8 @@ error:
   }
 
 theend:
+  kv_destroy(uhps);
+  map_free(uint64_t, ssize_t)(seq_map);
   if (fp != NULL) {
     fclose(fp);
   }
@@ -1546,6 +1811,14 @@ theend:
   }
 }
 
+/// Finds the header with sequence number "seq" read from the undo file.
+static u_header_T *u_read_find_seq(u_header_T **uhps,
+                                   Map(uint64_t, ssize_t) *seq_map, long seq)
+{
+  ssize_t idx = map_get(uint64_t, ssize_t)(seq_map, (uint64_t)seq);
+  return seq > 0 && idx >= 0 ? uhps[idx] : NULL;
+}
+
 /// Writes a sequence of bytes to the undo file.
 ///
 /// @param bi  The buffer info
@@ -1707,6 +1980,7 @@ bool u_undo_and_forget(int count)
   if (curbuf->b_u_curhead) {
     to_forget->uh_alt_next.ptr = NULL;
     curbuf->b_u_curhead->uh_alt_prev.ptr = to_forget->uh_alt_prev.ptr;
+    u_header_changed(curbuf->b_u_curhead);
     curbuf->b_u_seq_cur = curbuf->b_u_curhead->uh_next.ptr ?
         curbuf->b_u_curhead->uh_next.ptr->uh_seq : 0;
   } else if (curbuf->b_u_newhead) {
@@ -1714,9 +1988,11 @@ bool u_undo_and_forget(int count)
   }
   if (to_forget->uh_alt_prev.ptr) {
     to_forget->uh_alt_prev.ptr->uh_alt_next.ptr = curbuf->b_u_curhead;
+    u_header_changed(to_forget->uh_alt_prev.ptr);
   }
   if (curbuf->b_u_newhead) {
     curbuf->b_u_newhead->uh_prev.ptr = curbuf->b_u_curhead;
+    u_header_changed(curbuf->b_u_newhead);
   }
   if (curbuf->b_u_seq_last == to_forget->uh_seq) {
     curbuf->b_u_seq_last--;
@@ -2062,11 +2338,15 @@ target_zero:
           }
           if (last->uh_alt_next.ptr != NULL) {
             last->uh_alt_next.ptr->uh_alt_prev.ptr = last->uh_alt_prev.ptr;
+            u_header_changed(last->uh_alt_next.ptr);
           }
           last->uh_alt_prev.ptr->uh_alt_next.ptr = last->uh_alt_next.ptr;
+          u_header_changed(last->uh_alt_prev.ptr);
           last->uh_alt_prev.ptr = NULL;
           last->uh_alt_next.ptr = uhp;
           uhp->uh_alt_prev.ptr = last;
+          u_header_changed(last);
+          u_header_changed(uhp);
 
           if (curbuf->b_u_oldhead == uhp) {
             curbuf->b_u_oldhead = last;
@@ -2074,6 +2354,7 @@ target_zero:
           uhp = last;
           if (uhp->uh_next.ptr != NULL) {
             uhp->uh_next.ptr->uh_prev.ptr = uhp;
+            u_header_changed(uhp->uh_next.ptr);
           }
         }
         curbuf->b_u_curhead = uhp;
@@ -2180,6 +2461,10 @@ static void u_undoredo(int undo, bool do_buf_event)
     oldsize = bot - top - 1;        /* number of lines before undo */
     newsize = uep->ue_size;         /* number of lines after undo */
 
+    if (uep->ue_delta) {
+      u_delta_decode(uep);
+    }
+
     if (top < newlnum) {
       /* If the saved cursor is somewhere in this undo block, move it to
        * the remembered position.  Makes "gwap" put the cursor back
@@ -2268,6 +2553,7 @@ static void u_undoredo(int undo, bool do_buf_event)
     uep->ue_size = oldsize;
     uep->ue_array = newarray;
     uep->ue_bot = top + newsize + 1;
+    u_entry_account(curbuf, uep);
 
     /*
      * insert this entry in front of the new entry list
@@ -2277,8 +2563,9 @@ static void u_undoredo(int undo, bool do_buf_event)
     newlist = uep;
   }
 
-  // Adjust Extmarks
+  // Adjust Extmarks. The "bytes" channels already got the changed lines.
   ExtmarkUndoObject undo_info;
+  buf_updates_skip_splices(do_buf_event);
   if (undo) {
     for (i = (int)kv_size(curhead->uh_extmark) - 1; i > -1; i--) {
       undo_info = kv_A(curhead->uh_extmark, i);
@@ -2291,11 +2578,14 @@ static void u_undoredo(int undo, bool do_buf_event)
       extmark_apply_undo(undo_info, undo);
     }
   }
+  buf_updates_skip_splices(false);
   // finish Adjusting extmarks
 
 
   curhead->uh_entry = newlist;
   curhead->uh_flags = new_flags;
+  u_header_changed(curhead);
+  u_compact_entries(curhead);
   if ((old_flags & UH_EMPTYBUF) && BUFEMPTY()) {
     curbuf->b_ml.ml_flags |= ML_EMPTY;
   }
@@ -2472,6 +2762,9 @@ u_sync(
     int force               // Also sync when no_u_sync is set.
 )
 {
+  // Undo for pending extmark splices belongs to the current entry list.
+  extmark_splice_flush();
+
   /* Skip it when already synced or syncing is disabled. */
   if (curbuf->b_u_synced || (!force && no_u_sync > 0))
     return;
@@ -2480,6 +2773,7 @@ u_sync(
   else {
     u_getbot();                     /* compute ue_bot of previous u_save */
     curbuf->b_u_curhead = NULL;
+    u_compact_entries(curbuf->b_u_newhead);
   }
 }
 
@@ -2616,6 +2910,8 @@ void ex_undojoin(exarg_T *eap)
   if (get_undolevel() < 0) {
     return;                 // no entries, nothing to do
   } else {
+    // The next change may modify the lines the entries are relative to.
+    u_expand_entries(curbuf->b_u_newhead);
     curbuf->b_u_synced = false;  // Append next change to last entry
   }
 }
@@ -2644,8 +2940,9 @@ void u_find_first_changed(void)
     return;      /* undid something in an autocmd? */
 
   /* Check that the last undo block was for the whole file. */
+  u_header_changed(uhp);
   uep = uhp->uh_entry;
-  if (uep->ue_top != 0 || uep->ue_bot != 0)
+  if (uep->ue_top != 0 || uep->ue_bot != 0 || uep->ue_delta)
     return;
 
   for (lnum = 1; lnum < curbuf->b_ml.ml_line_count
@@ -2678,8 +2975,18 @@ void u_update_save_nr(buf_T *buf)
     uhp = uhp->uh_next.ptr;
   else
     uhp = buf->b_u_newhead;
-  if (uhp != NULL)
+  if (uhp != NULL) {
     uhp->uh_save_nr = buf->b_u_save_nr_last;
+    u_header_changed(uhp);
+  }
+}
+
+/// Remember that header "uhp" needs to be written to the undo file again.
+static void u_header_changed(u_header_T *uhp)
+{
+  if (uhp != NULL) {
+    uhp->uh_dirty = true;
+  }
 }
 
 static void u_unch_branch(u_header_T *uhp)
@@ -2687,7 +2994,10 @@ static void u_unch_branch(u_header_T *uhp)
   u_header_T  *uh;
 
   for (uh = uhp; uh != NULL; uh = uh->uh_prev.ptr) {
-    uh->uh_flags |= UH_CHANGED;
+    if (!(uh->uh_flags & UH_CHANGED)) {
+      uh->uh_flags |= UH_CHANGED;
+      u_header_changed(uh);
+    }
     if (uh->uh_alt_next.ptr != NULL)
       u_unch_branch(uh->uh_alt_next.ptr);           /* recursive */
   }
@@ -2759,21 +3069,28 @@ u_freeheader(
   if (uhp->uh_alt_next.ptr != NULL)
     u_freebranch(buf, uhp->uh_alt_next.ptr, uhpp);
 
-  if (uhp->uh_alt_prev.ptr != NULL)
+  if (uhp->uh_alt_prev.ptr != NULL) {
     uhp->uh_alt_prev.ptr->uh_alt_next.ptr = NULL;
+    u_header_changed(uhp->uh_alt_prev.ptr);
+  }
 
   /* Update the links in the list to remove the header. */
-  if (uhp->uh_next.ptr == NULL)
+  if (uhp->uh_next.ptr == NULL) {
     buf->b_u_oldhead = uhp->uh_prev.ptr;
-  else
+  } else {
     uhp->uh_next.ptr->uh_prev.ptr = uhp->uh_prev.ptr;
+    u_header_changed(uhp->uh_next.ptr);
+  }
 
-  if (uhp->uh_prev.ptr == NULL)
+  if (uhp->uh_prev.ptr == NULL) {
     buf->b_u_newhead = uhp->uh_next.ptr;
-  else
+  } else {
     for (uhap = uhp->uh_prev.ptr; uhap != NULL;
-         uhap = uhap->uh_alt_next.ptr)
+         uhap = uhap->uh_alt_next.ptr) {
       uhap->uh_next.ptr = uhp->uh_next.ptr;
+      u_header_changed(uhap);
+    }
+  }
 
   u_freeentries(buf, uhp, uhpp);
 }
@@ -2798,8 +3115,10 @@ u_freebranch(
     return;
   }
 
-  if (uhp->uh_alt_prev.ptr != NULL)
+  if (uhp->uh_alt_prev.ptr != NULL) {
     uhp->uh_alt_prev.ptr->uh_alt_next.ptr = NULL;
+    u_header_changed(uhp->uh_alt_prev.ptr);
+  }
 
   next = uhp;
   while (next != NULL) {
@@ -2834,6 +3153,10 @@ u_freeentries(
 
   for (uep = uhp->uh_entry; uep != NULL; uep = nuep) {
     nuep = uep->ue_next;
+    buf->b_u_bytes -= uep->ue_bytes;
+    if (uep->ue_delta) {
+      buf->b_u_delta_count--;
+    }
     u_freeentry(uep, uep->ue_size);
   }
 
@@ -2860,6 +3183,289 @@ static void u_freeentry(u_entry_T *uep, long n)
   xfree((char_u *)uep);
 }
 
+/// Update the memory used by entry "uep" in b_u_bytes of "buf".
+static void u_entry_account(buf_T *buf, u_entry_T *uep)
+{
+  size_t bytes = sizeof(u_entry_T) + sizeof(char_u *) * (size_t)uep->ue_size;
+  for (long i = 0; i < uep->ue_size; i++) {
+    bytes += STRLEN(uep->ue_array[i]) + 1;
+  }
+  buf->b_u_bytes = buf->b_u_bytes - uep->ue_bytes + bytes;
+  uep->ue_bytes = bytes;
+}
+
+/// Check if the undo information of "buf" uses more memory than
+/// 'maxmemundo' allows.
+static bool u_over_budget(const buf_T *buf)
+{
+  return p_mmu > 0 && buf->b_u_bytes > (size_t)p_mmu * 1024;
+}
+
+/// Number of lines entry "uep" spans in the current buffer text.
+static linenr_T u_entry_newsize(const u_entry_T *uep)
+{
+  linenr_T bot = uep->ue_bot == 0 ? curbuf->b_ml.ml_line_count + 1
+                                  : uep->ue_bot;
+  return bot - uep->ue_top - 1;
+}
+
+/// Replace the saved lines of the one-line entries of "uhp" by the part that
+/// differs from the line in the buffer.
+///
+/// Only done for an entry when the entries before it in the list keep the
+/// line count and do not include its line.  Then u_undoredo() finds the
+/// same text in the buffer when it gets to the entry, and can restore the
+/// line from it.
+static void u_compact_entries(u_header_T *uhp)
+{
+  if (uhp == NULL || curbuf->b_p_udf) {
+    return;
+  }
+
+  Map(int, int) *seen = NULL;  // lines of the entries before "uep"
+  for (u_entry_T *uep = uhp->uh_entry; uep != NULL; uep = uep->ue_next) {
+    if (uep->ue_size != 1 || u_entry_newsize(uep) != 1) {
+      break;
+    }
+    int lnum = (int)uep->ue_top + 1;
+    if (!uep->ue_delta && (seen == NULL || !map_has(int, int)(seen, lnum))) {
+      u_delta_encode(uep);
+    }
+    if (uep->ue_next != NULL) {
+      if (seen == NULL) {
+        seen = map_new(int, int)();
+      }
+      map_put(int, int)(seen, lnum, 1);
+    }
+  }
+  if (seen != NULL) {
+    map_free(int, int)(seen);
+  }
+}
+
+/// Restore the full lines of the entries of "uhp".  Must be done before the
+/// buffer text the entries are relative to changes.
+static void u_expand_entries(u_header_T *uhp)
+{
+  for (u_entry_T *uep = uhp->uh_entry; uep != NULL; uep = uep->ue_next) {
+    if (uep->ue_delta) {
+      u_delta_decode(uep);
+    }
+  }
+}
+
+/// Store only the bytes of the saved line of "uep" that differ from line
+/// "ue_top + 1" in the buffer.  Short lines and lines that changed a lot
+/// are kept as they are.
+static void u_delta_encode(u_entry_T *uep)
+{
+  char_u *old = uep->ue_array[0];
+  const char_u *cur = ml_get(uep->ue_top + 1);
+  size_t old_len = STRLEN(old);
+  size_t cur_len = STRLEN(cur);
+
+  if (old_len < U_DELTA_MINLEN) {
+    return;
+  }
+
+  size_t prefix = 0;
+  while (prefix < old_len && prefix < cur_len && old[prefix] == cur[prefix]) {
+    prefix++;
+  }
+  size_t suffix = 0;
+  while (suffix < old_len - prefix && suffix < cur_len - prefix
+         && old[old_len - suffix - 1] == cur[cur_len - suffix - 1]) {
+    suffix++;
+  }
+  size_t len = old_len - prefix - suffix;
+  if (len > old_len / 2) {
+    return;
+  }
+
+  uep->ue_array[0] = vim_strnsave(old + prefix, len);
+  xfree(old);
+  uep->ue_delta = true;
+  uep->ue_prefix = (colnr_T)prefix;
+  uep->ue_suffix = (colnr_T)suffix;
+  curbuf->b_u_delta_count++;
+  u_entry_account(curbuf, uep);
+}
+
+/// Rebuild the saved line of "uep" from the differing bytes and line
+/// "ue_top + 1" in the buffer.
+static void u_delta_decode(u_entry_T *uep)
+{
+  u_delta_decode_line(curbuf, uep, ml_get(uep->ue_top + 1));
+}
+
+/// Rebuild the saved line of "uep" of buffer "buf" from the differing bytes
+/// and "cur", the line "ue_top + 1" in the text the entry is applied to.
+static void u_delta_decode_line(buf_T *buf, u_entry_T *uep,
+                                const char_u *cur)
+{
+  size_t cur_len = STRLEN(cur);
+  size_t prefix = MIN((size_t)uep->ue_prefix, cur_len);
+  size_t suffix = MIN((size_t)uep->ue_suffix, cur_len - prefix);
+  size_t len = STRLEN(uep->ue_array[0]);
+
+  char_u *line = xmalloc(prefix + len + suffix + 1);
+  memcpy(line, cur, prefix);
+  memcpy(line + prefix, uep->ue_array[0], len);
+  memcpy(line + prefix + len, cur + cur_len - suffix, suffix);
+  line[prefix + len + suffix] = NUL;
+
+  xfree(uep->ue_array[0]);
+  uep->ue_array[0] = line;
+  uep->ue_delta = false;
+  buf->b_u_delta_count--;
+  u_entry_account(buf, uep);
+}
+
+/// Restore the full lines of all the delta entries in the undo tree of
+/// "buf", e.g. to write them to an undo file.
+///
+/// The entries of a header are relative to the text on the side of it where
+/// the buffer is now, so the tree is walked from the current state.  The text
+/// of each state is kept as references to the lines of the buffer and the
+/// entries, in the same way u_undoredo() changes the buffer.
+///
+/// @return false when the line numbers of an entry do not fit the text.
+static bool u_expand_tree(buf_T *buf)
+{
+  undo_text_T text = KV_INITIAL_VALUE;
+  undo_text_T saved = KV_INITIAL_VALUE;
+  undo_steps_T steps = KV_INITIAL_VALUE;
+  // the states on the way from the current one: the header after which the
+  // state is (NULL before the oldest), and the steps that led there
+  kvec_t(u_header_T *) states = KV_INITIAL_VALUE;
+  kvec_t(size_t) state_steps = KV_INITIAL_VALUE;
+  bool ok = true;
+
+  kv_resize(text, (size_t)buf->b_ml.ml_line_count);
+  for (linenr_T lnum = 1; lnum <= buf->b_ml.ml_line_count; lnum++) {
+    kv_push(text, ((undo_line_T){ .text = NULL, .lnum = lnum }));
+  }
+
+  int mark = ++lastmark;
+  kv_push(states, buf->b_u_curhead != NULL ? buf->b_u_curhead->uh_next.ptr
+                                           : buf->b_u_newhead);
+  kv_push(state_steps, 0);
+  while (kv_size(states) > 0 && buf->b_u_delta_count > 0) {
+    u_header_T *state = kv_last(states);
+    // Next header to cross: the one the state is after, leading to the
+    // state before it, or one of the headers that follow the state.
+    u_header_T *uhp = state;
+    if (uhp == NULL || uhp->uh_walk == mark) {
+      uhp = state == NULL ? buf->b_u_oldhead : state->uh_prev.ptr;
+      while (uhp != NULL && uhp->uh_alt_prev.ptr != NULL) {
+        uhp = uhp->uh_alt_prev.ptr;
+      }
+      while (uhp != NULL && uhp->uh_walk == mark) {
+        uhp = uhp->uh_alt_next.ptr;
+      }
+    }
+
+    if (uhp == NULL) {
+      // all done here, go back to the previous state
+      size_t n = kv_pop(state_steps);
+      (void)kv_pop(states);
+      while (kv_size(steps) > n) {
+        undo_step_T step = kv_pop(steps);
+        undo_line_T *lines = u_text_splice(&text, step.top, step.ins,
+                                           step.del);
+        kv_drop(saved, step.del);
+        memcpy(lines, saved.items + kv_size(saved),
+               step.del * sizeof(*lines));
+      }
+      continue;
+    }
+
+    uhp->uh_walk = mark;
+    size_t n = kv_size(steps);
+    if (!u_expand_apply(buf, uhp, &text, &saved, &steps)) {
+      ok = false;
+      break;
+    }
+    kv_push(states, uhp == state ? uhp->uh_next.ptr : uhp);
+    kv_push(state_steps, n);
+  }
+
+  kv_destroy(text);
+  kv_destroy(saved);
+  kv_destroy(steps);
+  kv_destroy(states);
+  kv_destroy(state_steps);
+  return ok;
+}
+
+/// Restore the full lines of the delta entries of "uhp" from "text", then
+/// change "text" to the state on the other side of "uhp".  The replaced
+/// lines are pushed on "saved" and the places on "steps".
+static bool u_expand_apply(buf_T *buf, u_header_T *uhp, undo_text_T *text,
+                           undo_text_T *saved, undo_steps_T *steps)
+{
+  // The entries are relative to the text before any of them is applied,
+  // see u_compact_entries().
+  for (u_entry_T *uep = uhp->uh_entry; uep != NULL; uep = uep->ue_next) {
+    if (uep->ue_delta) {
+      if (uep->ue_top < 0 || (size_t)uep->ue_top >= kv_size(*text)) {
+        return false;
+      }
+      undo_line_T line = kv_A(*text, uep->ue_top);
+      u_delta_decode_line(buf, uep, line.text != NULL
+                          ? line.text : ml_get_buf(buf, line.lnum, false));
+    }
+  }
+
+  for (u_entry_T *uep = uhp->uh_entry; uep != NULL; uep = uep->ue_next) {
+    size_t count = kv_size(*text);
+    if (uep->ue_top < 0 || uep->ue_bot < 0 || uep->ue_size < 0) {
+      return false;
+    }
+    size_t top = (size_t)uep->ue_top;
+    size_t bot = uep->ue_bot == 0 ? count + 1 : (size_t)uep->ue_bot;
+    if (top > count || top >= bot || bot > count + 1) {
+      return false;
+    }
+    size_t del = bot - top - 1;
+    size_t ins = (size_t)uep->ue_size;
+
+    for (size_t i = 0; i < del; i++) {
+      kv_push(*saved, kv_A(*text, top + i));
+    }
+    undo_line_T *lines;
+    if (del == count && ins == 0) {
+      // like ml_delete() leaves an empty line in an empty buffer
+      lines = u_text_splice(text, top, del, 1);
+      lines[0] = (undo_line_T){ .text = (char_u *)"", .lnum = 0 };
+      ins = 1;
+    } else {
+      lines = u_text_splice(text, top, del, ins);
+      for (size_t i = 0; i < ins; i++) {
+        lines[i] = (undo_line_T){ .text = uep->ue_array[i], .lnum = 0 };
+      }
+    }
+    kv_push(*steps, ((undo_step_T){ .top = top, .ins = ins, .del = del }));
+  }
+  return true;
+}
+
+/// Replace "del" lines of "text" at index "at" with "ins" lines.
+///
+/// @return the place of the new lines, for the caller to fill in.
+static undo_line_T *u_text_splice(undo_text_T *text, size_t at, size_t del,
+                                  size_t ins)
+{
+  size_t size = kv_size(*text) - del + ins;
+  if (size > kv_max(*text)) {
+    kv_resize(*text, MAX(size, kv_max(*text) * 2));
+  }
+  memmove(text->items + at + ins, text->items + at + del,
+          (kv_size(*text) - at - del) * sizeof(undo_line_T));
+  kv_size(*text) = size;
+  return text->items + at;
+}
+
 /*
  * invalidate the undo buffer; called when storage has already been released
  */
@@ -2868,6 +3474,9 @@ void u_clearall(buf_T *buf)
   buf->b_u_newhead = buf->b_u_oldhead = buf->b_u_curhead = NULL;
   buf->b_u_synced = true;
   buf->b_u_numhead = 0;
+  buf->b_u_bytes = 0;
+  buf->b_u_delta_count = 0;
+  buf->b_u_file_id_valid = false;
   buf->b_u_line_ptr = NULL;
   buf->b_u_line_lnum = 0;
 }
@@ -2951,6 +3560,7 @@ void u_blockfree(buf_T *buf)
     assert(buf->b_u_oldhead != previous_oldhead);
   }
   xfree(buf->b_u_line_ptr);
+  buf->b_u_file_id_valid = false;
 }
 
 /*
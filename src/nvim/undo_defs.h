@@ -27,6 +27,11 @@ struct u_entry {
   linenr_T ue_lcount;           /* linecount when u_save called */
   char_u      **ue_array;       /* array of lines in undo block */
   long ue_size;                 /* number of lines in ue_array */
+  size_t ue_bytes;              // memory counted in b_u_bytes
+  bool ue_delta;                // ue_array[0] only has the part of the line
+                                // that differs from the line in the buffer
+  colnr_T ue_prefix;            // with ue_delta: bytes before ue_array[0]
+  colnr_T ue_suffix;            // with ue_delta: bytes after ue_array[0]
 #ifdef U_DEBUG
   int ue_magic;                 /* magic number to check allocation */
 #endif
@@ -53,6 +58,7 @@ struct u_header {
   } uh_alt_prev;
   long uh_seq;                  /* sequence number, higher == newer undo */
   int uh_walk;                  /* used by undo_time() */
+  bool uh_dirty;                // changed since written to the undo file
   u_entry_T   *uh_entry;        /* pointer to first entry */
   u_entry_T   *uh_getbot_entry;   /* pointer to where ue_bot must be set */
   pos_T uh_cursor;              /* cursor position before saving */
@@ -287,6 +287,44 @@ describe('api/buf', function()
       end
     end)
 
+    it('inserts many lines in the middle of a buffer', function()
+      local lines = {}
+      for i = 1, 2000 do
+        lines[i] = ('line %d'):format(i)
+      end
+      set_lines(0, -1, true, lines)
+      local new = {}
+      for i = 1, 5000 do
+        -- Some lines are longer than a memline block.
+        new[i] = i % 1000 == 0 and ('x'):rep(5000) or ('new %d'):format(i)
+      end
+      set_lines(1000, 1000, true, new)
+      for i = #new, 1, -1 do
+        table.insert(lines, 1001, new[i])
+      end
+      eq(lines, get_lines(0, -1, true))
+      local offset = 0
+      for i = 1, #lines do
+        if i % 251 == 1 then
+          eq(offset, curbufmeths.get_offset(i - 1))
+        end
+        offset = offset + #lines[i] + 1
+      end
+      eq(offset, curbufmeths.get_offset(#lines))
+
+      -- A linewise put appends the same way.
+      local count = #lines
+      command('1000,5999yank | $put')
+      for i = 1000, 5999 do
+        table.insert(lines, lines[i])
+      end
+      eq(lines, get_lines(0, -1, true))
+      for i = count + 1, #lines do
+        offset = offset + #lines[i] + 1
+      end
+      eq(offset, curbufmeths.get_offset(#lines))
+    end)
+
     it('can get line ranges with non-strict indexing', function()
       set_lines(0, -1, true, {'a', 'b', 'c'})
       eq({'a', 'b', 'c'}, get_lines(0, -1, true)) --sanity
@@ -390,6 +428,17 @@ describe('api/buf', function()
       feed('<c-w>p')
       eq(3, funcs.winnr())
     end)
+
+    it('returns results larger than a message chunk', function()
+      local lines = {}
+      for i = 1, 20000 do
+        lines[i] = ('line %d with some more text'):format(i)
+      end
+      set_lines(0, -1, true, lines)
+      eq(lines, get_lines(0, -1, true))
+      -- the channel still works afterwards
+      eq({'line 20000 with some more text'}, get_lines(-2, -1, true))
+    end)
   end)
 
   describe('nvim_buf_get_offset', function()
@@ -427,6 +476,118 @@ describe('api/buf', function()
       command("bunload! 1")
       eq(-1, bufmeths.get_offset(1,1))
     end)
+
+    it('works after edits in a buffer with many chunks', function()
+      local lines = {}
+      for i = 1, 5000 do
+        lines[i] = ('x'):rep(i % 7)
+      end
+      curbufmeths.set_lines(0, -1, true, lines)
+      -- Delete and change lines all over the buffer.
+      for i = 4900, 100, -450 do
+        curbufmeths.set_lines(i, i + 30, true, {'changed'})
+        table.remove(lines, i + 1)
+        for _ = 1, 29 do
+          table.remove(lines, i + 1)
+        end
+        table.insert(lines, i + 1, 'changed')
+      end
+      local offset = 0
+      for i = 1, #lines do
+        if i % 97 == 1 then
+          eq(offset, get_offset(i - 1))
+          eq(i, funcs.byte2line(offset + 1))
+        end
+        offset = offset + #lines[i] + 1
+      end
+      eq(offset, get_offset(#lines))
+    end)
+  end)
+
+  describe('nvim__buf_stats', function()
+    it('counts leaf cache hits for scattered reads', function()
+      local lines = {}
+      for i = 1, 3000 do
+        lines[i] = ('line %d'):format(i)
+      end
+      curbufmeths.set_lines(0, -1, true, lines)
+      local before = request('nvim__buf_stats', 0)
+      for _ = 1, 10 do
+        eq({'line 1', 'line 2'}, curbufmeths.get_lines(0, 2, true))
+        eq({'line 1500'}, curbufmeths.get_lines(1499, 1500, true))
+        eq({'line 3000'}, curbufmeths.get_lines(2999, 3000, true))
+      end
+      local after = request('nvim__buf_stats', 0)
+      ok(after.leaf_cache_hits - before.leaf_cache_hits >= 27)
+      ok(after.leaf_cache_misses - before.leaf_cache_misses < 10)
+
+      -- Changing the text forgets the cached blocks.
+      curbufmeths.set_lines(0, 1, true, {})
+      eq({'line 1501'}, curbufmeths.get_lines(1499, 1500, true))
+      eq({'line 3000'}, curbufmeths.get_lines(2998, 2999, true))
+    end)
+  end)
+
+  describe('nvim__buf_snapshot', function()
+    it('writes the text and a line offset table', function()
+      curbufmeths.set_lines(0, -1, true, {'first', '', 'a\0b', 'last'})
+      local snap = request('nvim__buf_snapshot', 0)
+      eq(curbufmeths.get_changedtick(), snap.changedtick)
+      eq(4, snap.line_count)
+      eq(16, snap.table)
+
+      local data = helpers.read_file(snap.path)
+      eq('first\n\na\0b\nlast\n', data:sub(1, 16))
+      local offsets = {}
+      for i = 0, snap.line_count do
+        local value = 0
+        for j = 8, 1, -1 do  -- little-endian
+          value = value * 256 + data:byte(snap.table + i * 8 + j)
+        end
+        offsets[i + 1] = value
+      end
+      eq({0, 6, 7, 11, 16}, offsets)
+      eq(snap.table + 5 * 8, #data)
+      os.remove(snap.path)
+
+      eq('Invalid buffer id: 42', pcall_err(request, 'nvim__buf_snapshot', 42))
+    end)
+
+    it('is taken again after each change', function()
+      local function snapshot_lines()
+        local snap = request('nvim__buf_snapshot', 0)
+        eq(curbufmeths.get_changedtick(), snap.changedtick)
+        local data = helpers.read_file(snap.path)
+        os.remove(snap.path)
+        local lines = {}
+        for line in data:sub(1, snap.table):gmatch('([^\n]*)\n') do
+          table.insert(lines, line)
+        end
+        eq(snap.line_count, #lines)
+        return lines
+      end
+
+      curbufmeths.set_lines(0, -1, true, {'a', 'b', 'c'})
+      eq({'a', 'b', 'c'}, snapshot_lines())
+      eq({'a', 'b', 'c'}, snapshot_lines())
+      -- ml_delete()
+      command('2delete')
+      eq({'a', 'c'}, snapshot_lines())
+      -- ml_append()
+      funcs.append(1, 'x')
+      eq({'a', 'x', 'c'}, snapshot_lines())
+      -- ml_replace()
+      funcs.setline(1, 'A')
+      eq({'A', 'x', 'c'}, snapshot_lines())
+      -- ml_get_buf() with "will_change", the line is changed in place
+      command('normal! 3G0~')
+      eq({'A', 'x', 'C'}, snapshot_lines())
+      -- ml_append_lines()
+      funcs.setreg('a', {'y', 'z'}, 'l')
+      command('normal! 1G"ap')
+      eq({'A', 'y', 'z', 'x', 'C'}, snapshot_lines())
+      eq(curbufmeths.get_lines(0, -1, true), snapshot_lines())
+    end)
   end)
 
   describe('nvim_buf_get_var, nvim_buf_set_var, nvim_buf_del_var', function()
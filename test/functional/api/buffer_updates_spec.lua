@@ -757,6 +757,105 @@ describe('API: buffer events:', function()
     expectn('nvim_buf_changedtick_event', {b, tick})
   end)
 
+  it('coalesces the changes of a command', function()
+    clear()
+    local b = editoriginal(false)
+    ok(buffer('attach', b, false, {coalesce=true}))
+    expectn('nvim_buf_changedtick_event', {b, eval('b:changedtick')})
+
+    command('normal! ggddjdd')
+    expectn('nvim_buf_lines_event', {b, eval('b:changedtick'), 0, 3,
+                                     {'original line 2'}, false})
+
+    command('%s/line [46]$/changed/')
+    expectn('nvim_buf_lines_event', {b, eval('b:changedtick'), 1, 4,
+                                     {'original changed',
+                                      'original line 5',
+                                      'original changed'}, false})
+
+    eq("coalesce must be boolean",
+       pcall_err(buffer, 'attach', b, false, {coalesce=1}))
+  end)
+
+  it('sends byte splices to channels attached with bytes', function()
+    clear()
+    local b = editoriginal(false)
+    ok(buffer('attach', b, false, {bytes=true}))
+    expectn('nvim_buf_changedtick_event', {b, eval('b:changedtick')})
+
+    local function expectbytes(args)
+      local msg = next_msg()
+      eq({'notification', 'nvim_buf_bytes_event'}, {msg[1], msg[2]})
+      eq(b, msg[3][1])
+      eq(args, {unpack(msg[3], 3)})
+    end
+
+    command('normal! 3G$ix')
+    expectbytes({2, 14, 0, 0, 0, 1, {'x'}})
+
+    command('2delete')
+    expectbytes({1, 0, 1, 0, 0, 0, {''}})
+
+    eq("coalesce and bytes cannot be used together",
+       pcall_err(buffer, 'attach', b, false, {bytes=true, coalesce=true}))
+  end)
+
+  it('sends the new text of :s, :join and :move to bytes channels', function()
+    clear()
+    local b = editoriginal(false, {'one two', 'a', 'b', 'three', 'four'})
+    ok(buffer('attach', b, false, {bytes=true}))
+    expectn('nvim_buf_changedtick_event', {b, eval('b:changedtick')})
+
+    local function expectbytes(args)
+      local msg = next_msg()
+      eq({'notification', 'nvim_buf_bytes_event'}, {msg[1], msg[2]})
+      eq(b, msg[3][1])
+      eq(args, {unpack(msg[3], 3)})
+    end
+
+    command('1s/o/<&>/g')
+    expectbytes({0, 0, 0, 1, 0, 3, {'<o>'}})
+    expectbytes({0, 8, 0, 1, 0, 3, {'<o>'}})
+
+    command('2join')
+    expectbytes({1, 1, 1, 0, 0, 1, {' '}})
+
+    command('3move 4')
+    expectbytes({2, 0, 1, 0, 0, 0, {''}})
+    expectbytes({3, 0, 0, 0, 1, 0, {'three', ''}})
+    eq({'<o>ne tw<o>', 'a b', 'four', 'three'},
+       buffer('get_lines', b, 0, -1, true))
+  end)
+
+  it('sends changes without a splice to bytes channels as lines', function()
+    clear()
+    local b = editoriginal(false)
+    ok(buffer('attach', b, false, {bytes=true}))
+    expectn('nvim_buf_changedtick_event', {b, eval('b:changedtick')})
+
+    local function expectbytes(args)
+      local msg = next_msg()
+      eq({'notification', 'nvim_buf_bytes_event'}, {msg[1], msg[2]})
+      eq(b, msg[3][1])
+      eq(args, {unpack(msg[3], 3)})
+    end
+
+    command('call setline(2, "changed")')
+    expectbytes({1, 0, 1, 0, 1, 0, {'changed', ''}})
+
+    command('undo')
+    expectbytes({1, 0, 1, 0, 1, 0, {'original line 2', ''}})
+    expectn('nvim_buf_changedtick_event', {b, eval('b:changedtick')})
+
+    -- the appended line is spliced
+    command('call setline(6, ["last", "appended"])')
+    expectbytes({5, 0, 1, 0, 1, 0, {'last', ''}})
+    expectbytes({6, 0, 0, 0, 1, 0, {'appended', ''}})
+    eq({'original line 1', 'original line 2', 'original line 3',
+        'original line 4', 'original line 5', 'last', 'appended'},
+       buffer('get_lines', b, 0, -1, true))
+  end)
+
   it('returns a proper error on nonempty options dict', function()
     clear()
     local b = editoriginal(false)
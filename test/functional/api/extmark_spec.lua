@@ -1010,6 +1010,35 @@ describe('API/extmarks', function()
     check_undo_redo(ns, marks[3], 0, 4, 0, 8)
   end)
 
+  it('substitutes many matches over many lines', function()
+    -- the splices of do_sub are applied together
+    curbufmeths.set_lines(0, -1, true, {'1.2.3', '4.5.6', '7.8.9'})
+    local before = {{0, 1}, {0, 4}, {1, 0}, {1, 3}, {2, 2}, {2, 5}}
+    local ids = batch_set(ns, before)
+    command('%s/\\./--/g')
+    expect('1--2--3\n4--5--6\n7--8--9')
+    batch_check_undo_redo(ns, ids, before,
+                          {{0, 3}, {0, 6}, {1, 0}, {1, 6}, {2, 3}, {2, 7}})
+  end)
+
+  it('joins many lines', function()
+    curbufmeths.set_lines(0, -1, true, {'a', 'b', 'c', 'd'})
+    local before = {{0, 0}, {1, 0}, {2, 0}, {3, 0}, {3, 1}}
+    local ids = batch_set(ns, before)
+    command('%join')
+    expect('a b c d')
+    batch_check_undo_redo(ns, ids, before,
+                          {{0, 0}, {0, 2}, {0, 4}, {0, 6}, {0, 7}})
+  end)
+
+  it('moves marks when a macro changes many lines', function()
+    curbufmeths.set_lines(0, -1, true, {'a1', 'b2', 'c3', 'd4'})
+    local ids = batch_set(ns, {{0, 1}, {1, 1}, {2, 1}, {3, 1}, {3, 2}})
+    feed('ggqqxjq3@q')
+    expect('1\n2\n3\n4')
+    batch_check(ns, ids, {{0, 0}, {1, 0}, {2, 0}, {3, 0}, {3, 1}})
+  end)
+
   it('substitions over multiple lines with newline in pattern', function()
     feed('A<cr>67890<cr>xx<esc>')
     set_extmark(ns, marks[1], 0, 3)
@@ -1469,6 +1498,52 @@ describe('Extmarks buffer api with many marks', function()
     eq(ns_marks[ns2], get_marks(ns2))
   end)
 
+  it("can set marks in a batch", function()
+    local positions, expected = {}, {}
+    for i = 29,0,-1 do
+      for j = 0,i,2 do
+        table.insert(positions, i)
+        table.insert(positions, j)
+        table.insert(positions, -1)
+        table.insert(positions, -1)
+        table.insert(expected, {i,j})
+      end
+    end
+    table.insert(positions, 3)
+    table.insert(positions, 1)
+    table.insert(positions, 4)
+    table.insert(positions, -1)
+    table.insert(expected, {3,1})
+    local ids = curbufmeths.set_extmarks(ns1, positions, {clear=true})
+    eq(#expected, #ids)
+    ns_marks[ns1] = {}
+    for i, id in ipairs(ids) do
+      ns_marks[ns1][id] = expected[i]
+    end
+    eq(ns_marks[ns1], get_marks(ns1))
+    eq(ns_marks[ns2], get_marks(ns2))
+
+    feed('10Gdd')
+    for _, marks in pairs(ns_marks) do
+      for id, mark in pairs(marks) do
+        if mark[1] == 9 then
+          marks[id] = {9,0}
+        elseif mark[1] >= 10 then
+          mark[1] = mark[1] - 1
+        end
+      end
+    end
+    eq(ns_marks[ns1], get_marks(ns1))
+    eq(ns_marks[ns2], get_marks(ns2))
+
+    eq("positions must have four items per mark",
+       pcall_err(curbufmeths.set_extmarks, ns1, {0, 0, -1}, {}))
+    eq("line value outside range",
+       pcall_err(curbufmeths.set_extmarks, ns1, {0, 0, -1, -1, 40, 0, -1, -1}, {}))
+    eq("end is before start",
+       pcall_err(curbufmeths.set_extmarks, ns1, {2, 1, 2, 0}, {}))
+  end)
+
   it("can wipe buffer", function()
     command('bwipe!')
     eq({}, get_marks(ns1))
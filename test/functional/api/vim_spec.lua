@@ -50,6 +50,17 @@ describe('API', function()
       pcall_err(request, nil))
   end)
 
+  it('accepts method ids from api_info', function()
+    local id
+    for _, f in ipairs(meths.get_api_info()[2].functions) do
+      if f.name == 'nvim_eval' then
+        id = f.id
+      end
+    end
+    eq(2, request(id, '1+1'))
+    matches('Invalid method id: 100000$', pcall_err(request, 100000))
+  end)
+
   it('handles errors in async requests', function()
     local error_types = meths.get_api_info()[2].error_types
     nvim_async('bogus')
@@ -1438,6 +1449,55 @@ describe('API', function()
     end)
   end)
 
+  describe('nvim__call_batch', function()
+    it('passes results to later calls', function()
+      meths.buf_set_lines(0, 0, -1, true, {'first'})
+      local req = {
+        {'nvim_get_current_line', {}},
+        {'nvim_set_var', {'avar', NIL}, {{1, 0}}},
+        {'nvim_get_var', {'avar'}},
+      }
+      eq({{'first', NIL, 'first'}, NIL}, request('nvim__call_batch', req))
+    end)
+
+    it('accepts method ids', function()
+      local id
+      for _, f in ipairs(meths.get_api_info()[2].functions) do
+        if f.name == 'nvim_get_current_line' then
+          id = f.id
+        end
+      end
+      meths.buf_set_lines(0, 0, -1, true, {'first'})
+      eq({{'first'}, NIL}, request('nvim__call_batch', {{id, {}}}))
+    end)
+
+    it('makes no call if a call is malformed', function()
+      local req = {
+        {'nvim_set_var', {'avar', 1}},
+        {'nvim_set_var', {'avar', 2}, {{0, 1}}},
+      }
+      eq('Invalid ref in call 1', pcall_err(request, 'nvim__call_batch', req))
+      req = {
+        {'nvim_set_var', {'avar', 1}},
+        {'i_am_not_a_method', {'xx'}},
+      }
+      eq('Invalid method: i_am_not_a_method',
+         pcall_err(request, 'nvim__call_batch', req))
+      eq(false, pcall(meths.get_var, 'avar'))
+    end)
+
+    it('returns the results of calls before an error', function()
+      local error_types = meths.get_api_info()[2].error_types
+      local req = {
+        {'nvim_set_var', {'avar', 5}},
+        {'nvim_get_var', {'avar'}},
+        {'nvim_buf_get_lines', {0, 10, 20, true}},
+      }
+      eq({{NIL, 5}, {2, error_types.Validation.id, 'Index out of bounds'}},
+         request('nvim__call_batch', req))
+    end)
+  end)
+
   describe('nvim_list_runtime_paths', function()
     it('returns nothing with empty &runtimepath', function()
       meths.set_option('runtimepath', '')
@@ -12,6 +12,7 @@ local rmdir = helpers.rmdir
 local mkdir = helpers.mkdir
 local sleep = helpers.sleep
 local read_file = helpers.read_file
+local write_file = helpers.write_file
 local trim = helpers.trim
 local currentdir = helpers.funcs.getcwd
 local iswin = helpers.iswin
@@ -26,6 +27,7 @@ describe('fileio', function()
     os.remove('Xtest_startup_file1~')
     os.remove('Xtest_startup_file2')
     os.remove('Xtest_тест.md')
+    os.remove('Xtest_mmap')
     rmdir('Xtest_startup_swapdir')
     rmdir('Xtest_backupdir')
   end)
@@ -128,5 +130,54 @@ describe('fileio', function()
     table.insert(text, '')
     eq(text, funcs.readfile(fname, 'b'))
   end)
+
+  it("reads a file with 'mmapsize' like without it", function()
+    clear()
+    -- More than one READ_MAP_WINDOW, with a line across the window border.
+    local lines = {}
+    for i = 1, 40000 do
+      lines[i] = ('%d: %s'):format(i, ('x'):rep(i % 61))
+    end
+    local text = table.concat(lines, '\n')
+    local function check(contents, ff, bomb)
+      write_file('Xtest_mmap', contents, true)
+      command('set mmapsize=0')
+      command('edit! Xtest_mmap')
+      local expected = funcs.getline(1, '$')
+      command('set mmapsize=1')
+      command('edit! Xtest_mmap')
+      eq(expected, funcs.getline(1, '$'))
+      eq(40000, #expected)
+      eq(ff, funcs.eval('&fileformat'))
+      eq(bomb, funcs.eval('&bomb') == 1)
+      command('bwipe!')
+    end
+    command('set fileformats=unix,dos')
+    check(text..'\n', 'unix', false)
+    check(text, 'unix', false)
+    check('\239\187\191'..text..'\n', 'unix', true)
+    check(text:gsub('\n', '\r\n')..'\r\n', 'dos', false)
+  end)
+
+  it('falls back to latin1 for a non-UTF-8 byte after many lines', function()
+    clear()
+    local lines = {}
+    for i = 1, 20000 do
+      lines[i] = ('line %d'):format(i)
+    end
+    lines[19999] = 'caf\233'
+    write_file('Xtest_mmap', table.concat(lines, '\n')..'\n', true)
+    command('set fileencodings=ucs-bom,utf-8,latin1')
+    for _, mms in ipairs({0, 1}) do
+      command('set mmapsize='..mms)
+      command('edit! Xtest_mmap')
+      eq('latin1', funcs.eval('&fileencoding'))
+      eq(20000, funcs.line('$'))
+      eq('line 1', funcs.getline(1))
+      eq('café', funcs.getline(19999))
+      eq('line 20000', funcs.getline(20000))
+      command('bwipe!')
+    end
+  end)
 end)
 
@@ -14,6 +14,7 @@ local spawn = helpers.spawn
 local nvim_async = helpers.nvim_async
 local expect_msg_seq = helpers.expect_msg_seq
 local pcall_err = helpers.pcall_err
+local retry = helpers.retry
 
 describe(':recover', function()
   before_each(clear)
@@ -85,6 +86,40 @@ describe(':preserve', function()
     ok(nil == string.find(swappath2, '%.%.%.'))
   end)
 
+  it('records the owner in a swap file created after the buffer', function()
+    local testfile = 'Xtest_recover_file3'
+    source([[
+      set directory^=]]..swapdir:gsub([[\]], [[\\]])..[[//
+      set swapfile fileformat=unix undolevels=-1
+    ]])
+    command('edit! '..testfile)
+    feed('isometext<esc>')
+    command('preserve')
+    local info = eval('swapinfo(swapname("%"))')
+    eq(eval('getpid()'), info.pid)
+    ok(info.user ~= '')
+    eq(testfile, string.match(info.fname, '[^/\\]+$'))
+  end)
+
+  it("writes changes to the swap file after 'updatetime'", function()
+    local testfile = 'Xtest_recover_file2'
+    source([[
+      set directory^=]]..swapdir:gsub([[\]], [[\\]])..[[//
+      set swapfile fileformat=unix undolevels=-1 updatetime=20
+    ]])
+    command('edit! '..testfile)
+    feed('isometext<esc>')
+    local swappath = eval('swapname("%")')
+    -- The blocks are written by a worker thread while waiting for input.
+    retry(nil, 5000, function()
+      local f = io.open(swappath, 'rb')
+      local data = f:read('*a')
+      f:close()
+      ok(nil ~= string.find(data, 'sometext', 1, true))
+    end)
+    eq('sometext', eval('getline(1)'))
+  end)
+
 end)
 
 describe('swapfile detection', function()
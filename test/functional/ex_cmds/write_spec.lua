@@ -91,6 +91,14 @@ describe(':write', function()
     fifo:close()
   end)
 
+  it('writes long lines, NULs and a missing EOL', function()
+    local long = ('x'):rep(100000)
+    funcs.setline(1, {'short', long, 'a\nb', 'last'})
+    command('set nofixendofline noendofline')
+    command('write ' .. fname)
+    eq('short\n' .. long .. '\na\0b\nlast', helpers.read_file(fname))
+  end)
+
   it('errors out correctly', function()
     command('let $HOME=""')
     eq(funcs.fnamemodify('.', ':p:h'), funcs.fnamemodify('.', ':p:h:~'))
@@ -59,3 +59,93 @@ describe('u CTRL-R g- g+', function()
     undo_and_redo(4, 'g-', 'g+', '1')
   end)
 end)
+
+describe('undo of long lines', function()
+  local eq = helpers.eq
+  local funcs = helpers.funcs
+
+  before_each(clear)
+
+  local function lines(n)
+    local l = {}
+    for i = 1, n do
+      l[i] = string.rep(tostring(i % 10), 200)
+    end
+    return l
+  end
+
+  it('restores lines changed in place', function()
+    funcs.setline(1, lines(5))
+    command('set undolevels=100')
+    local states = {funcs.getline(1, '$')}
+    local function change(cmd, join)
+      command(cmd)
+      -- Setting 'undolevels' closes the undo block.
+      command('set undolevels=100')
+      if join then
+        table.remove(states)
+      end
+      table.insert(states, funcs.getline(1, '$'))
+    end
+    change('normal! gg3|rA')
+    change('2s/2/B/')
+    change('undojoin | 3s/3$/C/', true)
+    change('%s/\\d$/D/')
+    change('normal! 4G50|x')
+    change('normal! 4G50|x')
+    for i = #states - 1, 1, -1 do
+      command('undo')
+      eq(states[i], funcs.getline(1, '$'))
+    end
+    for i = 2, #states do
+      command('redo')
+      eq(states[i], funcs.getline(1, '$'))
+    end
+  end)
+
+  it('writes the lines changed in place to an undo file', function()
+    local undofile = 'Xundofile_long_lines'
+    funcs.setline(1, lines(3))
+    command('set undolevels=100')
+    local states = {funcs.getline(1, '$')}
+    for _, cmd in ipairs({'normal! gg3|rA', '2s/2/B/', 'normal! 2G50|x',
+                          'normal! 3G9|x'}) do
+      command(cmd)
+      command('set undolevels=100')
+      table.insert(states, funcs.getline(1, '$'))
+    end
+    -- an undone change and a branch
+    command('undo')
+    command('normal! 3G20|rZ')
+    table.insert(states, funcs.getline(1, '$'))
+    command('undo')
+
+    command('wundo ' .. undofile)
+    local text = funcs.getline(1, '$')
+    command('enew!')
+    funcs.setline(1, text)
+    command('rundo ' .. undofile)
+    os.remove(undofile)
+
+    command('redo')
+    eq(states[6], funcs.getline(1, '$'))
+    command('undo 4')
+    eq(states[5], funcs.getline(1, '$'))
+    for i = 4, 1, -1 do
+      command('undo')
+      eq(states[i], funcs.getline(1, '$'))
+    end
+  end)
+
+  it('forgets the oldest changes with maxmemundo', function()
+    funcs.setline(1, lines(1))
+    command('set undolevels=100 maxmemundo=4')
+    for i = 1, 10 do
+      command('s/.*/' .. string.rep(string.char(64 + i), 1000) .. '/')
+      command('set undolevels=100')
+    end
+    command('undo 0')
+    eq(true, funcs.getline(1) ~= lines(1)[1])
+    eq(10, funcs.undotree().seq_last)
+  end)
+end)
@@ -0,0 +1,94 @@
+local helpers = require('test.functional.helpers')(after_each)
+local lfs = require('lfs')
+local clear = helpers.clear
+local command = helpers.command
+local eq = helpers.eq
+local funcs = helpers.funcs
+local read_file = helpers.read_file
+
+describe("'undofile'", function()
+  local undodir = 'Xtest_undofile_dir'
+  local testfile = 'Xtest_undofile'
+
+  before_each(function()
+    lfs.mkdir(undodir)
+    clear()
+    command('set undofile undodir=' .. undodir)
+    command('edit ' .. testfile)
+  end)
+
+  after_each(function()
+    clear()
+    os.remove(testfile)
+    helpers.rmdir(undodir)
+  end)
+
+  local function change(text)
+    command('normal! o' .. text)
+    -- Setting 'undolevels' closes the undo block.
+    command('let &undolevels = &undolevels')
+    command('write')
+  end
+
+  it('appends changes and reads them back', function()
+    change('one')
+    local undofile = funcs.undofile(testfile)
+    local written = read_file(undofile)
+    change('two')
+    command('undo')
+    command('write')
+    change('three')
+    eq(written, read_file(undofile):sub(1, #written))
+
+    command('bwipe!')
+    command('edit ' .. testfile)
+    eq({'', 'one', 'three'}, funcs.getline(1, '$'))
+    eq(3, funcs.undotree().seq_last)
+    command('undo')
+    eq({'', 'one'}, funcs.getline(1, '$'))
+    command('undo 2')
+    eq({'', 'one', 'two'}, funcs.getline(1, '$'))
+    command('undo 0')
+    eq({''}, funcs.getline(1, '$'))
+  end)
+
+  it('forgets headers freed after they were written', function()
+    command('set undolevels=2')
+    change('one')
+    change('two')
+    change('three')
+    change('four')
+    local entries = #funcs.undotree().entries
+
+    command('bwipe!')
+    command('edit ' .. testfile)
+    eq(4, funcs.undotree().seq_last)
+    eq(entries, #funcs.undotree().entries)
+    command('undo 0')
+    eq(true, #funcs.getline(1, '$') > 1)
+    command('undo 4')
+    eq({'', 'one', 'two', 'three', 'four'}, funcs.getline(1, '$'))
+  end)
+
+  it('hashes the text again after changes in a large buffer', function()
+    local lines = {}
+    for i = 1, 5000 do
+      lines[i] = 'line ' .. i
+    end
+    funcs.setline(1, lines)
+    command('let &undolevels = &undolevels')
+    command('write')
+    command('2500delete')
+    command('let &undolevels = &undolevels')
+    command('write')
+    funcs.setline(4000, 'changed')
+    command('let &undolevels = &undolevels')
+    command('write')
+
+    command('bwipe!')
+    command('edit ' .. testfile)
+    eq(3, funcs.undotree().seq_last)
+    command('undo 0')
+    eq({''}, funcs.getline(1, '$'))
+  end)
+end)
@@ -552,6 +552,32 @@ describe('Buffer highlighting', function()
     ]])
   end)
 
+  it('works with ranges starting far above the window', function()
+    local lines, marks = {}, {}
+    for i = 1,200 do
+      lines[i] = 'line '..i
+      for _, v in ipairs({i-1, 0, -1, -1, i-1, 2, -1, -1}) do
+        table.insert(marks, v)
+      end
+    end
+    curbufmeths.set_lines(0, -1, true, lines)
+    curbufmeths.set_extmarks(meths.create_namespace('marks'), marks, {})
+    curbufmeths.set_extmarks(meths.create_namespace('range'),
+                             {9, 2, 129, 4}, {hl_group='String'})
+    command('125')
+    feed('zt')
+    screen:expect([[
+      {2:^line 125}                                |
+      {2:line 126}                                |
+      {2:line 127}                                |
+      {2:line 128}                                |
+      {2:line 129}                                |
+      {2:line} 130                                |
+      line 131                                |
+                                              |
+    ]])
+  end)
+
   it('works with new syntax groups', function()
     insert([[
       fancy code in a new fancy language]])
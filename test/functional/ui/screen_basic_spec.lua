@@ -962,6 +962,122 @@ describe("Screen (line-based)", function()
   screen_tests(true)
 end)
 
+describe('Screen (line-based) updates', function()
+  local screen
+  local rows
+
+  before_each(function()
+    clear()
+    screen = Screen.new(20, 4)
+    screen:attach({rgb=true, ext_linegrid=true})
+    screen:set_default_attr_ids({
+      [0] = {bold=true, foreground=Screen.colors.Blue},
+      [1] = {bold=true, foreground=Screen.colors.Red},
+    })
+  end)
+
+  -- Collect the rows of the grid_line events from now on.
+  local function record_rows()
+    rows = {}
+    local handle_grid_line = screen._handle_grid_line
+    function screen:_handle_grid_line(grid, row, col, items)
+      if rows[#rows] ~= row then
+        table.insert(rows, row)
+      end
+      handle_grid_line(self, grid, row, col, items)
+    end
+  end
+
+  it('only carry the cells the UI does not show yet', function()
+    insert('hello\nworld')
+    screen:expect([[
+      hello               |
+      worl^d               |
+      {0:~                   }|
+                          |
+    ]])
+
+    record_rows()
+    command('redraw!')
+    feed('rX')
+    screen:expect([[
+      hello               |
+      worl^X               |
+      {0:~                   }|
+                          |
+    ]])
+    eq({1}, rows)
+  end)
+
+  it('carry the cells of a changed highlight', function()
+    insert('hello\nworld')
+    screen:expect([[
+      hello               |
+      worl^d               |
+      {0:~                   }|
+                          |
+    ]])
+
+    record_rows()
+    command('hi NonText guifg=Red')
+    screen:expect([[
+      hello               |
+      worl^d               |
+      {1:~                   }|
+                          |
+    ]])
+    eq({2}, rows)
+  end)
+
+  it('carry all cells after the default colors changed', function()
+    insert('hello\nworld')
+    screen:expect([[
+      hello               |
+      worl^d               |
+      {0:~                   }|
+                          |
+    ]])
+
+    record_rows()
+    command('hi Normal guifg=Yellow guibg=Black')
+    screen:expect{grid=[[
+      hello               |
+      worl^d               |
+      {0:~                   }|
+                          |
+    ]], condition=function()
+      eq(Screen.colors.Black, screen.default_colors.rgb_bg)
+    end}
+    local sent = {}
+    for _, row in ipairs(rows) do
+      sent[row] = true
+    end
+    eq({true, true, true}, {sent[0], sent[1], sent[2]})
+  end)
+
+  it('carry the cells scrolled in by grid_scroll', function()
+    -- the row scrolled in has the text it had before the scroll
+    insert('a\nb\nc\nc\nd')
+    feed('gg')
+    screen:expect([[
+      ^a                   |
+      b                   |
+      c                   |
+                          |
+    ]])
+
+    record_rows()
+    feed('<c-e>')
+    screen:expect([[
+      ^b                   |
+      c                   |
+      c                   |
+                          |
+    ]])
+    eq({2}, rows)
+  end)
+end)
+
 describe('Screen default colors', function()
   local screen
   local function startup(light, termcolors)
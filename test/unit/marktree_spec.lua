@@ -97,7 +97,7 @@ describe('marktree', function()
     for i = 1,100 do
       for j = 1,100 do
         local gravitate = (i%2) > 0
-        local id = tonumber(lib.marktree_put(tree, j, i, gravitate))
+        local id = tonumber(lib.marktree_put(tree, j, i, gravitate, 0))
         ok(id > 0)
         eq(nil, shadow[id])
         shadow[id] = {j,i,gravitate}
@@ -187,4 +187,343 @@ describe('marktree', function()
       shadoworder(tree, shadow, iter2)
     end
  end)
+
+ itp('finds marks of one group', function()
+    local tree = ffi.new("MarkTree[1]") -- zero initialized by luajit
+    local iter = ffi.new("MarkTreeIter[1]")
+    local groups = {}
+
+    for i = 1,100 do
+      for j = 1,50 do
+        local group = (i*j) % 7
+        local id = tonumber(lib.marktree_put(tree, i, j, false, group))
+        groups[id] = group
+      end
+    end
+    lib.marktree_check(tree)
+
+    local function find(group, start, last, rev)
+      local mask = lib.marktree_group_mask(group)
+      local found = {}
+      local pos = ffi.new("mtpos_t", start)
+      if not lib.marktree_itr_get_filter(tree, pos, iter, rev, mask) then
+        return found
+      end
+      repeat
+        local mark = lib.marktree_itr_current(iter)
+        local mpos = {mark.row, mark.col}
+        local inside
+        if rev then
+          inside = pos_leq(last, mpos)
+        else
+          inside = pos_leq(mpos, last)
+        end
+        if not inside then
+          break
+        end
+        local id = tonumber(mark.id)
+        if groups[id] == group then
+          table.insert(found, mpos)
+        end
+        local status
+        if rev then
+          status = lib.marktree_itr_prev_filter(tree, iter, mask)
+        else
+          status = lib.marktree_itr_next_filter(tree, iter, mask)
+        end
+      until not status
+      return found
+    end
+
+    for group = 0,6 do
+      local expected = {}
+      for i = 10,20 do
+        for j = 1,50 do
+          if (i*j) % 7 == group and pos_leq({10, 5}, {i, j})
+             and pos_leq({i, j}, {20, 5}) then
+            table.insert(expected, {i, j})
+          end
+        end
+      end
+      eq(expected, find(group, {10, 5}, {20, 5}, false))
+      local reversed = {}
+      for k = #expected,1,-1 do
+        table.insert(reversed, expected[k])
+      end
+      eq(reversed, find(group, {20, 5}, {10, 5}, true))
+    end
+ end)
+
+ itp('puts marks in batches', function()
+    local tree = ffi.new("MarkTree[1]") -- zero initialized by luajit
+    local iter = ffi.new("MarkTreeIter[1]")
+    local shadow = {}
+
+    local function put_batch(n, f)
+      local items = ffi.new("mtbatch_t[?]", n)
+      for k = 0,n-1 do
+        local row, col = f(k)
+        items[k].start_row, items[k].start_col = row, col
+        items[k].end_row = -1
+        items[k].start_right = (k % 3 == 0)
+      end
+      lib.marktree_put_batch(tree, items, n, 0)
+      for k = 0,n-1 do
+        local id = tonumber(items[k].id)
+        eq(nil, shadow[id])
+        shadow[id] = {items[k].start_row, items[k].start_col,
+                      items[k].start_right}
+      end
+      lib.marktree_check(tree)
+      shadoworder(tree, shadow, iter)
+    end
+
+    -- built bottom-up into an empty tree, then merged with the tree
+    put_batch(5000, function(k) return (k*7) % 300, k % 11 end)
+    put_batch(6000, function(k) return (k*13) % 300, k % 5 end)
+    -- fewer new marks than old ones are inserted one by one
+    put_batch(100, function(k) return k, 1 end)
+    for _ = 1,20 do
+      put_batch(1, function() return 0, 0 end)
+    end
+
+    -- the emptied tree keeps its root node
+    for id, _ in pairs(shadow) do
+      lib.marktree_lookup(tree, id, iter)
+      lib.marktree_del_itr(tree, iter, false)
+      shadow[id] = nil
+    end
+    lib.marktree_check(tree)
+    put_batch(10, function(k) return k, 0 end)
+ end)
+
+ itp('finds pairs overlapping a position', function()
+    local tree = ffi.new("MarkTree[1]") -- zero initialized by luajit
+    local pairs_ = {}
+
+    for i = 1,300 do
+      local start = {i, i % 7}
+      local stop = {i + (i*13) % 40, (i*5) % 11}
+      local id = tonumber(lib.marktree_put_pair(tree, start[1], start[2], true,
+                                                stop[1], stop[2], false, 0))
+      pairs_[id] = {start, stop}
+      -- single marks in between
+      lib.marktree_put(tree, i, 3, false, 0)
+    end
+    lib.marktree_check(tree)
+
+    local function overlap(pos)
+      local found = {}
+      local result = ffi.new("mtpairs_t[1]")
+      lib.marktree_get_overlap(tree, pos[1], pos[2], result)
+      for k = 0,tonumber(result[0].size)-1 do
+        local pair = result[0].items[k]
+        local id = tonumber(pair.id)
+        eq(pairs_[id], {{pair.start.row, pair.start.col},
+                        {pair["end"].row, pair["end"].col}})
+        found[id] = true
+      end
+      lib.xfree(result[0].items)
+      return found
+    end
+
+    for _, pos in ipairs({{1, 0}, {50, 3}, {150, 0}, {320, 0}}) do
+      local expected = {}
+      for id, pair in pairs(pairs_) do
+        if not pos_leq(pos, pair[1]) and pos_leq(pos, pair[2]) then
+          expected[id] = true
+        end
+      end
+      eq(expected, overlap(pos))
+    end
+ end)
+
+ itp('keeps pair end bounds through random changes', function()
+    local tree = ffi.new("MarkTree[1]") -- zero initialized by luajit
+    local iter = ffi.new("MarkTreeIter[1]")
+    local shadow = {}
+    local marks = {} -- ids to delete, the start id of pairs
+    math.randomseed(42)
+
+    local function randpos()
+      return {math.random(0, 40), math.random(0, 12)}
+    end
+
+    -- the start key of a pair has PAIRED_FLAG set, its end key has the next
+    -- id with END_FLAG set
+    local function is_pair(id)
+      return id % 4 == 2
+    end
+
+    local function put_pair(start, stop, start_right, end_right)
+      local id = tonumber(lib.marktree_put_pair(tree, start[1], start[2],
+                                                start_right, stop[1], stop[2],
+                                                end_right, 0))
+      shadow[id] = {start[1], start[2], start_right}
+      shadow[id + 1] = {stop[1], stop[2], end_right}
+      table.insert(marks, id)
+    end
+
+    local function put_batch(n)
+      local items = ffi.new("mtbatch_t[?]", n)
+      for k = 0,n-1 do
+        local start, stop = randpos(), randpos()
+        if not pos_leq(start, stop) then
+          start, stop = stop, start
+        end
+        items[k].start_row, items[k].start_col = start[1], start[2]
+        items[k].end_row = math.random(3) > 1 and stop[1] or -1
+        items[k].end_col = stop[2]
+        items[k].start_right = math.random(2) == 1
+        items[k].end_right = math.random(2) == 1
+      end
+      lib.marktree_put_batch(tree, items, n, 0)
+      for k = 0,n-1 do
+        local item = items[k]
+        local id = tonumber(item.id)
+        shadow[id] = {item.start_row, item.start_col, item.start_right}
+        if item.end_row >= 0 then
+          shadow[id + 1] = {item.end_row, item.end_col, item.end_right}
+        end
+        table.insert(marks, id)
+      end
+    end
+
+    local function delete(id)
+      local pos = lib.marktree_lookup(tree, id, iter)
+      eq(shadow[id][1], pos.row)
+      lib.marktree_del_itr(tree, iter, false)
+      shadow[id] = nil
+    end
+
+    local function check()
+      lib.marktree_check(tree)
+      shadoworder(tree, shadow, iter)
+      for _ = 1,3 do
+        local pos = randpos()
+        local expected = {}
+        for id, start in pairs(shadow) do
+          local stop = shadow[id + 1]
+          if is_pair(id) and not pos_leq(pos, start) and pos_leq(pos, stop) then
+            expected[id] = {{start[1], start[2]}, {stop[1], stop[2]}}
+          end
+        end
+        local found = {}
+        local result = ffi.new("mtpairs_t[1]")
+        lib.marktree_get_overlap(tree, pos[1], pos[2], result)
+        for k = 0,tonumber(result[0].size)-1 do
+          local pair = result[0].items[k]
+          found[tonumber(pair.id)] = {{pair.start.row, pair.start.col},
+                                      {pair["end"].row, pair["end"].col}}
+        end
+        lib.xfree(result[0].items)
+        eq(expected, found)
+      end
+    end
+
+    for step = 1,400 do
+      -- grow the tree first, then mostly shrink it to merge nodes
+      local r = math.random(10)
+      if r <= (step <= 200 and 6 or 2) then
+        if math.random(4) == 1 then
+          put_batch(math.random(10))
+        else
+          local start, stop = randpos(), randpos()
+          if not pos_leq(start, stop) then
+            start, stop = stop, start
+          end
+          put_pair(start, stop, math.random(2) == 1, math.random(2) == 1)
+        end
+      elseif r <= 8 then
+        dosplice(tree, shadow, randpos(),
+                 {math.random(0, 2), math.random(0, 5)},
+                 {math.random(0, 2), math.random(0, 5)})
+      elseif #marks > 0 then
+        local k = math.random(#marks)
+        local id = marks[k]
+        marks[k] = marks[#marks]
+        marks[#marks] = nil
+        delete(id)
+        if is_pair(id) then
+          delete(id + 1)
+        end
+      end
+      check()
+    end
+
+    while #marks > 0 do
+      local id = table.remove(marks)
+      delete(id)
+      if is_pair(id) then
+        delete(id + 1)
+      end
+      check()
+    end
+    eq({}, shadow)
+ end)
+end)
+
+describe('marktree benchmark', function()
+  if os.getenv('NVIM_TEST_BENCH') ~= '1' then
+    pending('set NVIM_TEST_BENCH=1 to measure marktree operations')
+    return
+  end
+
+  local n = 1000000
+
+  local function measure(name, f)
+    local start = os.clock()
+    f()
+    io.stderr:write(('\nmarktree %s: %.3f s'):format(name, os.clock() - start))
+  end
+
+  itp('puts, looks up, iterates and splices 1M marks', function()
+    local tree = ffi.new("MarkTree[1]") -- zero initialized by luajit
+    local iter = ffi.new("MarkTreeIter[1]")
+    local ids = {}
+
+    measure('put', function()
+      for i = 1,n do
+        ids[i] = lib.marktree_put(tree, (i*7919) % 100000, i % 80, i % 2 == 0,
+                                  0)
+      end
+    end)
+
+    measure('lookup', function()
+      for i = 1,n do
+        lib.marktree_lookup(tree, ids[i], iter)
+      end
+    end)
+
+    local count = 0
+    measure('iterate', function()
+      lib.marktree_itr_first(tree, iter)
+      repeat
+        count = count + 1
+      until not lib.marktree_itr_next(tree, iter)
+    end)
+    eq(n, count)
+
+    measure('splice', function()
+      for i = 1,100000 do
+        lib.marktree_splice(tree, (i*31) % 100000, i % 80, 0, 2, 0, 3)
+      end
+    end)
+    lib.marktree_check(tree)
+
+    measure('clear', function()
+      lib.marktree_clear(tree)
+    end)
+
+    local items = ffi.new("mtbatch_t[?]", n)
+    for k = 0,n-1 do
+      items[k].start_row, items[k].start_col = (k*7919) % 100000, k % 80
+      items[k].end_row = -1
+    end
+    measure('put_batch', function()
+      lib.marktree_put_batch(tree, items, n, 0)
+    end)
+    lib.marktree_check(tree)
+    lib.marktree_clear(tree)
+  end)
 end)
@@ -0,0 +1,108 @@
+local bit = require('bit')
+local helpers = require('test.unit.helpers')(after_each)
+local itp = helpers.gen_itp(it)
+
+local eq = helpers.eq
+local neq = helpers.neq
+local ffi = helpers.ffi
+local cimport = helpers.cimport
+local cppimport = helpers.cppimport
+local to_cstr = helpers.to_cstr
+local OK = helpers.OK
+
+local m = cimport('./src/nvim/memfile.h', './src/nvim/memory.h',
+                  './src/nvim/os/os.h')
+cppimport('fcntl.h')
+
+local BH_DIRTY = 1
+local MFS_ASYNC = 16
+
+local fname = 'Xtest-unit-memfile'
+
+describe('mf_sync()', function()
+  after_each(function()
+    os.remove(fname)
+  end)
+
+  itp('keeps the blocks dirty when a background write fails', function()
+    local mfp = m.mf_open(m.xstrdup(to_cstr(fname)), m.kO_RDWR + m.kO_CREAT)
+    eq(false, mfp == nil)
+    local hp = m.mf_new(mfp, false, 1)
+    eq(0, hp.bh_bnum)
+    ffi.copy(hp.bh_data, 'sometext')
+    m.mf_put(mfp, hp, true, false)
+
+    -- Writes to a read-only descriptor fail in the worker thread.
+    local fd = mfp.mf_fd
+    mfp.mf_fd = m.os_open(to_cstr(fname), m.kO_RDONLY, 0)
+    eq(OK, m.mf_sync(mfp, MFS_ASYNC))
+    m.mf_wait(mfp)
+    neq(0, bit.band(hp.bh_flags, BH_DIRTY))
+    eq(true, mfp.mf_dirty)
+    eq('sometext', ffi.string(hp.bh_data))
+
+    m.os_close(mfp.mf_fd)
+    mfp.mf_fd = fd
+    eq(OK, m.mf_sync(mfp, 0))
+    eq(0, bit.band(hp.bh_flags, BH_DIRTY))
+    m.mf_close(mfp, false)
+
+    local f = io.open(fname, 'rb')
+    eq('sometext', f:read(8))
+    f:close()
+  end)
+end)
+
+describe('mf_new()', function()
+  local BH_ARENA = 4
+
+  after_each(function()
+    os.remove(fname)
+  end)
+
+  itp('reuses the pages of a memfile without a swap file', function()
+    local mfp1 = m.mf_open(nil, 0)
+    local mfp2 = m.mf_open(nil, 0)
+    local hp1 = m.mf_new(mfp1, false, 1)
+    local hp2 = m.mf_new(mfp1, false, 1)
+    neq(0, bit.band(hp1.bh_flags, BH_ARENA))
+    local data = hp1.bh_data
+    m.mf_free(mfp1, hp1)
+    m.mf_free(mfp1, hp2)
+
+    -- Another memfile does not get the freed pages.
+    local hp = m.mf_new(mfp2, false, 1)
+    eq(false, hp.bh_data == data)
+    ffi.copy(hp.bh_data, 'sometext')
+    m.mf_put(mfp2, hp, true, false)
+
+    -- The freed page is used again, the other one is still free when the
+    -- memfile is closed.
+    hp1 = m.mf_new(mfp1, false, 1)
+    eq(true, hp1.bh_data == data)
+    m.mf_close(mfp1, false)
+
+    -- A block of more pages is allocated on its own.
+    hp = m.mf_new(mfp2, false, 2)
+    eq(0, bit.band(hp.bh_flags, BH_ARENA))
+    m.mf_free(mfp2, hp)
+    -- More blocks than fit in the first chunk of pages.
+    for _ = 1, 20 do
+      hp = m.mf_new(mfp2, false, 1)
+      neq(0, bit.band(hp.bh_flags, BH_ARENA))
+      m.mf_put(mfp2, hp, true, false)
+    end
+    hp = m.mf_get(mfp2, 0, 1)
+    eq('sometext', ffi.string(hp.bh_data))
+    m.mf_put(mfp2, hp, false, false)
+    m.mf_close(mfp2, false)
+  end)
+
+  itp('allocates the pages of a memfile with a swap file', function()
+    local mfp = m.mf_open(m.xstrdup(to_cstr(fname)), m.kO_RDWR + m.kO_CREAT)
+    local hp = m.mf_new(mfp, false, 1)
+    eq(0, bit.band(hp.bh_flags, BH_ARENA))
+    m.mf_put(mfp, hp, true, false)
+    m.mf_close(mfp, false)
+  end)
+end)
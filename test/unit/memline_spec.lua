@@ -0,0 +1,63 @@
+local helpers = require('test.unit.helpers')(after_each)
+local itp = helpers.gen_itp(it)
+
+local ffi = helpers.ffi
+local eq = helpers.eq
+local cimport = helpers.cimport
+local to_cstr = helpers.to_cstr
+local NULL = helpers.NULL
+local OK = helpers.OK
+
+local globals = cimport('./src/nvim/globals.h')
+local m = cimport('./src/nvim/memline.h')
+
+describe('ml_snapshot()', function()
+  local function snapshot_lines(snap)
+    local lines = {}
+    local len = ffi.new('colnr_T[1]')
+    for lnum = 1, snap.ms_line_count do
+      local line = m.ml_snapshot_line(snap, lnum, len)
+      table.insert(lines, ffi.string(line, len[0]))
+    end
+    return lines
+  end
+
+  local function take_snapshot()
+    local snap = m.ml_snapshot(globals.curbuf)
+    local lines = snapshot_lines(snap)
+    m.ml_snapshot_unref(snap)
+    return lines
+  end
+
+  itp('is taken again after each change', function()
+    eq(NULL, m.ml_snapshot(globals.curbuf))
+    eq(OK, m.ml_open(globals.curbuf))
+    eq({''}, take_snapshot())
+    eq(OK, m.ml_replace(1, to_cstr('a'), true))
+    eq(OK, m.ml_append(1, to_cstr('b'), 0, false))
+    eq(OK, m.ml_append(2, to_cstr('c'), 0, false))
+    eq({'a', 'b', 'c'}, take_snapshot())
+
+    -- Taken again without a change it is the same snapshot.
+    local snap = m.ml_snapshot(globals.curbuf)
+    local snap2 = m.ml_snapshot(globals.curbuf)
+    eq(true, snap == snap2)
+    m.ml_snapshot_unref(snap2)
+
+    eq(OK, m.ml_delete(2, false))
+    eq({'a', 'c'}, take_snapshot())
+    eq(OK, m.ml_append(1, to_cstr('x'), 0, false))
+    eq({'a', 'x', 'c'}, take_snapshot())
+    eq(OK, m.ml_replace(1, to_cstr('A'), true))
+    eq({'A', 'x', 'c'}, take_snapshot())
+    -- The line is changed in place.
+    local line = m.ml_get_buf(globals.curbuf, 3, true)
+    line[0] = string.byte('C')
+    eq({'A', 'x', 'C'}, take_snapshot())
+
+    -- A reference taken before the changes still has the old text.
+    eq({'a', 'b', 'c'}, snapshot_lines(snap))
+    m.ml_snapshot_unref(snap)
+    m.ml_close(globals.curbuf, false)
+  end)
+end)
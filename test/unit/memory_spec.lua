@@ -50,3 +50,24 @@ describe('xstrlcat()', function()
   end)
 
 end)
+
+describe('arena_alloc()', function()
+  itp('keeps small and big allocations until arena_mem_free()', function()
+    local arena = ffi.new('Arena[1]')
+    local strs = {}
+    for i = 1, 200 do
+      local str = ('%d'):format(i):rep(i % 7 == 0 and 1000 or 3)
+      strs[i] = {str, cimp.arena_memdupz(arena, str, #str)}
+    end
+    local ints = ffi.cast('int64_t *', cimp.arena_calloc(arena, 100, 8))
+    for i = 0, 99 do
+      eq(0, tonumber(ints[i]))
+    end
+    for _, s in ipairs(strs) do
+      eq(s[1], ffi.string(s[2]))
+    end
+    cimp.arena_mem_free(arena)
+    eq(true, arena[0].cur_blk == nil)
+    eq(0, tonumber(arena[0].size))
+  end)
+end)
@@ -0,0 +1,55 @@
+local helpers = require('test.unit.helpers')(after_each)
+local itp = helpers.gen_itp(it)
+
+local eq = helpers.eq
+local ffi = helpers.ffi
+local cimport = helpers.cimport
+local to_cstr = helpers.to_cstr
+
+local m = cimport('./src/nvim/sha256.h')
+
+-- FIPS 180-2 test vectors, the last two need more than one block.
+local vectors = {
+  {'abc',
+   'ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad'},
+  {'abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq',
+   '248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1'},
+  {string.rep('a', 1000000),
+   'cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0'},
+}
+
+-- Hash "msg", passed to sha256_update() in pieces of "chunk" bytes.
+local function sha256(msg, chunk)
+  local ctx = ffi.new('context_sha256_T')
+  local digest = ffi.new('char_u[32]')
+  local cstr = to_cstr(msg)
+  local buf = ffi.cast('const char_u *', cstr)
+  m.sha256_start(ctx)
+  for i = 0, #msg - 1, chunk do
+    m.sha256_update(ctx, buf + i, math.min(chunk, #msg - i))
+  end
+  m.sha256_finish(ctx, digest)
+  local hex = {}
+  for i = 0, 31 do
+    hex[#hex + 1] = string.format('%02x', digest[i])
+  end
+  return table.concat(hex)
+end
+
+describe('sha256', function()
+  for _, accel in ipairs({true, false}) do
+    -- The SHA extensions are only used when the CPU has them.
+    local name = accel and 'with the SHA extensions if available'
+                       or 'with the portable code'
+    itp('hashes the FIPS 180-2 test vectors ' .. name, function()
+      m.sha256_use_accel = accel
+      for _, vector in ipairs(vectors) do
+        local msg, expected = vector[1], vector[2]
+        for _, chunk in ipairs({#msg, 1, 55, 64, 1000}) do
+          eq(expected, sha256(msg, chunk))
+        end
+      end
+      eq(true, m.sha256_self_test())
+    end)
+  end
+end)